@@ -13,6 +13,7 @@
 
 #include "acpi.h"
 
+#include "idt/idt.h"
 #include "io/io.h"
 #include "memory/memory.h"
 #include "stdio/stdio.h"
@@ -37,6 +38,22 @@ uint32_t apicNInterruptOverrides;
 struct apicInterruptOverride
     *apicInterruptOverridePtrs[MAX_N_INTERRUPT_OVERRIDE_SUPPORTED];
 
+// NUMA topology (SRAT and SLIT): node ids are indices into
+// acpiNumaDomainIds, cores are indexed by local APIC id
+uint32_t acpiNNumaNodes;
+uint32_t acpiNumaDomainIds[MAX_N_NUMA_NODES];
+uint32_t acpiCoreNumaNodeIds[MAX_N_CORES_SUPPORTED];
+uint32_t acpiNNumaMemoryRanges;
+struct numaMemoryRange acpiNumaMemoryRanges[MAX_N_NUMA_MEMORY_RANGES];
+uint8_t acpiNumaDistances[MAX_N_NUMA_NODES][MAX_N_NUMA_NODES];
+
+// Cores whose local APIC is initialized (bit i: core id i)
+static uint64_t onlineCoreMask;
+
+// Local APIC timer counts per second (divide by 16), see
+// localApicTimerCalibrate
+static uint64_t localApicTimerFreq;
+
 // Initalize SMP:
 // send init and startup commands to all AP cores
 // wait until all AP cores have started
@@ -276,6 +293,115 @@ int parseDSDT(const struct acpiRSDTHeader *rsdtPtr, size_t fadtPtrSize) {
   }
 }
 
+// Return NUMA node id of SRAT proximity domain (a new node id is assigned to
+// a domain seen for the first time; domains beyond MAX_N_NUMA_NODES are merged
+// into node 0)
+static uint32_t getNumaNodeId(uint32_t proximityDomain) {
+  for (uint32_t i = 0; i < acpiNNumaNodes; i++) {
+    if (acpiNumaDomainIds[i] == proximityDomain) {
+      return i;
+    }
+  }
+  if (acpiNNumaNodes == MAX_N_NUMA_NODES) {
+    printk(
+        "WARNING: SRAT proximity domain %u exceeds number of NUMA nodes "
+        "supported (merged into node 0)\n",
+        proximityDomain);
+    return 0;
+  }
+  acpiNumaDomainIds[acpiNNumaNodes] = proximityDomain;
+  return acpiNNumaNodes++;
+}
+
+// Parse System Resource Affinity Table: NUMA node of each core and memory
+// range
+static int parseSRAT(struct acpiSRAT *sratPtr) {
+  if (checksum((uint8_t *)sratPtr, sratPtr->header.length)) {
+    printk("ERROR: ACPI SRAT checksum not zero\n");
+    return -1;
+  }
+  uint8_t *ptr8 = ((uint8_t *)sratPtr) + sizeof(struct acpiSRAT);
+  uint8_t *ptr8End = ((uint8_t *)sratPtr) + sratPtr->header.length;
+  while (ptr8 < ptr8End) {
+    struct apicHeader *header = (struct apicHeader *)ptr8;
+    if (header->length == 0) {
+      printk("ERROR: ACPI SRAT struct of length zero\n");
+      return -1;
+    }
+    if (header->type == SRAT_TYPE_PROCESSOR_AFFINITY) {
+      struct sratProcessorAffinity *affinityPtr =
+          (struct sratProcessorAffinity *)ptr8;
+      uint32_t proximityDomain =
+          affinityPtr->proximityDomainLow |
+          ((uint32_t)affinityPtr->proximityDomainHigh[0] << 8) |
+          ((uint32_t)affinityPtr->proximityDomainHigh[1] << 16) |
+          ((uint32_t)affinityPtr->proximityDomainHigh[2] << 24);
+      if ((affinityPtr->flags & SRAT_AFFINITY_ENABLED) &&
+          affinityPtr->apicId < MAX_N_CORES_SUPPORTED) {
+        acpiCoreNumaNodeIds[affinityPtr->apicId] =
+            getNumaNodeId(proximityDomain);
+      }
+    } else if (header->type == SRAT_TYPE_X2APIC_AFFINITY) {
+      struct sratX2ApicAffinity *affinityPtr =
+          (struct sratX2ApicAffinity *)ptr8;
+      if ((affinityPtr->flags & SRAT_AFFINITY_ENABLED) &&
+          affinityPtr->x2ApicId < MAX_N_CORES_SUPPORTED) {
+        acpiCoreNumaNodeIds[affinityPtr->x2ApicId] =
+            getNumaNodeId(affinityPtr->proximityDomain);
+      }
+    } else if (header->type == SRAT_TYPE_MEMORY_AFFINITY) {
+      struct sratMemoryAffinity *affinityPtr =
+          (struct sratMemoryAffinity *)ptr8;
+      if ((affinityPtr->flags & SRAT_AFFINITY_ENABLED) &&
+          affinityPtr->length > 0) {
+        if (acpiNNumaMemoryRanges < MAX_N_NUMA_MEMORY_RANGES) {
+          struct numaMemoryRange *range =
+              &acpiNumaMemoryRanges[acpiNNumaMemoryRanges++];
+          range->baseAddr = affinityPtr->baseAddr;
+          range->endAddr = affinityPtr->baseAddr + affinityPtr->length;
+          range->nodeId = getNumaNodeId(affinityPtr->proximityDomain);
+          printk("SRAT memory range %x - %x: NUMA node %u\n",
+                 range->baseAddr, range->endAddr, range->nodeId);
+        } else {
+          printk(
+              "WARNING: Found SRAT memory range but exceeded number of "
+              "memory ranges supported\n");
+        }
+      }
+    }
+    ptr8 += header->length;
+  }
+  printk("Finished parsing SRAT: %u NUMA nodes\n", acpiNNumaNodes);
+  return 0;
+}
+
+// Set NUMA node distances from System Locality Information Table (NULL: no
+// SLIT, all remote nodes are at NUMA_REMOTE_DISTANCE)
+static void initNumaDistances(struct acpiSLIT *slitPtr) {
+  if (slitPtr != NULL &&
+      checksum((uint8_t *)slitPtr, slitPtr->header.length)) {
+    printk("WARNING: ACPI SLIT checksum not zero (ignored)\n");
+    slitPtr = NULL;
+  }
+  uint8_t *distancePtr = (uint8_t *)slitPtr + sizeof(struct acpiSLIT);
+  for (uint32_t i = 0; i < MAX_N_NUMA_NODES; i++) {
+    for (uint32_t j = 0; j < MAX_N_NUMA_NODES; j++) {
+      acpiNumaDistances[i][j] =
+          i == j ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+      if (slitPtr != NULL && i < acpiNNumaNodes && j < acpiNNumaNodes &&
+          acpiNumaDomainIds[i] < slitPtr->nLocalities &&
+          acpiNumaDomainIds[j] < slitPtr->nLocalities) {
+        acpiNumaDistances[i][j] =
+            distancePtr[acpiNumaDomainIds[i] * slitPtr->nLocalities +
+                        acpiNumaDomainIds[j]];
+      }
+    }
+  }
+  if (slitPtr != NULL) {
+    printk("Finished parsing SLIT: %u localities\n", slitPtr->nLocalities);
+  }
+}
+
 // Root System Description Pointer (RSDP) found: parse ACPI tables
 int parseAcpiTables(const uint8_t *ptr) {
   printk("ACPI RSDP found! Verifying checksum...\n");
@@ -348,6 +474,8 @@ int parseAcpiTables(const uint8_t *ptr) {
 
   uint8_t *ptr8End = ((uint8_t *)(rsdtPtr)) + (rsdtPtr->length);
 
+  // SLIT distances are indexed by proximity domain: parsed after the SRAT
+  struct acpiSLIT *slitPtr = NULL;
   while (ptr8 != ptr8End) {
     // remember that RSDT contains 32-bit addresses of other DTs after the
     // header, so cast 32-bit value/address pointed to by ptr32 to struct
@@ -469,9 +597,21 @@ int parseAcpiTables(const uint8_t *ptr) {
       }
 
       printk("Finished parsing APIC MADT!\n");
+    } else if (signature == SRAT_SIG) {
+      printk("Found ACPI SRAT table!\n");
+      if (parseSRAT((struct acpiSRAT *)currRsdtPtr)) {
+        return -1;
+      }
+    } else if (signature == SLIT_SIG) {
+      printk("Found ACPI SLIT table!\n");
+      slitPtr = (struct acpiSLIT *)currRsdtPtr;
     }
     ptr8 += fadtPtrSize;
   }
+  if (acpiNNumaNodes == 0) {  // no SRAT: single node
+    acpiNNumaNodes = 1;
+  }
+  initNumaDistances(slitPtr);
 
   printk("Finished search for ACPI FADT and APIC tables!\n");
   return 0;
@@ -621,6 +761,24 @@ void localApicSendStartupCommand(uint32_t localApicId, uint32_t vector) {
          ICR_SEND_PENDING)
     ;
 }
+// Send inter-processor interrupt vector to local APIC identified by
+// localApicId: wait for the previous interrupt command to be sent, the
+// delivery to the destination core is not waited for
+void localApicSendIPI(uint32_t localApicId, uint8_t vector) {
+  while ((*(volatile uint32_t *)(gLocalApicAddress + LAPIC_ICRLO_REG)) &
+         ICR_SEND_PENDING) {
+    __asm volatile("pause" ::: "memory");
+  }
+  *(volatile uint32_t *)(gLocalApicAddress + LAPIC_ICRHI_REG) =
+      localApicId << ICR_DESTINATION_BIT_POS;
+  *(volatile uint32_t *)(gLocalApicAddress + LAPIC_ICRLO_REG) =
+      vector | ICR_FIXED | ICR_PHYSICAL | ICR_ASSERT | ICR_EDGE |
+      ICR_NO_SHORTHAND;
+}
+// Returns mask of cores whose local APIC is initialized
+uint64_t getOnlineCoreMask() {
+  return __atomic_load_n(&onlineCoreMask, __ATOMIC_SEQ_CST);
+}
 void localAPICInit() {
   // Clear task priority register
   *((volatile uint32_t *)(gLocalApicAddress + LAPIC_TP_REG)) = 0x0;
@@ -634,5 +792,67 @@ void localAPICInit() {
   currVal |= 0x1FF;
   *((volatile uint32_t *)(gLocalApicAddress + LAPIC_SPURIOUS_INT_VEC_REG)) =
       currVal;
+  // the core can receive inter-processor interrupts (see ipi.c)
+  __atomic_or_fetch(&onlineCoreMask, 1ULL << getLocalApicId(),
+                    __ATOMIC_SEQ_CST);
+}
+
+// Measure the local APIC timer frequency: count down from the largest initial
+// count (interrupt masked, one-shot mode) for LAPIC_TIMER_CALIBRATION_USECS
+// measured with the ACPI PM timer
+void localApicTimerCalibrate() {
+  *((volatile uint32_t *)(gLocalApicAddress + LAPIC_TIMER_DIVIDE_CONFIG_REG)) =
+      LAPIC_TIMER_DIVIDE_BY_16;
+  *((volatile uint32_t *)(gLocalApicAddress + LAPIC_LVT_TIMER_REG)) =
+      LAPIC_LVT_MASKED | TIMER_INTERRUPT;
+  *((volatile uint32_t *)(gLocalApicAddress + LAPIC_TIMER_INITIAL_COUNT_REG)) =
+      0xFFFFFFFF;
+  acpiBusySleepUsecs(LAPIC_TIMER_CALIBRATION_USECS);
+  uint32_t currentCount = *(
+      (volatile uint32_t *)(gLocalApicAddress + LAPIC_TIMER_CURRENT_COUNT_REG));
+  // stop the timer
+  *((volatile uint32_t *)(gLocalApicAddress + LAPIC_TIMER_INITIAL_COUNT_REG)) =
+      0;
+  localApicTimerFreq = ((uint64_t)(0xFFFFFFFF - currentCount)) * 1000000 /
+                       LAPIC_TIMER_CALIBRATION_USECS;
+  printk("Local APIC timer frequency: %u Hz\n", localApicTimerFreq);
+}
+
+// Busy wait until the ACPI PM timer count (shared by all cores) modulo period
+// reaches phase (PM timer ticks)
+static void acpiWaitForTimerPhase(uint64_t period, uint64_t phase) {
+  uint64_t currentPhase = acpiGetTimerValue() % period;
+  uint64_t waitTicks = (phase + period - currentPhase) % period;
+  acpiBusySleepUsecs(waitTicks * 1000000 / ACPI_TIMER_FREQ);
+}
+
+// Start the local APIC timer of the calling core in periodic mode
+// The local APIC timers of all cores run at the same frequency: starting core
+// i at phase i / acpiNCores of a period of the PM timer keeps the ticks of the
+// cores apart
+void localApicTimerStart(uint32_t ticksPerSecond) {
+  if (localApicTimerFreq == 0 || ticksPerSecond == 0) {
+    printk("ERROR localApicTimerStart: timer is not calibrated\n");
+    return;
+  }
+  uint64_t initialCount = localApicTimerFreq / ticksPerSecond;
+  if (initialCount == 0) {
+    initialCount = 1;
+  } else if (initialCount > 0xFFFFFFFF) {
+    initialCount = 0xFFFFFFFF;
+  }
+  uint64_t pmTimerPeriod = ACPI_TIMER_FREQ / ticksPerSecond;
+  if (pmTimerPeriod == 0) {
+    pmTimerPeriod = 1;
+  }
+  uint64_t coreIndex = getLocalApicId() % acpiNCores;
+
+  *((volatile uint32_t *)(gLocalApicAddress + LAPIC_TIMER_DIVIDE_CONFIG_REG)) =
+      LAPIC_TIMER_DIVIDE_BY_16;
+  *((volatile uint32_t *)(gLocalApicAddress + LAPIC_LVT_TIMER_REG)) =
+      LAPIC_TIMER_PERIODIC | TIMER_INTERRUPT;
+  acpiWaitForTimerPhase(pmTimerPeriod, pmTimerPeriod * coreIndex / acpiNCores);
+  *((volatile uint32_t *)(gLocalApicAddress + LAPIC_TIMER_INITIAL_COUNT_REG)) =
+      (uint32_t)initialCount;
 }
 /**** END LOCAL APIC ***/
@@ -32,6 +32,10 @@
 #define MAX_N_IO_APICS_SUPPORTED 1
 // Maximum number of INTERRUPT OVERRIDES supported
 #define MAX_N_INTERRUPT_OVERRIDE_SUPPORTED 16
+// Maximum number of NUMA nodes (SRAT proximity domains) supported
+#define MAX_N_NUMA_NODES 8
+// Maximum number of SRAT memory ranges supported
+#define MAX_N_NUMA_MEMORY_RANGES 32
 
 /**** Local APIC defiintions ****/
 // Register offsets
@@ -43,6 +47,23 @@
 #define LAPIC_ID_REG 0x20      // Local APIC id register
 #define LAPIC_LD_REG 0xD0      // Local Destination register
 #define LAPIC_TP_REG 0x80      // Task Priority Register (TPR)
+#define LAPIC_LVT_TIMER_REG 0x320          // Local Vector Table timer entry
+#define LAPIC_TIMER_INITIAL_COUNT_REG 0x380  // Timer initial count register
+#define LAPIC_TIMER_CURRENT_COUNT_REG 0x390  // Timer current count register
+#define LAPIC_TIMER_DIVIDE_CONFIG_REG 0x3E0  // Timer divide configuration
+
+/* Local APIC timer */
+// LVT timer entry: bit 16 masks the interrupt, bit 17 selects periodic mode
+// (one-shot if clear)
+#define LAPIC_LVT_MASKED 0x00010000
+#define LAPIC_TIMER_PERIODIC 0x00020000
+// Divide configuration 0b0011: the timer counts at bus clock / 16
+#define LAPIC_TIMER_DIVIDE_BY_16 0x3
+// Default timer interrupts (scheduler ticks) per second of each core
+// (defined in boot/defs.asm as well)
+#define LAPIC_TIMER_HZ 100
+// Duration of the calibration of the timer against the ACPI PM timer
+#define LAPIC_TIMER_CALIBRATION_USECS 10000
 
 /* Interrupt command  */
 // Bit position/shift of destination field
@@ -59,6 +80,7 @@
 #define ICR_IDLE 0x00000000
 #define ICR_SEND_PENDING 0x00001000
 // Delivery mode
+#define ICR_FIXED 0x00000000
 #define ICR_INIT 0x00000500
 #define ICR_STARTUP 0x00000600
 /**** END Local APIC definitions ****/
@@ -99,6 +121,20 @@ uint32_t getLocalApicId();
 void localApicSendInitCommand(uint32_t localApicId);
 // Send statup command to local APIC indetified by localApicId
 void localApicSendStartupCommand(uint32_t localApicId, uint32_t vector);
+// Send inter-processor interrupt vector to local APIC identified by
+// localApicId (fixed delivery mode)
+// Interrupts must be disabled
+void localApicSendIPI(uint32_t localApicId, uint8_t vector);
+// Returns mask of cores whose local APIC is initialized (bit i: core id i)
+uint64_t getOnlineCoreMask();
+// Measure the local APIC timer frequency against the ACPI PM timer (called by
+// the BP before the APs start: all cores share the bus clock)
+void localApicTimerCalibrate();
+// Start the local APIC timer of the calling core in periodic mode with
+// ticksPerSecond timer interrupts per second; the ticks of core i are offset
+// by i / acpiNCores of a period so that the cores do not all take their tick
+// (and the scheduler locks) at the same time
+void localApicTimerStart(uint32_t ticksPerSecond);
 
 // ACPI signature: this value denotes the start of the memory area containing
 // the ACPI tables
@@ -113,6 +149,12 @@ void localApicSendStartupCommand(uint32_t localApicId, uint32_t vector);
 // DSDT signature
 #define DSDT_SIG 0x54445344  // 'TDSD'
 
+// SRAT (System Resource Affinity Table) signature
+#define SRAT_SIG 0x54415253  // 'TARS'
+
+// SLIT (System Locality Information Table) signature
+#define SLIT_SIG 0x54494C53  // 'TILS'
+
 // S5 object signature
 #define S5_SIG 0x5F35535F  // '_5S_'
 
@@ -287,4 +329,72 @@ struct apicInterruptOverride {
   uint32_t interrupt;
   uint16_t flags;
 } __attribute__((packed));
+
+// **** NUMA: SRAT AND SLIT **** //
+// The SRAT assigns cores (local APIC ids) and physical memory ranges to
+// proximity domains; the SLIT gives the relative memory access distance
+// between proximity domains (10: local)
+// Proximity domains are numbered 0 to acpiNNumaNodes - 1 (NUMA node ids) in
+// order of appearance in the SRAT: without SRAT all cores and memory belong to
+// node 0
+
+#define NUMA_LOCAL_DISTANCE 10
+#define NUMA_REMOTE_DISTANCE 20  // used if there is no SLIT
+
+// SRAT affinity struct type (struct apicHeader type field)
+#define SRAT_TYPE_PROCESSOR_AFFINITY 0
+#define SRAT_TYPE_MEMORY_AFFINITY 1
+#define SRAT_TYPE_X2APIC_AFFINITY 2
+
+#define SRAT_AFFINITY_ENABLED 0x1  // flags bit 0
+
+struct acpiSRAT {
+  struct acpiRSDTHeader header;
+  uint32_t reserved1;
+  uint64_t reserved2;
+} __attribute__((packed));
+
+struct sratProcessorAffinity {
+  struct apicHeader header;
+  uint8_t proximityDomainLow;  // bits 0-7
+  uint8_t apicId;
+  uint32_t flags;
+  uint8_t localSapicEid;
+  uint8_t proximityDomainHigh[3];  // bits 8-31
+  uint32_t clockDomain;
+} __attribute__((packed));
+
+struct sratMemoryAffinity {
+  struct apicHeader header;
+  uint32_t proximityDomain;
+  uint16_t reserved1;
+  uint64_t baseAddr;
+  uint64_t length;
+  uint32_t reserved2;
+  uint32_t flags;
+  uint64_t reserved3;
+} __attribute__((packed));
+
+struct sratX2ApicAffinity {
+  struct apicHeader header;
+  uint16_t reserved1;
+  uint32_t proximityDomain;
+  uint32_t x2ApicId;
+  uint32_t flags;
+  uint32_t clockDomain;
+  uint32_t reserved2;
+} __attribute__((packed));
+
+// followed by nLocalities * nLocalities distance bytes (row: from locality)
+struct acpiSLIT {
+  struct acpiRSDTHeader header;
+  uint64_t nLocalities;
+} __attribute__((packed));
+
+// Physical memory range [baseAddr, endAddr[ of NUMA node nodeId
+struct numaMemoryRange {
+  uint64_t baseAddr;
+  uint64_t endAddr;
+  uint32_t nodeId;
+};
 #endif
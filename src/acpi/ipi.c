@@ -0,0 +1,115 @@
+/*
+ * Copyright 2024 Andrea Miele
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ipi.h"
+
+#include "acpi.h"         // localApicSendIPI, MAX_N_CORES_SUPPORTED
+#include "kernel.h"       // Kernel error codes
+#include "lib/lib.h"      // saveFlagsAndCli
+#include "stdio/stdio.h"  // printk
+
+// Assembly lock and unlock implementations for mutex
+extern void spinLock(volatile uint8_t *lock);
+extern void spinUnlock(volatile uint8_t *lock);
+
+// returns core id
+extern uint64_t getCoreId();  // ../kernel.asm
+
+// Requests queued for a core: each core has at most one request in flight
+// (smpCallFunction waits for completion), so a queue holds at most one request
+// per other core
+struct callFunctionQueue {
+  volatile uint8_t lock;
+  uint64_t nRequests;
+  struct callFunctionRequest *requestArray[MAX_N_CORES_SUPPORTED];
+} __attribute__((aligned(64)));  // one cache line boundary per core
+
+// Static variables, zero-initialized
+
+static struct callFunctionQueue callFunctionQueueArray[MAX_N_CORES_SUPPORTED];
+
+// Run and dequeue the requests queued for core coreId
+// Interrupts must be disabled
+static void runQueuedRequests(uint64_t coreId) {
+  struct callFunctionQueue *queue = &callFunctionQueueArray[coreId];
+  struct callFunctionRequest *requestArray[MAX_N_CORES_SUPPORTED];
+  spinLock(&queue->lock);
+  uint64_t nRequests = queue->nRequests;
+  for (uint64_t i = 0; i < nRequests; i++) {
+    requestArray[i] = queue->requestArray[i];
+  }
+  queue->nRequests = 0;
+  spinUnlock(&queue->lock);
+
+  for (uint64_t i = 0; i < nRequests; i++) {
+    struct callFunctionRequest *request = requestArray[i];
+    request->function(request->arg);
+    // the request lives on the caller stack: do not touch it after this
+    __atomic_sub_fetch(&request->nPending, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+// Queue request on core coreId
+static void queueRequest(uint64_t coreId,
+                         struct callFunctionRequest *request) {
+  struct callFunctionQueue *queue = &callFunctionQueueArray[coreId];
+  spinLock(&queue->lock);
+  if (queue->nRequests == MAX_N_CORES_SUPPORTED) {
+    spinUnlock(&queue->lock);
+    printk("ERROR queueRequest: call function queue of core %u is full\n",
+           coreId);
+    KERNEL_PANIC(ERR_IPI);
+  }
+  queue->requestArray[queue->nRequests++] = request;
+  spinUnlock(&queue->lock);
+}
+
+// Run function(arg) on the cores in coreMask and return when all of them have
+// run it
+void smpCallFunction(uint64_t coreMask, void (*function)(void *arg),
+                     void *arg) {
+  uint64_t flags = saveFlagsAndCli();
+  uint64_t coreId = getCoreId();
+  uint64_t targetMask = coreMask & getOnlineCoreMask() & ~(1ULL << coreId);
+  struct callFunctionRequest request;
+  request.function = function;
+  request.arg = arg;
+  request.nPending = 0;
+  for (uint64_t i = 0; i < MAX_N_CORES_SUPPORTED; i++) {
+    if (targetMask & (1ULL << i)) {
+      request.nPending++;
+    }
+  }
+
+  // one IPI per target core
+  for (uint64_t i = 0; i < MAX_N_CORES_SUPPORTED; i++) {
+    if (targetMask & (1ULL << i)) {
+      queueRequest(i, &request);
+      localApicSendIPI(i, CALL_FUNCTION_INTERRUPT);
+    }
+  }
+  if (coreMask & (1ULL << coreId)) {
+    function(arg);
+  }
+  while (__atomic_load_n(&request.nPending, __ATOMIC_SEQ_CST) != 0) {
+    runQueuedRequests(coreId);
+    __asm volatile("pause" ::: "memory");
+  }
+  restoreFlags(flags);
+}
+
+// CALL_FUNCTION_INTERRUPT handler: run the requests queued for the running
+// core
+void callFunctionInterruptHandler(struct interruptFrame *framePtr) {
+  runQueuedRequests(framePtr->coreId);
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright 2024 Andrea Miele
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _IPI_H_
+#define _IPI_H_
+
+#include <stdint.h>
+
+#include "idt/idt.h"  // struct interruptFrame
+
+///*** CROSS-CORE FUNCTION CALLS ***///
+// smpCallFunction runs a function on a set of cores: a request is queued on
+// each target core and a CALL_FUNCTION_INTERRUPT inter-processor interrupt
+// (IPI) is sent to it through the local APIC; the target core runs the
+// queued requests in its interrupt handler and the caller waits until all
+// target cores have run the function
+// While waiting, the caller runs the requests queued for its own core, so two
+// cores calling each other do not deadlock
+// Functions run with interrupts disabled in interrupt context: they must not
+// take locks, sleep or call smpCallFunction
+
+struct callFunctionRequest {
+  void (*function)(void *arg);
+  void *arg;
+  uint64_t nPending;  // target cores that have not run function yet
+};
+
+// Run function(arg) on the cores in coreMask (bit i: core id i) and return
+// when all of them have run it; offline cores are skipped and the running core
+// calls function directly if it is in coreMask
+// Must not be called while holding a lock other cores can spin on with
+// interrupts disabled (e.g., processLock): they would not take the IPI
+void smpCallFunction(uint64_t coreMask, void (*function)(void *arg),
+                     void *arg);
+// CALL_FUNCTION_INTERRUPT handler: run the requests queued for the running
+// core
+void callFunctionInterruptHandler(struct interruptFrame *framePtr);
+#endif
@@ -31,6 +31,7 @@ gNMemoryRegions equ 0x6010 			; address at which the E820 Memory Region count is
 LOCAL_APIC_EOI_REG EQU 0xb0			; Local APIC end-of-interrupt command
 LAPIC_ID_REG equ 0x20			        ; Local APIC id register offset
 LAPIC_SPURIOUS_INT_VEC_REG equ 0xF0             ; Local APIC spurious interrupt register offset
+LAPIC_TIMER_HZ equ 100				; Local APIC timer interrupts per second (see acpi/acpi.h)
 
 LONG_MODE_CODE_SEG equ 0x08			; first 8-byte GDT descriptor after null one
 LONG_MODE_DATA_SEG equ 0x10			; second 8-byte GDT descriptor after null one
@@ -39,7 +40,7 @@ LONG_MODE_USER_CODE_SEG equ 0x28		; fifth 8-byte GDT descriptor after null one
 LONG_MODE_FIRST_TSS equ 0x30		        ; sixth 8-byte GDT descriptor after null one
 DPL_RING3 equ 0x3			        ; ring3: 3
 
-N_SYSCALLS equ 13				; number of supported system calls
+N_SYSCALLS equ 26				; number of supported system calls
 
 BP_STACK_POINTER equ 0xffff800000200000         ; higher ring0 stack pointer address: Bootstrap processor ring0 stack pointer
 
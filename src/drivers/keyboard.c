@@ -17,7 +17,7 @@
 
 #include "../acpi/acpi.h"        // MAX_N_CORES_SUPPORTED
 #include "../io/io.h"            // inb
-#include "../process/process.h"  // sleep, wakeUp
+#include "../process/process.h"  // sleepOnWaitQueue, wakeUpAll
 #include "../stdio/stdio.h"      // printk
 
 // Currently the keyboard driver only supports
@@ -67,6 +67,9 @@ extern uint64_t syscallRunningArray[MAX_N_CORES_SUPPORTED];
 
 static volatile uint8_t keyboardQueueLock;
 
+// Processes waiting for a character to be added to the keyboard queue
+struct waitQueue keyboardWaitQueue = WAIT_QUEUE_INITIALIZER(KEYBOARD_EVENT);
+
 static int isKeyboardQueueFull() {
   return ((queue.back - queue.front) % (KEYBOARD_BUFFER_SIZE + 1) ==
           KEYBOARD_BUFFER_SIZE);
@@ -94,12 +97,12 @@ char readFromKeyboardQueue() {
   spinLock(&keyboardQueueLock);
   while (isKeyboardQueueEmpty()) {  // if keyboard is empty sleep until a
                                     // character is added to the queue
-    spinUnlock(&keyboardQueueLock);
     // before calling functions that call schedule, make sure to clear
     // syscallRunningArray for current core as syscall will not be running after
     // schedule is called
     syscallRunningArray[getCoreId()] = 0;
-    sleep(KEYBOARD_EVENT);
+    // releases keyboardQueueLock
+    sleepOnWaitQueue(&keyboardWaitQueue, &keyboardQueueLock);
     // syscall is running now
     syscallRunningArray[getCoreId()] = 1;
     spinLock(&keyboardQueueLock);
@@ -195,7 +198,7 @@ void keyboardISR() {
   char c = readCharFromKeyboard();
   if (c > 0) {
     writeToKeyboardQueue(c);
-    // wake up process waiting for keyboard
-    wakeUp(KEYBOARD_EVENT);
+    // wake up processes waiting for keyboard
+    wakeUpAll(&keyboardWaitQueue);
   }
 }
@@ -17,6 +17,7 @@
 #include "../drivers/disk.h"  //readSector
 #include "../kernel.h"        // KERNEL_PANIC
 #include "../lib/lib.h"       // memcpy
+#include "../memory/slab.h"   // kmemCacheCreate, kmemCacheAlloc
 #include "../stdio/stdio.h"   // printk
 
 // Minimal FAT16 implementation
@@ -43,12 +44,25 @@ static uint16_t fat16Table[MAX_SUPPORTED_FAT16_TABLE_SECTORS *
 
 static struct fileControlBlock
     fileControlBlockArray[MAX_SUPPORTED_FAT16_ROOT_DIR_ENTRIES];
-static struct fileDescriptor
-    fileDescriptorArray[MAX_SUPPORTED_FAT16_ROOT_DIR_ENTRIES];
+// File descriptors are allocated from an object cache
+static struct kmemCache *fileDescriptorCache;
 
 volatile uint8_t
     fat16Lock;  // lock for SMP exclusive access to critical sections
 
+// File descriptor object constructor: zero out descriptor
+static void fileDescriptorConstructor(void *fileDesc) {
+  memset(fileDesc, 0, sizeof(struct fileDescriptor));
+}
+
+// Create object cache for file descriptors
+void initFileDescriptorCache() {
+  fileDescriptorCache =
+      kmemCacheCreate("fileDescriptor", sizeof(struct fileDescriptor),
+                      fileDescriptorConstructor);
+  fileDescriptorCache->pageTag = PAGE_TAG_FS_BUFFER;
+}
+
 // Get BIOS Parameter block (BPB) of primary master FAT16 disk
 static struct biosParameterBlock *loadFAT16BPB() {
   struct biosParameterBlock *bpbPtr = NULL;
@@ -246,38 +260,18 @@ static int64_t readClusterData(uint16_t clusterIndex, size_t size,
     }
     readSector(sectorIndex, bpbPtr->nSectorsPerCluster, sectorBuffer);
 
-    if (bytesRead + size - bytesRead > size) {
-      printk("ERROR readClusterData: total bytes read larger than file size\n");
-      return -1;
-    }
     if (clusterIndex > MAX_SUPPORTED_FAT16_TABLE_SECTORS * SECTOR_SIZE) {
       printk("ERROR readClusterData: cluster index too large\n");
       return -1;
     }
     clusterIndex = fatTablePtr[clusterIndex];  // get index of next cluster
 
-    if (clusterIndex >=
-        FAT16_LAST_CLUSTER_VALUE) {  // if we just read the last cluster, break
-
-      if (bytesRead + size - bytesRead > size) {
-        printk(
-            "ERROR readClusterData: total bytes read larger than file size\n");
-        return -1;
-      }
-
-      memcpy(fileBuffer, sectorBuffer, size - bytesRead);
-      bytesRead += size - bytesRead;
-
-      break;
-    }
-    if (bytesRead + clusterSize > size) {
-      printk("ERROR readClusterData: total bytes read larger than file size\n");
-      return -1;
-    }
-
-    memcpy(fileBuffer, sectorBuffer, clusterSize);
-    fileBuffer += clusterSize;
-    bytesRead += clusterSize;
+    // the last cluster read may be partial (end of file or of requested size)
+    uint32_t clusterReadSize =
+        (size - bytesRead) < clusterSize ? (size - bytesRead) : clusterSize;
+    memcpy(fileBuffer, sectorBuffer, clusterReadSize);
+    fileBuffer += clusterReadSize;
+    bytesRead += clusterReadSize;
   }
 
   return bytesRead;
@@ -309,10 +303,39 @@ int64_t loadFile(char *name, uint8_t *fileBuffer) {
   return status;
 }
 
+// Look up file given input file name
+int64_t lookupFile(char *name, uint16_t *clusterIndex, uint32_t *fileSize) {
+  spinLock(&fat16Lock);
+  struct biosParameterBlock *bpbPtr = loadFAT16BPB();
+  loadFAT16Table(bpbPtr);
+  struct fat16DirEntry *rootDirEntryPtr = loadFAT16rootDirPtr(bpbPtr);
+
+  int64_t entryIndex = findFileEntry(name, bpbPtr, rootDirEntryPtr);
+  if (entryIndex == -1) {
+    printk("ERROR lookupFile: file not found!\n");
+    spinUnlock(&fat16Lock);
+    return -1;
+  }
+  *clusterIndex = rootDirEntryPtr[entryIndex].startingClusterIndex;
+  *fileSize = rootDirEntryPtr[entryIndex].fileSize;
+  spinUnlock(&fat16Lock);
+  return 0;
+}
+
+// Read size bytes at position of the file whose first cluster is clusterIndex
+int64_t readFileData(uint16_t clusterIndex, uint32_t position,
+                     uint8_t *buffer, size_t size) {
+  spinLock(&fat16Lock);
+  // BPB and FAT16 table are loaded by lookupFile and loadFile
+  int64_t bytesRead =
+      readClusterData(clusterIndex, size, position, buffer, &bpb, fat16Table);
+  spinUnlock(&fat16Lock);
+  return bytesRead;
+}
+
 // Open file given input file name
 int64_t openFile(struct process *proc, char *name) {
   int64_t procFileDescIndex = -1;
-  int64_t fileDescIndex = -1;
 
   spinLock(&fat16Lock);
   struct biosParameterBlock *bpbPtr = loadFAT16BPB();
@@ -332,20 +355,6 @@ int64_t openFile(struct process *proc, char *name) {
     return -1;
   }
 
-  // find unused file descriptor in file descriptor table
-  for (int i = 0; i < MAX_SUPPORTED_FAT16_ROOT_DIR_ENTRIES; i++) {
-    if (fileDescriptorArray[i].fileControlBlockPtr == NULL) {
-      fileDescIndex = i;
-      break;
-    }
-  }
-
-  if (fileDescIndex == -1) {
-    printk("ERROR openFile: no file descriptor available!\n");
-    spinUnlock(&fat16Lock);
-    return -1;
-  }
-
   // search file in root directory
 
   int64_t entryIndex = findFileEntry(name, bpbPtr, rootDirEntryPtr);
@@ -355,6 +364,16 @@ int64_t openFile(struct process *proc, char *name) {
     return -1;
   }
 
+  // allocate file descriptor (zeroed by constructor or closeFile)
+  int64_t errCode = 0;
+  struct fileDescriptor *fileDescPtr =
+      kmemCacheAlloc(fileDescriptorCache, &errCode);
+  if (fileDescPtr == NULL) {
+    printk("ERROR openFile: no file descriptor available!\n");
+    spinUnlock(&fat16Lock);
+    return -1;
+  }
+
   // if file is not open already, populate File Control Block
   if (fileControlBlockArray[entryIndex].referenceCount == 0) {
     fileControlBlockArray[entryIndex].fat16ClusterIndex =
@@ -370,12 +389,9 @@ int64_t openFile(struct process *proc, char *name) {
   // increase reference count
   fileControlBlockArray[entryIndex].referenceCount++;
 
-  memset(&fileDescriptorArray[fileDescIndex], 0, sizeof(struct fileDescriptor));
-  fileDescriptorArray[fileDescIndex].fileControlBlockPtr =
-      &fileControlBlockArray[entryIndex];
-  fileDescriptorArray[fileDescIndex].nReferencingProcesses = 1;
-  proc->fileDescPtrArray[procFileDescIndex] =
-      &fileDescriptorArray[fileDescIndex];
+  fileDescPtr->fileControlBlockPtr = &fileControlBlockArray[entryIndex];
+  fileDescPtr->nReferencingProcesses = 1;
+  proc->fileDescPtrArray[procFileDescIndex] = fileDescPtr;
 
   spinUnlock(&fat16Lock);
   return procFileDescIndex;
@@ -436,8 +452,11 @@ int64_t closeFile(struct process *proc, uint32_t procFileDescriptorIndex) {
   proc->fileDescPtrArray[procFileDescriptorIndex]->nReferencingProcesses--;
   if (proc->fileDescPtrArray[procFileDescriptorIndex]->nReferencingProcesses ==
       0) {  // if the number of processes using this file descriptor is zero,
-            // set File Control Block ptr to null to free it up
-    proc->fileDescPtrArray[procFileDescriptorIndex]->fileControlBlockPtr = NULL;
+            // zero it out and return it to the cache
+    memset(proc->fileDescPtrArray[procFileDescriptorIndex], 0,
+           sizeof(struct fileDescriptor));
+    kmemCacheFree(fileDescriptorCache,
+                  proc->fileDescPtrArray[procFileDescriptorIndex]);
   }
   proc->fileDescPtrArray[procFileDescriptorIndex] = NULL;
   spinUnlock(&fat16Lock);
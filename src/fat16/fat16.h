@@ -97,9 +97,19 @@ struct fileDescriptor {
                                    // descriptor
 };
 
+// Create object cache for file descriptors
+void initFileDescriptorCache();
 // Load file give input file name
 // Returns 0 if successful, -1 otherwise
 int64_t loadFile(char *name, uint8_t *fileBuffer);
+// Look up file given input file name and return the index of its first
+// cluster and its size
+// Returns 0 if successful, -1 otherwise
+int64_t lookupFile(char *name, uint16_t *clusterIndex, uint32_t *fileSize);
+// Read size bytes at position of the file whose first cluster is clusterIndex
+// (file found by lookupFile) into buffer and return number of bytes read
+int64_t readFileData(uint16_t clusterIndex, uint32_t position,
+                     uint8_t *buffer, size_t size);
 // Open file given input file name
 // Returns non negative descriptor or -1 if it failed
 struct process;
@@ -16,7 +16,6 @@
 ; process yield after timer interrupt
 extern yield
 extern spinUnlock
-extern processLock 
 global startUserProcess
 global switchUserProcess
 global returnFromTimerInterrupt
@@ -174,6 +173,7 @@ isrAddressArray:
 
 ; Save 6 x64 callee-save registers on stack
 ; rsp must point current process' ring0ProcessContext before calling switchUserProcess
+; The run queue lock passed as third argument (rdx) is released once the stack of the next process is loaded
 switchUserProcess:
         push rbx
     	push rbp
@@ -194,7 +194,7 @@ switchUserProcess:
         ; if we are inside timer ISR 
         ; at this point esp points to ring0ProcessContext->ret,
 	; which is address of returnFromTimerInterrupt function
-        mov rdi, processLock     
+        mov rdi, rdx			; third argument is the run queue lock held by the scheduler
         call spinUnlock
         ret	
 
@@ -14,9 +14,11 @@
 #include "idt.h"
 
 #include "acpi/acpi.h"
+#include "acpi/ipi.h"
 #include "drivers/keyboard.h"
 #include "gdt/gdt.h"
 #include "io/io.h"
+#include "kernel.h"
 #include "lib/lib.h"
 #include "memory/memory.h"
 #include "process/process.h"
@@ -92,7 +94,8 @@ void selectInterruptHandler(struct interruptFrame *framePtr) {
 void int20Handler(struct interruptFrame *framePtr) {
   // printk("Timer Interrupt; CORE: %d\n", framePtr->coreId);
   ticksArray[framePtr->coreId]++;  // increment tick count
-  wakeUp(TIMER_WAKEUP_EVENT);
+  // wake up only the sleeping processes of this core whose deadline expired
+  wakeUpExpiredTimers(ticksArray[framePtr->coreId]);
   //   syscall in progress?
   if (syscallRunningArray[framePtr->coreId]) {
     // printk("Syscall interrupted %d; CORE: %d\n",
@@ -136,6 +139,33 @@ void int0Handler(struct interruptFrame *framePtr) {
   }
 }
 
+// Page fault handler: resolve demand-paging faults (zero-filled, file-backed
+// and shared memory pages populated on first access, 2MB anonymous pages) and
+// copy-on-write faults, otherwise exit user process (fault in ring3) or panic
+// (fault in ring0)
+void int14Handler(struct interruptFrame *framePtr) {
+  uint64_t vAddr = readCR2();
+  if (handlePageFault(&currentProcessArray[framePtr->coreId]->vmSpace, vAddr,
+                      framePtr->errorCode) == SUCCESS) {
+    return;  // restart faulting instruction
+  }
+  printk(
+      "UNHANDLED EXCEPTION: Page fault; CORE %u, ring %x, errorCode %x, "
+      "accessed virtual address %x, rip %x\n",
+      framePtr->coreId, framePtr->cs & 3, framePtr->errorCode, vAddr,
+      framePtr->rip);
+  if ((framePtr->cs & 0x3) !=
+      0) {  // if the exception ocurred in user mode exit process
+    printk("EXITING USER PROCESS %d\n",
+           currentProcessArray[framePtr->coreId]->pid);
+    exit();
+  } else {  // unhandled exception occured in rinr0
+    printk("KERNEL PANIC!\n");
+    while (1) {
+    }
+  }
+}
+
 // interupt gates: maskable interrupts are disabled when exeucting ISR
 void setIDTDescriptor(int interruptNumber, void *address) {
   // pointer to descriptor entry in IDT
@@ -181,8 +211,11 @@ void initializeIDT() {
     interruptHandlerAddressArray[i] = NULL;
   }
   interruptHandlerAddressArray[0] = int0Handler;
+  interruptHandlerAddressArray[PAGE_FAULT] = int14Handler;
   interruptHandlerAddressArray[0x20 + TIMER_IRQ] = int20Handler;
   interruptHandlerAddressArray[0x20 + KEYBOARD_IRQ] = int21Handler;
+  interruptHandlerAddressArray[CALL_FUNCTION_INTERRUPT] =
+      callFunctionInterruptHandler;
 
   for (int i = 0; i < TOT_N_INTERRUPTS; i++) {
     setIDTDescriptor(i, (void *)isrAddressArray[i]);
@@ -193,7 +226,8 @@ void initializeIDT() {
   // setIDTDescriptor(0x20 + TIMER_IRQ, int20);
   // setIDTDescriptor(0x20 + KEYBOARD_IRQ, int21);
   setIDTDescriptor(0x20 + SPURIOUS_IRQ, intFF);
-  remapIRQ(TIMER_IRQ, TIMER_INTERRUPT, 0);        // sent to all CPUs
+  // the PIT (TIMER_IRQ) stays masked (see ioAPICInit): each core takes
+  // TIMER_INTERRUPT from its own local APIC timer (see localApicTimerStart)
   remapIRQ(KEYBOARD_IRQ, KEYBOARD_INTERRUPT, 1);  // sent to single CPU
   remapIRQ(SPURIOUS_IRQ, SPURIOUS_INTERRUPT, 0);  // sent to all CPUs
   loadIDT(&idtDesc);
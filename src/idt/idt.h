@@ -33,8 +33,12 @@
 #define STACK_SEGMENT_FAULT 0xC
 #define GENERAL_PROTECTION_FAULT 0xD
 
+#define PAGE_FAULT 0xE
+
 #define TIMER_INTERRUPT 0x20
 #define KEYBOARD_INTERRUPT 0x21
+// inter-processor interrupt: run functions queued by other cores (acpi/ipi.c)
+#define CALL_FUNCTION_INTERRUPT 0xF0
 #define SPURIOUS_INTERRUPT 0xFF
 
 // PS2 KEYBOARD
@@ -31,10 +31,13 @@ extern idtDesc                                  ; IDT descriptor
 extern printk                                   ; print function
 extern loadGDT 					; defined in gdt/gdt.c
 extern localAPICInit                            ; defined in acpi/acpi.c
+extern localApicTimerStart                      ; defined in acpi/acpi.c
 extern loadPageTable                            ; defined in memory/memory.c
 extern loadIDTAP                                ; defined in idt/idt.c
 extern startIdleProcess				; defined in process/process.c
 extern enableSysCall				; defined in syscall/syscall.c
+extern refillZeroedPagePools			; defined in memory/memory.c
+extern releaseLazyAddressSpace			; defined in memory/memory.c
 
 section .text
 [BITS 64]
@@ -125,11 +128,15 @@ ap64:
         xor rax, rax                            ; printk is a variadic function, rax=0 means no floating point arguments
         call printk
         call enableSysCall
+        mov rdi, LAPIC_TIMER_HZ			; timer interrupts per second
+        call localApicTimerStart		; start core's Local APIC timer
         call startIdleProcess
 idleProcess:               
         mov ax, LONG_MODE_DATA_SEG		; set ss to kernel mode code segment descriptor before enabling interrupts
 	mov ss, ax
         sti					; enable interrupts
+        call releaseLazyAddressSpace		; free borrowed page table of an exited process
+        call refillZeroedPagePools		; zero out free pages while there is nothing to run (preemptible)
 	hlt					; halt core until next interrupt
         jmp idleProcess
 coreMsg: db 'Core %d started!', 0xa, 0 ; \r\n
@@ -23,6 +23,7 @@
 #include "idt/idt.h"
 #include "io/io.h"
 #include "memory/memory.h"
+#include "memory/slab.h"
 #include "process/process.h"
 #include "stdio/stdio.h"
 #include "syscall/syscall.h"
@@ -86,6 +87,9 @@ void printKernelError(int64_t errCode) {
     case ERR_VM:
       printk("%d: VIRTUAL MEMORY PAGE TABLE ERROR!\n", errCode);
       break;
+    case ERR_IPI:
+      printk("%d: INTER-PROCESSOR INTERRUPT ERROR!\n", errCode);
+      break;
     default:
       printk("%d: UNKOWN ERROR CODE!\n", errCode);
       break;
@@ -135,6 +139,8 @@ void kernelStart() {
   */
   printFreeMemoryRegionList();
   initMemory();
+  initKmemCaches();
+  initFileDescriptorCache();
   initTSS();
   initGDT();
   kInitVM();
@@ -142,6 +148,9 @@ void kernelStart() {
 
   initSystemCalls();
   initStartupProcesses();
+  // calibrate the local APIC timer before the APs start their timer
+  localApicTimerCalibrate();
+  localApicTimerStart(LAPIC_TIMER_HZ);
   startIdleProcess();
   smpInit();
   printk("Active cores count: %d\n", gActiveCpuCount);
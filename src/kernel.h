@@ -28,6 +28,7 @@
 #define ERR_SCHEDULER -9LL
 #define ERR_FAT16 -10LL
 #define ERR_VM -11LL
+#define ERR_IPI -12LL
 
 void printKernelError(int64_t errCode);
 
@@ -46,6 +46,28 @@ void memcpy(void *dest, void *src, size_t size);
 // otherwise
 int bufferEqual(uint8_t *buf1, uint8_t *buf2, size_t size);
 
+/*** Interrupt flag utility functions ***/
+
+// Save RFLAGS and disable interrupts on the running core
+static inline uint64_t saveFlagsAndCli() {
+  uint64_t flags;
+  __asm volatile("pushfq; popq %0; cli" : "=r"(flags) : : "memory");
+  return flags;
+}
+
+// Restore RFLAGS (interrupt flag) saved by saveFlagsAndCli
+static inline void restoreFlags(uint64_t flags) {
+  __asm volatile("pushq %0; popfq" : : "r"(flags) : "memory", "cc");
+}
+
+// Read time stamp counter (CPU cycles)
+static inline uint64_t readTimeStampCounter() {
+  uint32_t low;
+  uint32_t high;
+  __asm volatile("rdtsc" : "=a"(low), "=d"(high));
+  return ((uint64_t)high << 32) | low;
+}
+
 /*** String utility functions ***/
 
 // returns length of null-terminated string
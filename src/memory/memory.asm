@@ -13,6 +13,17 @@
 
 global loadCR3
 global readCR3
+global invalidatePage
+global enableWriteProtect
+global zeroPageNonTemporal
+global enableGlobalPages
+global enablePCID
+global flushGlobalTLB
+
+CR0_WP equ 0x10000                              ; CR0 bit 16: Write Protect
+CR4_PGE equ 0x80                                ; CR4 bit 7: Page Global Enable
+CR4_PCIDE equ 0x20000                           ; CR4 bit 17: PCID Enable
+PAGE_SIZE equ 4096
 
 section .text
 ; Long Mode
@@ -37,3 +48,71 @@ readCR3:
  	mov rax, cr3
         retq	
 
+
+; invalidate TLB entry for page containing input virtual address
+
+; x64 System V calling convention: parameters are passed in rdi, rsi, rdx, rcx, r8, r9
+; and if there are more the stack is used
+invalidatePage:
+        invlpg [rdi]
+        retq
+
+; set CR0 Write Protect (WP) bit: ring0 writes to read-only pages fault too
+; (needed for copy-on-write user pages written by the kernel)
+enableWriteProtect:
+        mov rax, cr0
+        or rax, CR0_WP
+        mov cr0, rax
+        retq
+
+; set CR4 Page Global Enable (PGE) bit: TLB entries of pages with the global
+; flag set (kernel space direct map) are not flushed by CR3 loads
+enableGlobalPages:
+        mov rax, cr4
+        or rax, CR4_PGE
+        mov cr4, rax
+        retq
+
+; flush all TLB entries including global pages (kernel space direct map) and
+; all PCIDs: toggling CR4.PGE invalidates the whole TLB
+flushGlobalTLB:
+        mov rax, cr4
+        mov rdx, rax
+        and rax, ~CR4_PGE
+        mov cr4, rax
+        mov cr4, rdx
+        retq
+
+; set CR4 PCID Enable (PCIDE) bit: CR3 bits 0-11 hold the process-context
+; identifier of the loaded page table (CR3 bits 0-11 must be zero when this is
+; called)
+enablePCID:
+        mov rax, cr4
+        or rax, CR4_PCIDE
+        mov cr4, rax
+        retq
+
+; zero out the 4KB page at input virtual address with non-temporal stores:
+; the page is written straight to memory (through write-combining buffers)
+; without evicting useful cache lines, which makes it suitable for zeroing
+; pages that will not be read soon (idle cores filling the zeroed page pool)
+
+; x64 System V calling convention: parameters are passed in rdi, rsi, rdx, rcx, r8, r9
+; and if there are more the stack is used
+zeroPageNonTemporal:
+        xor rax, rax
+        mov rcx, PAGE_SIZE / 64                 ; number of 64-byte cache lines
+.loop:
+        movnti [rdi], rax
+        movnti [rdi + 8], rax
+        movnti [rdi + 16], rax
+        movnti [rdi + 24], rax
+        movnti [rdi + 32], rax
+        movnti [rdi + 40], rax
+        movnti [rdi + 48], rax
+        movnti [rdi + 56], rax
+        add rdi, 64
+        dec rcx
+        jnz .loop
+        sfence                                  ; order non-temporal stores before the page is published
+        retq
@@ -13,7 +13,9 @@
 
 #include "memory.h"
 
-#include "../acpi/acpi.h"  // IOAPIC addresses
+#include "../acpi/acpi.h"    // IOAPIC addresses, getOnlineCoreMask
+#include "../acpi/ipi.h"     // smpCallFunction
+#include "../fat16/fat16.h"  // readFileData
 #include "../kernel.h"
 #include "../lib/lib.h"
 #include "../process/process.h"
@@ -27,44 +29,150 @@ extern void spinUnlock(volatile uint8_t *lock);
 
 // Static variables, zero-initialized
 
-static volatile uint8_t
-    memoryLock;  // lock from SMP access to critical sections
+static uint64_t nZeroFillFaults;  // demand paging faults: zero-filled pages
+static uint64_t nFileFaults;      // demand paging faults: pages read from file
+static uint64_t nCoWFaults;       // copy-on-write page faults
+static uint64_t nHugePageFaults;  // 2MB user pages populated by page faults
+static uint64_t nHugePageFallbacks;  // 4KB pages used: no free 2MB block
+static uint64_t nHugePageSplits;     // 2MB mappings split into 4KB pages
 
-static uint64_t nFreePages;
-static uint64_t nAllocatedPages;
-
-// Total memory size in bytes
-static uint64_t totMemorySize;
+// Set by kInitVM if the CPU supports PCIDs (see TLB MANAGEMENT)
+static int pcidEnabled;
 
 // Load cr3 register with page table address
 extern void loadCR3(uint64_t pageTableAddr);
 
+// Read cr3 register value
+extern uint64_t readCR3();
+
+// Invalidate TLB entry for page containing virtual address
+extern void invalidatePage(uint64_t vAddr);
+
+// Set CR0 Write Protect bit
+extern void enableWriteProtect();
+
+// Set CR4 Page Global Enable and PCID Enable bits
+extern void enableGlobalPages();
+extern void enablePCID();
+
+// Flush all TLB entries including global pages
+extern void flushGlobalTLB();
+
+// Zero out page with non-temporal stores (bypassing the data cache)
+extern void zeroPageNonTemporal(void *page);
+
 // LAPIC address ptr
 extern uint64_t *gLocalApicAddress;
 
+extern uint64_t getCoreId();  // ../kernel.asm
+
 // IOAPIC addresses
 extern uint32_t acpiNIoApics;
 extern uint8_t *ioApicAddresses[MAX_N_IO_APICS_SUPPORTED];
 
+// NUMA topology parsed from the ACPI SRAT and SLIT (acpi.c)
+extern uint32_t acpiNNumaNodes;
+extern uint32_t acpiCoreNumaNodeIds[MAX_N_CORES_SUPPORTED];
+extern uint32_t acpiNNumaMemoryRanges;
+extern struct numaMemoryRange acpiNumaMemoryRanges[MAX_N_NUMA_MEMORY_RANGES];
+extern uint8_t acpiNumaDistances[MAX_N_NUMA_NODES][MAX_N_NUMA_NODES];
+
 // Defined in linker.ld script
 extern struct memoryRegionE820 gMemoryMap;
 extern uint32_t gNMemoryRegions;
 extern char kernelEnd;
 
-// Normally called by AP after BP as initialized Page Table
-void loadPageTable() { loadCR3((uint64_t)VADDR_TO_PADDR(gPML4TPageMapPtr)); }
-
 ///*** BIOS (E820) memory map ***///
 
 // Array of memoryRegion structures, one per free memory region obtained from
 // BIOS (E820) memory map
 static struct memoryRegion memoryRegions[MAX_N_MEMORY_REGIONS];
+static uint64_t nMemoryRegions;
+// Direct map virtual address of the end of the highest free memory region
 static uint64_t memoryEndAddress;
 
-// Print pages stats
-void printPagesStats() {
-  printk("Free Pages: %u\n Allocated Pages: %u\n", nFreePages, nAllocatedPages);
-}
+/*** PHYSICAL MEMORY ZONES ***/
+// ZONE_KERNEL: first KERNEL_PHYSICAL_MEMORY_LIMIT bytes of physical memory
+// (mapped by the loader): kernel data structures and page tables
+// ZONE_HIGH: physical memory above KERNEL_PHYSICAL_MEMORY_LIMIT, reachable only
+// through the direct map built by kInitVM: user pages (kAllocUserPage), and
+// kernel pages of NUMA nodes without memory in the kernel zone
+// Each zone has its own buddy allocator: the zone boundary is aligned to the
+// largest block size, so a block and its buddy are always in the same zone
+#define ZONE_KERNEL 0
+#define ZONE_HIGH 1
+#define N_MEMORY_ZONES 2
+
+#define PFN_TO_ZONE_INDEX(pfn) \
+  ((pfn) < KERNEL_PHYSICAL_MEMORY_LIMIT / PAGE_SIZE ? ZONE_KERNEL : ZONE_HIGH)
+
+// NUMA: each node (see acpi.h) has a kernel and a high zone holding the
+// memory ranges the SRAT assigns to the node (without SRAT there is a single
+// node): blocks do not span node boundaries and a block is merged with its
+// buddy only if they belong to the same node
+// Allocations prefer the running core's node, then the other nodes by
+// increasing SLIT distance (nodeOrderArray)
+#define PFN_TO_ZONE(pfn) \
+  (&zoneArray[pageFrameArray[pfn].nodeId][PFN_TO_ZONE_INDEX(pfn)])
+
+struct memoryZone {
+  const char *name;
+  uint32_t nodeId;
+  uint32_t zoneIndex;
+  volatile uint8_t lock;  // lock for free lists
+  struct page freeAreaArray[N_PAGE_ORDERS];  // list sentinels
+  uint64_t nFreeBlocksArray[N_PAGE_ORDERS];
+  uint64_t nFreePages;   // pages in the zone free lists
+  uint64_t nTotalPages;  // pages managed by the zone
+};
+
+static struct memoryZone zoneArray[MAX_N_NUMA_NODES][N_MEMORY_ZONES];
+static uint32_t nNumaNodes;  // at least 1
+// Node ids sorted by increasing distance from each node (the node first)
+static uint32_t nodeOrderArray[MAX_N_NUMA_NODES][MAX_N_NUMA_NODES];
+
+/*** PER-CORE PAGE CACHES ***/
+// Each core keeps a small stack (magazine) of free pages per zone of its NUMA
+// node: kAllocPage, kAllocUserPage and kFreePage only take the zone lock to
+// move PAGE_CACHE_BATCH_SIZE pages between the local cache and the zone buddy
+// allocator when the cache is empty (refill) or full (drain)
+// Pages of other nodes are allocated from and freed to their zone directly
+#define PAGE_CACHE_SIZE 64
+#define PAGE_CACHE_BATCH_SIZE 32
+
+struct pageCache {
+  struct page *pages[PAGE_CACHE_SIZE];
+  uint64_t nPages;
+  uint64_t nHits;     // allocations served by the cache
+  uint64_t nMisses;   // allocations that required a refill
+  uint64_t nRefills;  // batches moved from the buddy allocator
+  uint64_t nDrains;   // batches moved to the buddy allocator
+  uint64_t nRemoteAllocs;  // allocations served by another node's zone
+} __attribute__((aligned(64)));  // one cache line boundary per core
+
+static struct pageCache pageCacheArray[MAX_N_CORES_SUPPORTED][N_MEMORY_ZONES];
+
+/*** ZEROED PAGE POOLS ***/
+// Each zone keeps a pool of free pages that are already zeroed out: the idle
+// process of each core fills the pools of its node with non-temporal stores
+// (refillZeroedPagePools, called by the idle loop in kernel.asm), so that
+// kAllocZeroedPage/kAllocZeroedUserPage do not zero pages in the critical path
+// unless the pool is empty
+// Zeroed pages are not linked through a struct page (which would dirty them):
+// the pool is an array of page pointers
+#define ZEROED_PAGE_POOL_SIZE 256
+
+struct zeroedPagePool {
+  volatile uint8_t lock;  // lock for pages and nPages
+  struct page *pages[ZEROED_PAGE_POOL_SIZE];
+  uint64_t nPages;
+  uint64_t nHits;         // zeroed page allocations served by the pool
+  uint64_t nMisses;       // zeroed page allocations zeroed synchronously
+  uint64_t nZeroedPages;  // pages zeroed by idle cores
+};
+
+static struct zeroedPagePool zeroedPagePoolArray[MAX_N_NUMA_NODES]
+                                                [N_MEMORY_ZONES];
 
 // Print BIOS (E820) free memory region info
 void printFreeMemoryRegionList() {
@@ -79,7 +187,7 @@ void printFreeMemoryRegionList() {
     ++memoryMap;
   }
 }
-// KERNEL ADDRESS RANGE  IN PHYSICAL MEMORY: |0x0 - 0x40000000 (1GB)|
+// KERNEL ZONE IN PHYSICAL MEMORY: |0x0 - 0x40000000 (1GB)|
 // KERNEL SPACE:
 
 // 0x0 -> KERNEL_SPACE_BASE_VIRTUAL_ADDRESS: 0xffff800000000000
@@ -93,36 +201,287 @@ void printFreeMemoryRegionList() {
 // ..
 ///*** ***/
 // 0x40000000 (1GB) -> KERNEL_SPACE_END_VIRTUAL_ADDRESS: 0xffff800040000000
+/*** HIGH ZONE: RAM regions above 1GB (mapped by kInitVM) ***/
+// ..
+// memoryEndAddress (at most KERNEL_DIRECT_MAP_END_VIRTUAL_ADDRESS)
+
+/*** KERNEL MEMORY PAGE MANAGEMENT: buddy allocator ***/
+// Free blocks of 2^order pages are kept in one circular doubly linked list per
+// order: each free block contains a struct page (virtual addresses of the next
+// and previous free blocks of the same order)
+// A block and its buddy (the block whose physical page frame number differs
+// only in bit order) are merged into a block of order + 1 when both are free
+
+// One struct pageFrame per physical page in the kernel space direct map,
+// stored in the first free memory region above the kernel image that is large
+// enough (pages holding the array are not added to the free lists)
+static struct pageFrame *pageFrameArray;
+static uint64_t nPageFrames;
+
+#define VADDR_TO_PFN(vAddr) (VADDR_TO_PADDR(vAddr) / PAGE_SIZE)
+#define PFN_TO_VADDR(pfn) PADDR_TO_VADDR((uint64_t)(pfn)*PAGE_SIZE)
+
+// Add free block to the list of free blocks of given order
+// zone->lock must be held
+static void insertFreeBlock(struct memoryZone *zone, uint64_t pfn,
+                            uint64_t order) {
+  struct page *block = (struct page *)PFN_TO_VADDR(pfn);
+  struct page *head = &zone->freeAreaArray[order];
+  block->next = head->next;
+  block->prev = head;
+  head->next->prev = block;
+  head->next = block;
+  pageFrameArray[pfn].flags |= PAGE_FRAME_FREE;
+  pageFrameArray[pfn].order = order;
+  zone->nFreeBlocksArray[order]++;
+  zone->nFreePages += (1ULL << order);
+}
+
+// Remove free block from the list of free blocks of given order
+// zone->lock must be held
+static void removeFreeBlock(struct memoryZone *zone, uint64_t pfn,
+                            uint64_t order) {
+  struct page *block = (struct page *)PFN_TO_VADDR(pfn);
+  block->prev->next = block->next;
+  block->next->prev = block->prev;
+  pageFrameArray[pfn].flags &= ~PAGE_FRAME_FREE;
+  zone->nFreeBlocksArray[order]--;
+  zone->nFreePages -= (1ULL << order);
+}
+
+// Return page frame number of a free block of given order or -1 if there is
+// none: a larger block is split if there is no free block of given order
+// zone->lock must be held
+static int64_t allocBlock(struct memoryZone *zone, uint64_t order) {
+  uint64_t currentOrder = order;
+  while (currentOrder <= MAX_PAGE_ORDER &&
+         zone->freeAreaArray[currentOrder].next ==
+             &zone->freeAreaArray[currentOrder]) {
+    currentOrder++;
+  }
+  if (currentOrder > MAX_PAGE_ORDER) {
+    return -1;
+  }
+  uint64_t pfn = VADDR_TO_PFN(zone->freeAreaArray[currentOrder].next);
+  removeFreeBlock(zone, pfn, currentOrder);
+  // Split: return upper halves to the free lists
+  while (currentOrder > order) {
+    currentOrder--;
+    insertFreeBlock(zone, pfn + (1ULL << currentOrder), currentOrder);
+  }
+  return pfn;
+}
+
+// Return free block of given order to the free lists, merging it with its
+// buddy as long as the buddy is free
+// zone->lock must be held
+static void freeBlock(struct memoryZone *zone, uint64_t pfn, uint64_t order) {
+  while (order < MAX_PAGE_ORDER) {
+    uint64_t buddyPfn = pfn ^ (1ULL << order);
+    if (buddyPfn >= nPageFrames ||
+        !(pageFrameArray[buddyPfn].flags & PAGE_FRAME_FREE) ||
+        pageFrameArray[buddyPfn].order != order ||
+        pageFrameArray[buddyPfn].nodeId != pageFrameArray[pfn].nodeId) {
+      break;
+    }
+    removeFreeBlock(zone, buddyPfn, order);
+    pfn &= ~(1ULL << order);
+    order++;
+  }
+  insertFreeBlock(zone, pfn, order);
+}
+
+// Print free block count per order and the fraction of free memory that
+// cannot be used for an allocation of that order (unusable free space index)
+static void printBuddyStats(struct memoryZone *zone) {
+  printk("Buddy allocator free blocks:\n");
+  for (uint64_t order = 0; order <= MAX_PAGE_ORDER; order++) {
+    uint64_t nUsablePages = 0;
+    for (uint64_t i = order; i <= MAX_PAGE_ORDER; i++) {
+      nUsablePages += zone->nFreeBlocksArray[i] << i;
+    }
+    uint64_t unusablePercentage =
+        zone->nFreePages
+            ? (100 * (zone->nFreePages - nUsablePages)) / zone->nFreePages
+            : 0;
+    printk(" order %u (%uKB): %u blocks, unusable free memory: %u%%\n", order,
+           (PAGE_SIZE << order) / 1024, zone->nFreeBlocksArray[order],
+           unusablePercentage);
+  }
+}
+
+// Print page cache, zeroed page pool and buddy allocator stats of a zone
+// The page caches of a core only hold pages of the core's node
+static void printZoneStats(struct memoryZone *zone) {
+  uint64_t nCachedPages = 0;
+  if (zone->nTotalPages == 0) {
+    return;
+  }
+  printk("Node %u zone %s:\n", zone->nodeId, zone->name);
+  for (int i = 0; i < MAX_N_CORES_SUPPORTED; i++) {
+    struct pageCache *cache = &pageCacheArray[i][zone->zoneIndex];
+    if (acpiCoreNumaNodeIds[i] != zone->nodeId) {
+      continue;
+    }
+    nCachedPages += cache->nPages;
+    if (cache->nHits + cache->nMisses == 0) {
+      continue;
+    }
+    printk(
+        "Core %d page cache: %u pages, hits: %u, misses: %u (hit rate: "
+        "%u%%), refills: %u, drains: %u, remote node allocations: %u\n",
+        i, cache->nPages, cache->nHits, cache->nMisses,
+        (100 * cache->nHits) / (cache->nHits + cache->nMisses),
+        cache->nRefills, cache->nDrains, cache->nRemoteAllocs);
+  }
+  struct zeroedPagePool *pool =
+      &zeroedPagePoolArray[zone->nodeId][zone->zoneIndex];
+  printk("Free Pages: %u (cached: %u, zeroed: %u)\n Allocated Pages: %u\n",
+         zone->nFreePages + nCachedPages + pool->nPages, nCachedPages,
+         pool->nPages,
+         zone->nTotalPages - zone->nFreePages - nCachedPages - pool->nPages);
+  if (pool->nHits + pool->nMisses > 0) {
+    printk(
+        "Zeroed page pool: hits: %u, misses: %u (hit rate: %u%%), pages "
+        "zeroed by idle cores: %u\n",
+        pool->nHits, pool->nMisses,
+        (100 * pool->nHits) / (pool->nHits + pool->nMisses),
+        pool->nZeroedPages);
+  }
+  printBuddyStats(zone);
+}
+
+// Print pages stats
+void printPagesStats() {
+  for (uint64_t n = 0; n < nNumaNodes; n++) {
+    for (int z = 0; z < N_MEMORY_ZONES; z++) {
+      printZoneStats(&zoneArray[n][z]);
+    }
+  }
+  printk("Page faults: zero-fill: %u, file: %u, copy-on-write: %u\n",
+         nZeroFillFaults, nFileFaults, nCoWFaults);
+  printk("2MB user pages: populated: %u, 4KB fallbacks: %u, split: %u\n",
+         nHugePageFaults, nHugePageFallbacks, nHugePageSplits);
+}
+
+// Return NUMA node of the memory at physical address pAddr (node 0 if the SRAT
+// does not cover it)
+static uint32_t getMemoryNode(uint64_t pAddr) {
+  for (uint64_t i = 0; i < acpiNNumaMemoryRanges && nNumaNodes > 1; i++) {
+    if (pAddr >= acpiNumaMemoryRanges[i].baseAddr &&
+        pAddr < acpiNumaMemoryRanges[i].endAddr) {
+      return acpiNumaMemoryRanges[i].nodeId;
+    }
+  }
+  return 0;
+}
 
-/*** KERNEL MEMORY PAGE MANAGEMENT: linked list of free pages ***/
-// Each free page contains a 64-bit pointer (virtual address) to the next free
-// page
-static struct page freePageList;  // Head of the list (struct page consists of
-                                  // just a 64-bit pointer to a struct page)
+// Return 1 if the physical range [baseAddr, endAddr) contains the start or
+// the end of an SRAT memory range (pages of the range may belong to different
+// NUMA nodes), 0 otherwise
+static int crossesNodeBoundary(uint64_t baseAddr, uint64_t endAddr) {
+  for (uint64_t i = 0; i < acpiNNumaMemoryRanges && nNumaNodes > 1; i++) {
+    struct numaMemoryRange *range = &acpiNumaMemoryRanges[i];
+    if ((range->baseAddr > baseAddr && range->baseAddr < endAddr) ||
+        (range->endAddr > baseAddr && range->endAddr < endAddr)) {
+      return 1;
+    }
+  }
+  return 0;
+}
 
-// For a given memory region add as many pages fit in it to the free page list
-// as long as the page virtual address is less than
-// KERNEL_SPACE_END_VIRTUAL_ADDRESS
+// For a given memory region add the largest aligned blocks that fit in it to
+// the buddy allocator free lists of the zone containing each block (blocks do
+// not span NUMA node boundaries)
+// Pages are added directly to the free lists (not to the per-core page
+// caches), pages holding the page frame array are skipped
+// The region must be mapped in the kernel space direct map
 static void freeMemoryRegion(uint64_t baseAddress, uint64_t endAddress) {
-  for (uint64_t addr = PAGE_ALIGN_ADDR_UP(baseAddress);
-       addr + PAGE_SIZE <= endAddress; addr += PAGE_SIZE) {
-    if (addr + PAGE_SIZE <= KERNEL_SPACE_END_VIRTUAL_ADDRESS) {
-      int64_t errCode = kFreePage(addr);  // add page to free page list
-      if (errCode != SUCCESS) {
-        printk("ERROR freeMemoryRegion: kFree failed\n");
-        KERNEL_PANIC(errCode);
+  uint64_t frameArrayStart = (uint64_t)pageFrameArray;
+  uint64_t frameArrayEnd = PAGE_ALIGN_ADDR_UP(
+      frameArrayStart + nPageFrames * sizeof(struct pageFrame));
+  if (baseAddress < frameArrayEnd && endAddress > frameArrayStart) {
+    freeMemoryRegion(baseAddress, frameArrayStart);
+    freeMemoryRegion(frameArrayEnd, endAddress);
+    return;
+  }
+
+  uint64_t addr = PAGE_ALIGN_ADDR_UP(baseAddress);
+  endAddress = PAGE_ALIGN_ADDR_DOWN(endAddress);
+  while (addr < endAddress) {
+    uint64_t order = MAX_PAGE_ORDER;
+    while (order > 0 &&
+           ((VADDR_TO_PADDR(addr) & ((PAGE_SIZE << order) - 1)) ||
+            addr + (PAGE_SIZE << order) > endAddress ||
+            crossesNodeBoundary(VADDR_TO_PADDR(addr),
+                                VADDR_TO_PADDR(addr) + (PAGE_SIZE << order)))) {
+      order--;
+    }
+    uint64_t pfn = VADDR_TO_PFN(addr);
+    uint32_t nodeId = getMemoryNode(VADDR_TO_PADDR(addr));
+    for (uint64_t i = 0; i < (1ULL << order); i++) {
+      pageFrameArray[pfn + i].nodeId = nodeId;
+    }
+    struct memoryZone *zone = PFN_TO_ZONE(pfn);
+    freeBlock(zone, pfn, order);
+    zone->nTotalPages += (1ULL << order);
+    addr += (PAGE_SIZE << order);
+  }
+}
+
+// Return virtual address of the first page-aligned range of size bytes above
+// the kernel image inside a free memory region of the kernel zone (0 if there
+// is none)
+static uint64_t findFreeRange(uint64_t size) {
+  for (int64_t i = 0; i < nMemoryRegions; i++) {
+    uint64_t virtualBaseAddr = PADDR_TO_VADDR(memoryRegions[i].baseAddr);
+    uint64_t virtualEndAddr = virtualBaseAddr + memoryRegions[i].size;
+    if (virtualBaseAddr < (uint64_t)&kernelEnd) {
+      virtualBaseAddr = (uint64_t)&kernelEnd;
+    }
+    if (virtualEndAddr > KERNEL_SPACE_END_VIRTUAL_ADDRESS) {
+      virtualEndAddr = KERNEL_SPACE_END_VIRTUAL_ADDRESS;
+    }
+    virtualBaseAddr = PAGE_ALIGN_ADDR_UP(virtualBaseAddr);
+    if (virtualEndAddr > virtualBaseAddr &&
+        virtualEndAddr - virtualBaseAddr >= size) {
+      return virtualBaseAddr;
+    }
+  }
+  return 0;
+}
+
+// Sort node ids of each node by increasing SLIT distance from the node
+// (insertion sort, the node itself comes first)
+static void initNodeOrder() {
+  for (uint32_t n = 0; n < nNumaNodes; n++) {
+    uint32_t *order = nodeOrderArray[n];
+    uint32_t nSortedNodes = 1;
+    order[0] = n;
+    for (uint32_t i = 0; i < nNumaNodes; i++) {
+      if (i == n) {
+        continue;
       }
+      uint32_t j = nSortedNodes++;
+      while (j > 1 &&
+             acpiNumaDistances[n][order[j - 1]] > acpiNumaDistances[n][i]) {
+        order[j] = order[j - 1];
+        j--;
+      }
+      order[j] = i;
     }
   }
 }
 
 // Initalize Kernel memory
 // To be called by Bootstrap Processor
+// Only the kernel zone is populated here: memory above
+// KERNEL_PHYSICAL_MEMORY_LIMIT is not mapped yet and is added to the high zone
+// by kInitVM
 void initMemory() {
   struct memoryRegionE820 *memoryMap = &gMemoryMap;
-  uint64_t nMemoryRegions = 0;
-  totMemorySize = 0;
-  memoryLock = 0;
+  nMemoryRegions = 0;
+  memoryEndAddress = 0;
   printk("initMemory:\n");
 
   for (int64_t i = 0; i < gNMemoryRegions; i++) {
@@ -132,467 +491,2197 @@ void initMemory() {
           "of memory regions (%d): only first %d regions will be used\n",
           MAX_N_MEMORY_REGIONS, MAX_N_MEMORY_REGIONS);
     }
-    if (memoryMap[i].type == E820_TYPE_RAM) {
-      memoryRegions[nMemoryRegions].baseAddr = memoryMap[i].baseAddr;
-      memoryRegions[nMemoryRegions].size = memoryMap[i].size;
-      totMemorySize += memoryMap[i].size;
-      nMemoryRegions++;
-    }
     printk("E820 region baseAddr: %x  size: %uKB  type: %u\n",
            memoryMap[i].baseAddr, memoryMap[i].size / 1024,
            (uint64_t)memoryMap[i].type);
+    if (memoryMap[i].type != E820_TYPE_RAM ||
+        memoryMap[i].baseAddr >= MAX_PHYSICAL_MEMORY_SIZE) {
+      continue;
+    }
+    uint64_t size = memoryMap[i].size;
+    if (memoryMap[i].baseAddr + size > MAX_PHYSICAL_MEMORY_SIZE) {
+      printk("Physical memory above %uGB is not used\n",
+             MAX_PHYSICAL_MEMORY_SIZE >> 30);
+      size = MAX_PHYSICAL_MEMORY_SIZE - memoryMap[i].baseAddr;
+    }
+    memoryRegions[nMemoryRegions].baseAddr = memoryMap[i].baseAddr;
+    memoryRegions[nMemoryRegions].size = size;
+    if (PADDR_TO_VADDR(memoryMap[i].baseAddr + size) > memoryEndAddress) {
+      memoryEndAddress = PADDR_TO_VADDR(memoryMap[i].baseAddr + size);
+    }
+    nMemoryRegions++;
+  }
+
+  nNumaNodes = acpiNNumaNodes > 0 ? acpiNNumaNodes : 1;
+  for (uint32_t n = 0; n < nNumaNodes; n++) {
+    zoneArray[n][ZONE_KERNEL].name = "kernel";
+    zoneArray[n][ZONE_HIGH].name = "high";
+    for (int z = 0; z < N_MEMORY_ZONES; z++) {
+      struct memoryZone *zone = &zoneArray[n][z];
+      zone->nodeId = n;
+      zone->zoneIndex = z;
+      for (int i = 0; i <= MAX_PAGE_ORDER; i++) {
+        zone->freeAreaArray[i].next = &zone->freeAreaArray[i];
+        zone->freeAreaArray[i].prev = &zone->freeAreaArray[i];
+      }
+    }
+  }
+  initNodeOrder();
+
+  // Allocate page frame array: one descriptor per page up to the end of the
+  // highest free memory region (stored in the kernel zone)
+  nPageFrames = VADDR_TO_PFN(PAGE_ALIGN_ADDR_UP(memoryEndAddress));
+  pageFrameArray = (struct pageFrame *)findFreeRange(
+      nPageFrames * sizeof(struct pageFrame));
+  if (pageFrameArray == NULL) {
+    printk("ERROR initMemory: no free memory region for page frame array\n");
+    KERNEL_PANIC(ERR_ALLOC_FAILED);
   }
+  memset(pageFrameArray, 0, nPageFrames * sizeof(struct pageFrame));
 
-  // Populate free page list and skip kernel image
+  // Populate kernel zone free lists and skip kernel image
   // Only pages from free regions between physical address 0x0 and
   // KERNEL_PHYSICAL_MEMORY_LIMIT (normally 1GB, 0x40000000) are added
-
   for (int64_t i = 0; i < nMemoryRegions; i++) {
     uint64_t virtualBaseAddr = PADDR_TO_VADDR(memoryRegions[i].baseAddr);
     uint64_t virtualEndAddr = virtualBaseAddr + memoryRegions[i].size;
-    // region is beyond kernel image in virtual memory space
-    if (virtualBaseAddr > (uint64_t)&kernelEnd) {
+    if (virtualBaseAddr < (uint64_t)&kernelEnd) {
+      virtualBaseAddr = (uint64_t)&kernelEnd;
+    }
+    if (virtualEndAddr > KERNEL_SPACE_END_VIRTUAL_ADDRESS) {
+      virtualEndAddr = KERNEL_SPACE_END_VIRTUAL_ADDRESS;
+    }
+    if (virtualEndAddr > virtualBaseAddr) {
       freeMemoryRegion(virtualBaseAddr, virtualEndAddr);
-    } else  // region virtual base address is inside kernel image, allocate
-            // remainder
-      if (virtualEndAddr > (uint64_t)&kernelEnd) {
-        freeMemoryRegion((uint64_t)&kernelEnd, virtualEndAddr);
-      }
+    }
   }
 
-  // free memory end address is address of last free page + PAGE_SIZE
-  memoryEndAddress = ((uint64_t)freePageList.next) + PAGE_SIZE;
-  printk("Kernel Space End address: %x\n", memoryEndAddress);
+  for (uint32_t n = 0; n < nNumaNodes; n++) {
+    printk("Node %u kernel zone: %uKB\n", n,
+           zoneArray[n][ZONE_KERNEL].nTotalPages * PAGE_SIZE / 1024);
+  }
+  printk("Physical memory end address: %x\n",
+         VADDR_TO_PADDR(memoryEndAddress));
 }
 
-// Add page at address virtual address to free page list
-// It popoulates the memory pointed by vAddr with a page struct
-// Only pages from free regions between physical address 0x0 and
-// KERNEL_PHYSICAL_MEMORY_LIMIT (normally 1GB, 0x40000000) are added
-
-int64_t kFreePage(uint64_t vAddr) {
-  if (((uint64_t)vAddr) & (PAGE_SIZE - 1)) {
-    return ERR_MISALIGNED_ADDR;
+// Populate high zone free lists with free memory regions above
+// KERNEL_PHYSICAL_MEMORY_LIMIT
+// Called by kInitVM once the kernel space direct map covers them
+static void initHighMemory() {
+  for (int64_t i = 0; i < nMemoryRegions; i++) {
+    uint64_t virtualBaseAddr = PADDR_TO_VADDR(memoryRegions[i].baseAddr);
+    uint64_t virtualEndAddr = virtualBaseAddr + memoryRegions[i].size;
+    if (virtualBaseAddr < KERNEL_SPACE_END_VIRTUAL_ADDRESS) {
+      virtualBaseAddr = KERNEL_SPACE_END_VIRTUAL_ADDRESS;
+    }
+    if (virtualEndAddr > virtualBaseAddr) {
+      freeMemoryRegion(virtualBaseAddr, virtualEndAddr);
+    }
   }
-  if ((uint64_t)vAddr < (uint64_t)&kernelEnd) {
-    return ERR_KERNEL_OVERLAP_VADDR;
+  for (uint32_t n = 0; n < nNumaNodes; n++) {
+    printk("Node %u high zone: %uKB\n", n,
+           zoneArray[n][ZONE_HIGH].nTotalPages * PAGE_SIZE / 1024);
   }
-  if ((vAddr + PAGE_SIZE) > KERNEL_SPACE_END_VIRTUAL_ADDRESS) {
-    return ERR_KERNEL_ADDR_LARGER_THAN_LIMIT;
+}
+
+// Return page frame descriptor of the page containing kernel space virtual
+// address vAddr (NULL if vAddr is outside the kernel space direct map)
+struct pageFrame *getPageFrame(uint64_t vAddr) {
+  if (vAddr < KERNEL_SPACE_BASE_VIRTUAL_ADDRESS ||
+      VADDR_TO_PFN(vAddr) >= nPageFrames) {
+    return NULL;
   }
+  return &pageFrameArray[VADDR_TO_PFN(vAddr)];
+}
 
-  struct page *pagePtr = (struct page *)vAddr;
-  spinLock(&memoryLock);
-  pagePtr->next = freePageList.next;
-  freePageList.next = pagePtr;
-  nFreePages++;
-  if (nAllocatedPages > 0) nAllocatedPages--;
+/*** PAGE OWNERSHIP ACCOUNTING ***/
+// Allocated pages per owner tag: each core counts the pages it allocates and
+// frees (the count of a core can be negative, a page can be freed by another
+// core), getMemoryStats sums the counts of all cores
+struct pageTagCounters {
+  int64_t nPagesArray[N_PAGE_TAGS];
+} __attribute__((aligned(64)));  // one cache line boundary per core
 
-  spinUnlock(&memoryLock);
-  return SUCCESS;
+static struct pageTagCounters pageTagCountersArray[MAX_N_CORES_SUPPORTED];
+
+// Tag the 2^order pages starting at page frame pfn and count them
+static void accountPages(uint64_t pfn, uint64_t order, uint64_t tag) {
+  for (uint64_t i = 0; i < (1ULL << order); i++) {
+    pageFrameArray[pfn + i].tag = tag;
+  }
+  __atomic_add_fetch(&pageTagCountersArray[getCoreId()].nPagesArray[tag],
+                     1ULL << order, __ATOMIC_RELAXED);
 }
 
-// Return void* ptr to next free page available
-void *kAllocPage(int64_t *errCode) {
-  *errCode = SUCCESS;
-  spinLock(&memoryLock);
-  struct page *pagePtr = freePageList.next;
-  if (pagePtr != NULL) {
-    if ((uint64_t)pagePtr & (PAGE_SIZE - 1)) {
-      printk("ERROR kAllocPage: misaligned address %x\n", pagePtr);
-      pagePtr = NULL;
-      *errCode = ERR_MISALIGNED_ADDR;
-    } else {
-      if ((uint64_t)pagePtr < (uint64_t)&kernelEnd) {
-        pagePtr = NULL;
-        printk("ERROR kAllocPage: address inside kernel image area\n");
-        *errCode = ERR_KERNEL_OVERLAP_VADDR;
-      } else {
-        if (((uint64_t)pagePtr) + PAGE_SIZE >
-            KERNEL_SPACE_END_VIRTUAL_ADDRESS) {
-          pagePtr = NULL;
-          printk("ERROR kAllocPage: address beyond kernel space limit\n");
-          *errCode = ERR_KERNEL_ADDR_LARGER_THAN_LIMIT;
-        } else {
-          if (pagePtr != NULL) freePageList.next = pagePtr->next;
-          nAllocatedPages++;
-          if (nFreePages > 0) nFreePages--;
-        }
-      }
-    }
+// Remove the 2^order pages starting at page frame pfn from the count of their
+// tag
+static void unaccountPages(uint64_t pfn, uint64_t order) {
+  __atomic_sub_fetch(
+      &pageTagCountersArray[getCoreId()].nPagesArray[pageFrameArray[pfn].tag],
+      1ULL << order, __ATOMIC_RELAXED);
+}
 
-  } else  // freeList page ptr is NULL
-  {
-    printk("ERROR kAllocPage: NULL free page list next pointer\n");
-    *errCode = ERR_ALLOC_FAILED;
-  }
-  spinUnlock(&memoryLock);
-  return (void *)pagePtr;
+// Change owner tag of the 2^order allocated pages starting at vAddr
+void kSetPageTag(uint64_t vAddr, uint64_t order, uint64_t tag) {
+  uint64_t pfn = VADDR_TO_PFN(vAddr);
+  unaccountPages(pfn, order);
+  accountPages(pfn, order, tag);
 }
 
-///*** x64 VIRTUAL MEMORY MANAGEMENT ***///
-// There are 4 levels (optionally 5 levels if supported by the CPU and enabled
-// in which case there is a PML5T) in the page directory tree In long mode there
-// are 512 8-byte entries per table/level PML4T: page-map level 4 table, one
-// entry addresses 512GB (total of 256TB at most) PDPT: page-directory pointer
-// table, one entry addresses 1GB PDT: page-directory table, one entry addresses
-// 2MB PT: page table, one entry addresses 4KB
+/*** USER PAGE REFERENCE COUNTS ***/
+// A user page can be mapped by more than one process (copy-on-write after
+// fork): the page is freed when the last PT entry mapping it is removed
 
-// WE USE 4KB pages: PML4T -> PDPT -> PDT -> PT
+// Set reference count of newly mapped user page at physical address pAddr
+static void setUserPageRefCount(uint64_t pAddr, uint32_t refCount) {
+  pageFrameArray[pAddr / PAGE_SIZE].refCount = refCount;
+}
 
-// Returns pointer to virtual address of PDPT (pointer to first entry) for input
-// virtual address if PML4T entry pointing to it exists or NULL if it does not
-// exist
-static uint64_t *getPDPTPointer(uint64_t *PML4TPtr, uint64_t vAddr) {
-  uint64_t PML4TEntryIndex = VADDR_TO_PML4T_INDEX(vAddr);
-  uint64_t *PDPTPtr = NULL;
+// Add reference to user page at physical address pAddr
+static void getUserPage(uint64_t pAddr) {
+  __atomic_add_fetch(&pageFrameArray[pAddr / PAGE_SIZE].refCount, 1,
+                     __ATOMIC_SEQ_CST);
+}
 
-  if ((PML4TPtr[PML4TEntryIndex] & PAGE_DIRECTORY_ENTRY_PRESENT)) {
-    PDPTPtr = (uint64_t *)PADDR_TO_VADDR(
-        EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(PML4TPtr[PML4TEntryIndex]));
+// Remove reference to user page at physical address pAddr and free it if it
+// was the last one
+static int64_t putUserPage(uint64_t pAddr) {
+  if (__atomic_sub_fetch(&pageFrameArray[pAddr / PAGE_SIZE].refCount, 1,
+                         __ATOMIC_SEQ_CST) == 0) {
+    return kFreePage(PADDR_TO_VADDR(pAddr));
   }
-  return PDPTPtr;
+  return SUCCESS;
 }
 
-// Return pointer to virtual address of PDT (first entry) for input virtual
-// address if PDPT entry pointing to it exists or NULL if it does not exist
-static uint64_t *getPDTPointer(uint64_t *PML4TPtr, uint64_t vAddr) {
-  uint64_t PDPTEntryIndex = VADDR_TO_PDPT_INDEX(vAddr);
-  uint64_t *PDPTPtr = NULL;
-  uint64_t *PDTPtr = NULL;
+// Return NUMA node of the running core
+static uint32_t getLocalNode() {
+  uint32_t nodeId = acpiCoreNumaNodeIds[getCoreId()];
+  return nodeId < nNumaNodes ? nodeId : 0;
+}
 
-  PDPTPtr = getPDPTPointer(PML4TPtr, vAddr);
+// Return i-th zone (0 <= i < N_MEMORY_ZONES * nNumaNodes) in allocation order
+// for a core of node localNode
+// Kernel pages: kernel zone then high zone of each node, nodes by increasing
+// distance (a page of the local node is preferred to a kernel zone page)
+// User pages: high zones of all nodes by increasing distance, then kernel
+// zones (the kernel zone is kept for kernel data structures)
+static struct memoryZone *getPreferredZone(uint32_t localNode, int isUserPage,
+                                           uint32_t i) {
+  if (!isUserPage) {
+    return &zoneArray[nodeOrderArray[localNode][i / N_MEMORY_ZONES]]
+                     [i % N_MEMORY_ZONES == 0 ? ZONE_KERNEL : ZONE_HIGH];
+  }
+  return &zoneArray[nodeOrderArray[localNode][i % nNumaNodes]]
+                   [i < nNumaNodes ? ZONE_HIGH : ZONE_KERNEL];
+}
 
-  if (PDPTPtr != NULL &&
-      (PDPTPtr[PDPTEntryIndex] & PAGE_DIRECTORY_ENTRY_PRESENT)) {
-    PDTPtr = (uint64_t *)PADDR_TO_VADDR(
-        EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(PDPTPtr[PDPTEntryIndex]));
+// Return page frame number of a free block of given order from the first zone
+// with one in allocation order (see getPreferredZone), -1 if there is none
+static int64_t allocPreferredBlock(uint64_t order, int isUserPage) {
+  uint32_t localNode = getLocalNode();
+  int64_t pfn = -1;
+  for (uint32_t i = 0; i < N_MEMORY_ZONES * nNumaNodes && pfn < 0; i++) {
+    struct memoryZone *zone = getPreferredZone(localNode, isUserPage, i);
+    if (zone->nTotalPages == 0) {
+      continue;
+    }
+    spinLock(&zone->lock);
+    pfn = allocBlock(zone, order);
+    spinUnlock(&zone->lock);
   }
-  return PDTPtr;
+  return pfn;
 }
 
-// Return pointer to virtual address of PT (first entry) for input virtual
-// address if PDT entry pointing to it exists or NULL if it does not exist
-static uint64_t *getPTPointer(uint64_t *PML4TPtr, uint64_t vAddr) {
-  uint64_t PDTEntryIndex = VADDR_TO_PDT_INDEX(vAddr);
-  uint64_t *PDTPtr = NULL;
-  uint64_t *PTPtr = NULL;
+// Allocate 2^order physically contiguous pages (aligned to 2^order pages)
+// from the kernel zone of the running core's node, or from the closest node
+// (or high zone) with a free block of that order
+void *kAllocPages(uint64_t order, int64_t *errCode) {
+  *errCode = SUCCESS;
+  if (order > MAX_PAGE_ORDER) {
+    printk("ERROR kAllocPages: order %u larger than max order\n", order);
+    *errCode = ERR_ALLOC_FAILED;
+    return NULL;
+  }
+  int64_t pfn = allocPreferredBlock(order, 0);
+  if (pfn < 0) {
+    printk("ERROR kAllocPages: no free block of order %u\n", order);
+    *errCode = ERR_ALLOC_FAILED;
+    return NULL;
+  }
+  accountPages(pfn, order, PAGE_TAG_KERNEL);
+  return (void *)PFN_TO_VADDR(pfn);
+}
 
-  PDTPtr = getPDTPointer(PML4TPtr, vAddr);
+// Free 2^order contiguous pages allocated by kAllocPages
+int64_t kFreePages(uint64_t vAddr, uint64_t order) {
+  if (order > MAX_PAGE_ORDER) {
+    return ERR_ALLOC_FAILED;
+  }
+  if (VADDR_TO_PADDR(vAddr) & ((PAGE_SIZE << order) - 1)) {
+    return ERR_MISALIGNED_ADDR;
+  }
+  if (vAddr < (uint64_t)&kernelEnd) {
+    return ERR_KERNEL_OVERLAP_VADDR;
+  }
+  if ((vAddr + (PAGE_SIZE << order)) > memoryEndAddress) {
+    return ERR_KERNEL_ADDR_LARGER_THAN_LIMIT;
+  }
+  struct memoryZone *zone = PFN_TO_ZONE(VADDR_TO_PFN(vAddr));
+  unaccountPages(VADDR_TO_PFN(vAddr), order);
+  spinLock(&zone->lock);
+  freeBlock(zone, VADDR_TO_PFN(vAddr), order);
+  spinUnlock(&zone->lock);
+  return SUCCESS;
+}
 
-  if (PDTPtr != NULL &&
-      (PDTPtr[PDTEntryIndex] & PAGE_DIRECTORY_ENTRY_PRESENT)) {
-    PTPtr = (uint64_t *)PADDR_TO_VADDR(
-        EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(PDTPtr[PDTEntryIndex]));
+/*** 2MB USER PAGES ***/
+// Anonymous user memory is mapped with 2MB pages (one PDT entry, no PT) where
+// a whole 2MB-aligned block of a virtual memory area is populated at once,
+// using a free order HUGE_PAGE_ORDER block of the buddy allocator; the 4KB
+// page path is used if there is no free block (fragmentation)
+// A 2MB mapping holds one reference to each of its 512 pages: it can be split
+// into a PT with 512 entries (partial unmap, copy-on-write) without changing
+// the reference counts, and its pages are then freed one by one
+#define HUGE_PAGE_ORDER 9
+#define N_HUGE_PAGE_PAGES (PAGE_SIZE_2MB / PAGE_SIZE)
+
+// Return a 2MB block of user pages (zeroed out if isZeroed) with reference
+// counts set to 1, NULL if no zone has a free block of that size
+static void *allocHugeUserPage(int isZeroed) {
+  int64_t pfn = allocPreferredBlock(HUGE_PAGE_ORDER, 1);
+  if (pfn < 0) {
+    return NULL;
   }
-  return PTPtr;
+  accountPages(pfn, HUGE_PAGE_ORDER, PAGE_TAG_USER);
+  for (uint64_t i = 0; i < N_HUGE_PAGE_PAGES; i++) {
+    pageFrameArray[pfn + i].refCount = 1;
+    if (isZeroed) {
+      // 2MB would evict the data cache: bypass it
+      zeroPageNonTemporal((void *)PFN_TO_VADDR(pfn + i));
+    }
+  }
+  return (void *)PFN_TO_VADDR(pfn);
 }
 
-// If a PDT entry pointing to a PT (first
-// entry) for the input virtual address does not exist: allocate a page for
-// PT, zero initialize the page, create PDT entry and return pointer to
-// zero-initialized page
-// Recursively allocate PML4T, PDPT and PDT for vAddr if they do not exist
-static uint64_t *createPDTEntryAllocatePT(uint64_t *PML4TPtr, uint64_t vAddr,
-                                          uint64_t attributes) {
-  uint64_t PML4TEntryIndex = VADDR_TO_PML4T_INDEX(vAddr);
-  uint64_t PDPTEntryIndex = VADDR_TO_PDPT_INDEX(vAddr);
-  uint64_t PDTEntryIndex = VADDR_TO_PDT_INDEX(vAddr);
-  uint64_t *PDPTPtr = NULL;
-  uint64_t *PDTPtr = NULL;
-  uint64_t *PTPtr = NULL;
-  int64_t errCode = SUCCESS;
+// Add a reference to each page of the 2MB page at physical address pAddr
+static void getHugeUserPage(uint64_t pAddr) {
+  for (uint64_t i = 0; i < N_HUGE_PAGE_PAGES; i++) {
+    getUserPage(pAddr + i * PAGE_SIZE);
+  }
+}
 
-  if ((PML4TPtr[PML4TEntryIndex] & PAGE_DIRECTORY_ENTRY_PRESENT)) {
-    PDPTPtr = (uint64_t *)PADDR_TO_VADDR(
-        EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(PML4TPtr[PML4TEntryIndex]));
-  } else {
-    PDPTPtr = kAllocPage(&errCode);
-    if (PDPTPtr != NULL) {
-      memset(PDPTPtr, 0, PAGE_SIZE);
-    } else {
-      printk("ERROR createPDTEntryAllocatePT: kAllocPage for PDPT failed\n");
-      KERNEL_PANIC(errCode);
+// Returns 1 if the 2MB mapping of the pages at physical address pAddr holds
+// the only reference to each of them, 0 otherwise
+// Other processes can only get a reference from a mapping they already have:
+// the result does not change while the caller holds the mapping
+static int isHugeUserPageExclusive(uint64_t pAddr) {
+  for (uint64_t i = 0; i < N_HUGE_PAGE_PAGES; i++) {
+    if (__atomic_load_n(&pageFrameArray[pAddr / PAGE_SIZE + i].refCount,
+                        __ATOMIC_SEQ_CST) != 1) {
+      return 0;
     }
-    PML4TPtr[PML4TEntryIndex] = VADDR_TO_PADDR(PDPTPtr) | attributes;
   }
+  return 1;
+}
 
-  if ((PDPTPtr[PDPTEntryIndex] & PAGE_DIRECTORY_ENTRY_PRESENT)) {
-    PDTPtr = (uint64_t *)PADDR_TO_VADDR(
-        EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(PDPTPtr[PDPTEntryIndex]));
-  } else {
-    PDTPtr = kAllocPage(&errCode);
-    if (PDTPtr != NULL) {
-      memset(PDTPtr, 0, PAGE_SIZE);
-    } else {
-      printk("ERROR createPDTEntryAllocatePT: kAllocPage for PDT failed\n");
-      KERNEL_PANIC(errCode);
+// Remove the references of a 2MB mapping to the pages at physical address
+// pAddr: the block is returned to the buddy allocator at once if no other
+// mapping references its pages, otherwise the pages are freed one by one when
+// their last reference is removed
+static int64_t putHugeUserPage(uint64_t pAddr) {
+  if (isHugeUserPageExclusive(pAddr)) {
+    for (uint64_t i = 0; i < N_HUGE_PAGE_PAGES; i++) {
+      setUserPageRefCount(pAddr + i * PAGE_SIZE, 0);
     }
-    PDPTPtr[PDPTEntryIndex] = VADDR_TO_PADDR(PDTPtr) | attributes;
+    return kFreePages(PADDR_TO_VADDR(pAddr), HUGE_PAGE_ORDER);
   }
+  for (uint64_t i = 0; i < N_HUGE_PAGE_PAGES; i++) {
+    int64_t errCode = putUserPage(pAddr + i * PAGE_SIZE);
+    if (errCode != SUCCESS) {
+      return errCode;
+    }
+  }
+  return SUCCESS;
+}
 
-  // if PDT entry (PDPT) exists and PDT entry is not present
-  if (PDTPtr[PDTEntryIndex] & PAGE_DIRECTORY_ENTRY_PRESENT) {
-    PTPtr = (uint64_t *)PADDR_TO_VADDR(
-        EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(PDTPtr[PDTEntryIndex]));
-  } else {
-    uint64_t f = (uint64_t)freePageList.next;
-    PTPtr = kAllocPage(&errCode);
-    if (PTPtr != NULL) {
-      memset(PTPtr, 0, PAGE_SIZE);
-    } else {
-      printk("ERROR createPDTEntryAllocatePT: kAllocPage for PT failed %x\n",
-             f);
-      KERNEL_PANIC(errCode);
+// Move PAGE_CACHE_BATCH_SIZE pages (or as many as available) from the
+// zone buddy allocator to the cache
+// Return number of pages moved, 0 if there is no free memory in the zone
+static uint64_t refillPageCache(struct memoryZone *zone,
+                                struct pageCache *cache) {
+  uint64_t nMovedPages = 0;
+  spinLock(&zone->lock);
+  while (nMovedPages < PAGE_CACHE_BATCH_SIZE) {
+    int64_t pfn = allocBlock(zone, 0);
+    if (pfn < 0) {
+      break;
     }
-    PDTPtr[PDTEntryIndex] = VADDR_TO_PADDR(PTPtr) | attributes;
+    cache->pages[cache->nPages++] = (struct page *)PFN_TO_VADDR(pfn);
+    nMovedPages++;
   }
-  return PTPtr;
+  spinUnlock(&zone->lock);
+  if (nMovedPages > 0) {
+    cache->nRefills++;
+  }
+  return nMovedPages;
 }
 
-// Create page table mappings for all physical pages between pStartAddr and
-// (pStartAddr + vEndAddr - vStartAddr) to virtual pages between vStartAddr and
-// vEndAddr (after aligning virtual addresses to page boundaries)
-// pStartAddr must be page-aligned
-int kMapPagesForAddrRange(uint64_t *pml4tPtr, uint64_t vStartAddr,
-                          uint64_t vEndAddr, uint64_t pStartAddr,
-                          uint64_t pageAttributes) {
-  uint64_t vStartAddrAligned = PAGE_ALIGN_ADDR_DOWN(vStartAddr);
-  uint64_t vEndAddrAligned = PAGE_ALIGN_ADDR_UP(vEndAddr);
+// Move the PAGE_CACHE_BATCH_SIZE least recently freed pages of the cache to
+// the zone buddy allocator (most recently freed pages are more likely to be
+// still in the core's data cache and are kept)
+static void drainPageCache(struct memoryZone *zone, struct pageCache *cache) {
+  spinLock(&zone->lock);
+  for (uint64_t i = 0; i < PAGE_CACHE_BATCH_SIZE; i++) {
+    freeBlock(zone, VADDR_TO_PFN(cache->pages[i]), 0);
+  }
+  spinUnlock(&zone->lock);
+  cache->nPages -= PAGE_CACHE_BATCH_SIZE;
+  for (uint64_t i = 0; i < cache->nPages; i++) {
+    cache->pages[i] = cache->pages[i + PAGE_CACHE_BATCH_SIZE];
+  }
+  cache->nDrains++;
+}
 
-  if (vEndAddr < vStartAddr) {
-    printk("ERROR kMapPagesForAddrRange: negative address range\n");
-    return ERR_NEG_ADDR_RANGE;
+// Add page at virtual address vAddr to the running core's page cache of the
+// zone containing the page (drain the cache to the buddy allocator if full)
+// Pages of another NUMA node are returned to their zone buddy allocator
+// It popoulates the memory pointed by vAddr with a page struct
+static void releasePage(uint64_t vAddr) {
+  uint64_t pfn = VADDR_TO_PFN(vAddr);
+  struct memoryZone *zone = PFN_TO_ZONE(pfn);
+  // the running core must not change and an interrupt handler must not access
+  // the core's cache while it is modified
+  uint64_t flags = saveFlagsAndCli();
+  if (zone->nodeId != getLocalNode()) {
+    spinLock(&zone->lock);
+    freeBlock(zone, pfn, 0);
+    spinUnlock(&zone->lock);
+    restoreFlags(flags);
+    return;
   }
-  if (pStartAddr & (PAGE_SIZE - 1)) {  // % PAGE_SIZE
-    printk("ERROR kMapPagesForAddrRange: pStartAddr is not page-aligned\n");
+  struct pageCache *cache = &pageCacheArray[getCoreId()][zone->zoneIndex];
+  if (cache->nPages == PAGE_CACHE_SIZE) {
+    drainPageCache(zone, cache);
+  }
+  cache->pages[cache->nPages++] = (struct page *)vAddr;
+  restoreFlags(flags);
+}
+
+// Free page at virtual address vAddr allocated by kAllocPage, kAllocUserPage
+// or their zeroed variants (see releasePage)
+int64_t kFreePage(uint64_t vAddr) {
+  if (((uint64_t)vAddr) & (PAGE_SIZE - 1)) {
     return ERR_MISALIGNED_ADDR;
   }
-  if (vEndAddrAligned > KERNEL_SPACE_END_VIRTUAL_ADDRESS) {
-    printk(
-        "ERROR kMapPagesForAddrRange: vEndAddrAligned larger than kernel "
-        "limit\n");
+  if ((uint64_t)vAddr < (uint64_t)&kernelEnd) {
+    return ERR_KERNEL_OVERLAP_VADDR;
+  }
+  if ((vAddr + PAGE_SIZE) > memoryEndAddress) {
     return ERR_KERNEL_ADDR_LARGER_THAN_LIMIT;
   }
-  do {
-    uint64_t *ptPtr = getPTPointer(pml4tPtr, vStartAddrAligned);
-    if (ptPtr == NULL) {
-      ptPtr =
-          createPDTEntryAllocatePT(pml4tPtr, vStartAddrAligned, pageAttributes);
-    }
-    if (ptPtr == NULL) {
-      printk("ERROR kMapPagesForAddrRange: allocating page for PT failed\n");
-      return ERR_ALLOC_FAILED;
-    }
-    uint64_t ptIndex = VADDR_TO_PT_INDEX(vStartAddrAligned);
-    if (ptPtr[ptIndex] & PAGE_DIRECTORY_ENTRY_PRESENT) {
-      printk(
-          "ERROR kMapPagesForAddrRange PT: attempt to map a page that was "
-          "already "
-          "mapped: %d (%x) \n",
-          ptIndex, vStartAddrAligned);
-      return ERR_PAGE_IS_ALREADY_MAPPED;
-    }
-    ptPtr[ptIndex] = pStartAddr | pageAttributes;
-    vStartAddrAligned += PAGE_SIZE;
-    pStartAddr += PAGE_SIZE;
-
-  } while (vStartAddrAligned + PAGE_SIZE <= vEndAddrAligned);
+  unaccountPages(VADDR_TO_PFN(vAddr), 0);
+  releasePage(vAddr);
+  return SUCCESS;
+}
+
+// Return next free page of zone zoneIndex of the running core's node from the
+// core's page cache (refill the cache from the zone buddy allocator if empty),
+// NULL if the zone has no free pages
+static struct page *allocCachedPage(uint64_t zoneIndex) {
+  struct page *pagePtr = NULL;
+  uint64_t flags = saveFlagsAndCli();
+  struct pageCache *cache = &pageCacheArray[getCoreId()][zoneIndex];
+  if (cache->nPages > 0) {
+    cache->nHits++;
+  } else {
+    cache->nMisses++;
+    refillPageCache(&zoneArray[getLocalNode()][zoneIndex], cache);
+  }
+  if (cache->nPages > 0) {
+    pagePtr = cache->pages[--cache->nPages];
+  }
+  restoreFlags(flags);
+  return pagePtr;
+}
+
+// Return a free page of zone: zones of the running core's node are served by
+// the core's page cache, zones of other nodes by their buddy allocator
+// NULL if the zone has no free pages
+static struct page *allocZonePage(struct memoryZone *zone) {
+  if (zone->nodeId == getLocalNode()) {
+    return allocCachedPage(zone->zoneIndex);
+  }
+  uint64_t flags = saveFlagsAndCli();
+  spinLock(&zone->lock);
+  int64_t pfn = allocBlock(zone, 0);
+  spinUnlock(&zone->lock);
+  if (pfn >= 0) {
+    pageCacheArray[getCoreId()][zone->zoneIndex].nRemoteAllocs++;
+  }
+  restoreFlags(flags);
+  return pfn < 0 ? NULL : (struct page *)PFN_TO_VADDR(pfn);
+}
+
+// Return a page of zone from its zeroed page pool, NULL if the pool is empty
+static struct page *takeZeroedPage(struct memoryZone *zone) {
+  struct zeroedPagePool *pool =
+      &zeroedPagePoolArray[zone->nodeId][zone->zoneIndex];
+  struct page *pagePtr = NULL;
+  uint64_t flags = saveFlagsAndCli();
+  spinLock(&pool->lock);
+  if (pool->nPages > 0) {
+    pagePtr = pool->pages[--pool->nPages];
+  }
+  spinUnlock(&pool->lock);
+  restoreFlags(flags);
+  return pagePtr;
+}
+
+// Return a zeroed out page of zone: take it from the zeroed page pool or zero
+// out a free page of the zone if the pool is empty, NULL if the zone has no
+// free pages
+static struct page *allocZeroedPage(struct memoryZone *zone) {
+  struct zeroedPagePool *pool =
+      &zeroedPagePoolArray[zone->nodeId][zone->zoneIndex];
+  struct page *pagePtr = takeZeroedPage(zone);
+  if (pagePtr != NULL) {
+    __atomic_add_fetch(&pool->nHits, 1, __ATOMIC_RELAXED);
+    return pagePtr;
+  }
+  __atomic_add_fetch(&pool->nMisses, 1, __ATOMIC_RELAXED);
+  pagePtr = allocZonePage(zone);
+  if (pagePtr != NULL) {
+    memset(pagePtr, 0, PAGE_SIZE);
+  }
+  return pagePtr;
+}
+
+// Return a free (zeroed out if isZeroed) kernel or user page from the first
+// zone with free pages in allocation order (see getPreferredZone), NULL if
+// there is none
+// Pages of the zeroed page pools are used for non-zeroed allocations only if
+// there is no other free page
+static struct page *allocPreferredPage(int isUserPage, int isZeroed) {
+  uint32_t localNode = getLocalNode();
+  uint32_t nZones = N_MEMORY_ZONES * nNumaNodes;
+  struct page *pagePtr = NULL;
+  for (uint32_t i = 0; i < nZones && pagePtr == NULL; i++) {
+    struct memoryZone *zone = getPreferredZone(localNode, isUserPage, i);
+    if (zone->nTotalPages == 0) {
+      continue;
+    }
+    pagePtr = isZeroed ? allocZeroedPage(zone) : allocZonePage(zone);
+  }
+  for (uint32_t i = 0; i < nZones && pagePtr == NULL && !isZeroed; i++) {
+    pagePtr = takeZeroedPage(getPreferredZone(localNode, isUserPage, i));
+  }
+  if (pagePtr != NULL) {
+    accountPages(VADDR_TO_PFN(pagePtr), 0,
+                 isUserPage ? PAGE_TAG_USER : PAGE_TAG_KERNEL);
+  }
+  return pagePtr;
+}
+
+// Return void* ptr to next free page of the kernel zone (high zone of the
+// running core's node if its kernel zone is exhausted)
+void *kAllocPage(int64_t *errCode) {
+  *errCode = SUCCESS;
+  struct page *pagePtr = allocPreferredPage(0, 0);
+  if (pagePtr == NULL) {
+    printk("ERROR kAllocPage: no free pages\n");
+    *errCode = ERR_ALLOC_FAILED;
+  }
+  return (void *)pagePtr;
+}
+
+// Return void* ptr to next free page for user space: pages come from the
+// high zones, the kernel zones are used only when the high zones are exhausted
+void *kAllocUserPage(int64_t *errCode) {
+  *errCode = SUCCESS;
+  struct page *pagePtr = allocPreferredPage(1, 0);
+  if (pagePtr == NULL) {
+    printk("ERROR kAllocUserPage: no free pages\n");
+    *errCode = ERR_ALLOC_FAILED;
+  }
+  return (void *)pagePtr;
+}
+
+// Return void* ptr to a zeroed out kernel page (page tables, ring0 stacks),
+// same zone order as kAllocPage
+void *kAllocZeroedPage(int64_t *errCode) {
+  *errCode = SUCCESS;
+  struct page *pagePtr = allocPreferredPage(0, 1);
+  if (pagePtr == NULL) {
+    printk("ERROR kAllocZeroedPage: no free pages\n");
+    *errCode = ERR_ALLOC_FAILED;
+  }
+  return (void *)pagePtr;
+}
+
+// Return void* ptr to a zeroed out page for user space (high zone if
+// available, see kAllocUserPage)
+void *kAllocZeroedUserPage(int64_t *errCode) {
+  *errCode = SUCCESS;
+  struct page *pagePtr = allocPreferredPage(1, 1);
+  if (pagePtr == NULL) {
+    printk("ERROR kAllocZeroedUserPage: no free pages\n");
+    *errCode = ERR_ALLOC_FAILED;
+  }
+  return (void *)pagePtr;
+}
+
+// Zero out free pages of the running core's node and add them to the node's
+// zeroed page pools until the pools are full or the zones run out of free
+// pages
+// Called by the idle process of each core with interrupts enabled: zeroing is
+// preemptible, interrupts are disabled only while a pool is updated
+void refillZeroedPagePools() {
+  uint32_t nodeId = getLocalNode();
+  for (uint64_t z = 0; z < N_MEMORY_ZONES; z++) {
+    struct zeroedPagePool *pool = &zeroedPagePoolArray[nodeId][z];
+    if (zoneArray[nodeId][z].nTotalPages == 0) {
+      continue;
+    }
+    while (__atomic_load_n(&pool->nPages, __ATOMIC_RELAXED) <
+           ZEROED_PAGE_POOL_SIZE) {
+      struct page *pagePtr = allocCachedPage(z);
+      if (pagePtr == NULL) {
+        break;
+      }
+      zeroPageNonTemporal(pagePtr);
+      uint64_t flags = saveFlagsAndCli();
+      spinLock(&pool->lock);
+      int isPoolFull = pool->nPages == ZEROED_PAGE_POOL_SIZE;
+      if (!isPoolFull) {
+        pool->pages[pool->nPages++] = pagePtr;
+        pool->nZeroedPages++;
+      }
+      spinUnlock(&pool->lock);
+      restoreFlags(flags);
+      if (isPoolFull) {  // filled by another core
+        releasePage((uint64_t)pagePtr);
+        break;
+      }
+    }
+  }
+}
+
+///*** x64 VIRTUAL MEMORY MANAGEMENT ***///
+// There are 4 levels (optionally 5 levels if supported by the CPU and enabled
+// in which case there is a PML5T) in the page directory tree In long mode there
+// are 512 8-byte entries per table/level PML4T: page-map level 4 table, one
+// entry addresses 512GB (total of 256TB at most) PDPT: page-directory pointer
+// table, one entry addresses 1GB PDT: page-directory table, one entry addresses
+// 2MB PT: page table, one entry addresses 4KB
+
+// User space uses 4KB pages: PML4T -> PDPT -> PDT -> PT, and 2MB pages
+// (PML4T -> PDPT -> PDT) for anonymous memory (see 2MB USER PAGES)
+// Kernel space (direct map of physical memory) and LAPIC/IOAPIC identity
+// mappings use 1GB pages (PML4T -> PDPT) if supported by the CPU or 2MB pages
+// (PML4T -> PDPT -> PDT)
+
+// Set by kInitVM if the CPU supports 1GB pages
+static int largePage1GBSupported;
+
+// Return 1 if 1GB pages are supported (CPUID.80000001H:EDX.Page1GB[bit 26])
+static int cpuSupports1GBPages() {
+  uint32_t eax = 0x80000000;
+  uint32_t ebx, ecx, edx;
+  __asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+  if (eax < 0x80000001) {  // extended function not available
+    return 0;
+  }
+  eax = 0x80000001;
+  __asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+  return (edx >> 26) & 1;
+}
+
+// Return 1 if process-context identifiers are supported
+// (CPUID.01H:ECX.PCID[bit 17])
+static int cpuSupportsPCID() {
+  uint32_t eax = 1;
+  uint32_t ebx, ecx, edx;
+  __asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+  return (ecx >> 17) & 1;
+}
+
+/*** TLB MANAGEMENT ***/
+// The kernel space direct map uses global pages: its TLB entries survive CR3
+// loads
+// If the CPU supports PCIDs, TLB entries are tagged with the PCID in CR3 bits
+// 0-11: each core assigns PCIDs 1 to N_PCID_SLOTS to the address spaces it ran
+// most recently (PCID 0 is the kernel page table) and switching to one of them
+// loads CR3 with bit 63 set, which keeps its TLB entries
+// A process can run on several cores over time, while its mappings are only
+// changed by the core it is running on: removing or downgrading a mapping
+// increments the address space TLB generation (tlbGen) and a core whose PCID
+// slot records an older generation flushes the PCID when it switches to the
+// address space again
+// Lazy TLB: idle processes only run kernel code and keep the page table of the
+// previous process loaded, so a core going idle and back to the same process
+// does not load CR3 at all
+// TLB shootdown: mappings changed by the running core are invalidated on the
+// other cores running the same address space (all cores for kernel space
+// mappings) through a batch sent in one IPI per core (see smpCallFunction)
+// Cores borrowing the page table (lazy TLB) are skipped: they flush through the
+// TLB generation check before running the address space again
+#define N_PCID_SLOTS 6
+#define TLB_SHOOTDOWN_BENCHMARK_ITERATIONS 200
+#define CR3_NO_FLUSH (1ULL << 63)
+
+struct pcidSlot {
+  uint64_t addressSpaceId;  // 0: unused
+  uint64_t tlbGen;          // address space TLB generation last flushed
+};
+
+struct tlbState {
+  uint64_t *loadedPml4tPtr;  // page table in CR3
+  uint64_t loadedTlbGen;     // TLB generation of loadedPml4tPtr address space
+  uint64_t isLazy;           // 1: idle process borrowing loadedPml4tPtr
+  struct pcidSlot slotArray[N_PCID_SLOTS];
+  uint64_t nextVictimSlot;  // round-robin slot replacement
+  // page tables unloaded by switchAddressSpace and waiting to be freed outside
+  // the scheduler (see freeReleasedAddressSpaces)
+  uint64_t *releasedPml4tPtr;
+  struct tlbStats stats;
+} __attribute__((aligned(64)));  // one cache line boundary per core
+
+static struct tlbState tlbStateArray[MAX_N_CORES_SUPPORTED];
+static uint64_t nextAddressSpaceId;
+
+// Lock for deferred page table release (see freeVM)
+static volatile uint8_t deferredFreeLock;
+
+// Invalidate TLB entry of page containing vAddr on the running core
+static void flushTLBPage(uint64_t vAddr) {
+  tlbStateArray[getCoreId()].stats.nPageInvalidations++;
+  invalidatePage(vAddr);
+}
+
+// Flush non-global TLB entries of the current address space on the running
+// core (the PCID in CR3 is kept)
+static void flushTLB() {
+  tlbStateArray[getCoreId()].stats.nFullFlushes++;
+  loadCR3(readCR3());
+}
+
+// Record that mappings of the current address space were removed or
+// downgraded (and flushed on the running core): other cores flush the TLB
+// entries tagged with its PCID before running it again
+static void tlbGenIncrement(struct vmSpace *vmSpacePtr) {
+  uint64_t tlbGen =
+      __atomic_add_fetch(&vmSpacePtr->tlbGen, 1, __ATOMIC_SEQ_CST);
+  struct tlbState *state = &tlbStateArray[getCoreId()];
+  state->loadedTlbGen = tlbGen;
+  for (int i = 0; vmSpacePtr->addressSpaceId != 0 && i < N_PCID_SLOTS; i++) {
+    if (state->slotArray[i].addressSpaceId == vmSpacePtr->addressSpaceId) {
+      state->slotArray[i].tlbGen = tlbGen;
+    }
+  }
+}
+
+// Start an empty TLB shootdown batch for address space vmSpacePtr
+void tlbShootdownInit(struct tlbShootdownBatch *batch,
+                      struct vmSpace *vmSpacePtr, uint64_t *pml4tPtr) {
+  batch->vmSpacePtr = vmSpacePtr;
+  batch->pml4tPtr = pml4tPtr;
+  batch->flushAll = 0;
+  batch->nPages = 0;
+}
+
+// Add the pages in [vStartAddr, vEndAddr[ to batch: past
+// TLB_SHOOTDOWN_BATCH_SIZE pages the whole TLB is flushed
+void tlbShootdownAddRange(struct tlbShootdownBatch *batch, uint64_t vStartAddr,
+                          uint64_t vEndAddr) {
+  vStartAddr = PAGE_ALIGN_ADDR_DOWN(vStartAddr);
+  if (batch->flushAll || vStartAddr >= vEndAddr) {
+    return;
+  }
+  if ((vEndAddr - vStartAddr + PAGE_SIZE - 1) / PAGE_SIZE >
+      TLB_SHOOTDOWN_BATCH_SIZE - batch->nPages) {
+    batch->flushAll = 1;
+    return;
+  }
+  for (uint64_t vAddr = vStartAddr; vAddr < vEndAddr; vAddr += PAGE_SIZE) {
+    batch->vAddrArray[batch->nPages++] = vAddr;
+  }
+}
+
+// Invalidate the batch pages on the running core
+static void tlbShootdownLocal(struct tlbShootdownBatch *batch) {
+  if (batch->flushAll) {
+    if (batch->vmSpacePtr == NULL) {
+      tlbStateArray[getCoreId()].stats.nFullFlushes++;
+      flushGlobalTLB();
+    } else {
+      flushTLB();
+    }
+  } else {
+    for (uint64_t i = 0; i < batch->nPages; i++) {
+      flushTLBPage(batch->vAddrArray[i]);
+    }
+  }
+}
+
+// Run on the cores targeted by a shootdown (IPI handler, see smpCallFunction)
+static void tlbShootdownRemote(void *arg) {
+  struct tlbShootdownBatch *batch = arg;
+  // the core may have switched to another address space in the meantime:
+  // the CR3 load flushed the TLB or the TLB generation check will
+  if (batch->vmSpacePtr != NULL &&
+      tlbStateArray[getCoreId()].loadedPml4tPtr != batch->pml4tPtr) {
+    return;
+  }
+  tlbShootdownLocal(batch);
+}
+
+// Invalidate the batch pages on the running core and on the other cores
+// running the address space, then empty the batch
+void tlbShootdownFlush(struct tlbShootdownBatch *batch) {
+  if (!batch->flushAll && batch->nPages == 0) {
+    return;
+  }
+  tlbShootdownLocal(batch);
+  uint64_t coreId = getCoreId();
+  uint64_t coreMask = 0;
+  if (batch->vmSpacePtr == NULL) {
+    coreMask = getOnlineCoreMask() & ~(1ULL << coreId);
+  } else {
+    // a core switching to the address space publishes loadedPml4tPtr before
+    // reading the TLB generation: either it is seen here or it sees the new
+    // generation and flushes
+    tlbGenIncrement(batch->vmSpacePtr);
+    for (uint64_t i = 0; i < MAX_N_CORES_SUPPORTED; i++) {
+      if (i != coreId &&
+          __atomic_load_n(&tlbStateArray[i].loadedPml4tPtr,
+                          __ATOMIC_SEQ_CST) == batch->pml4tPtr &&
+          !__atomic_load_n(&tlbStateArray[i].isLazy, __ATOMIC_SEQ_CST)) {
+        coreMask |= 1ULL << i;
+      }
+    }
+  }
+  if (coreMask != 0) {
+    struct tlbStats *stats = &tlbStateArray[coreId].stats;
+    stats->nShootdowns++;
+    for (uint64_t i = 0; i < MAX_N_CORES_SUPPORTED; i++) {
+      if (coreMask & (1ULL << i)) {
+        stats->nShootdownIPIs++;
+      }
+    }
+    smpCallFunction(coreMask, tlbShootdownRemote, batch);
+  }
+  batch->flushAll = 0;
+  batch->nPages = 0;
+}
+
+// Returns pointer to virtual address of PDPT (pointer to first entry) for input
+// virtual address if PML4T entry pointing to it exists or NULL if it does not
+// exist
+static uint64_t *getPDPTPointer(uint64_t *PML4TPtr, uint64_t vAddr) {
+  uint64_t PML4TEntryIndex = VADDR_TO_PML4T_INDEX(vAddr);
+  uint64_t *PDPTPtr = NULL;
+
+  if ((PML4TPtr[PML4TEntryIndex] & PAGE_DIRECTORY_ENTRY_PRESENT)) {
+    PDPTPtr = (uint64_t *)PADDR_TO_VADDR(
+        EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(PML4TPtr[PML4TEntryIndex]));
+  }
+  return PDPTPtr;
+}
+
+// Return pointer to virtual address of PDT (first entry) for input virtual
+// address if PDPT entry pointing to it exists or NULL if it does not exist or
+// if the PDPT entry maps a 1GB page
+static uint64_t *getPDTPointer(uint64_t *PML4TPtr, uint64_t vAddr) {
+  uint64_t PDPTEntryIndex = VADDR_TO_PDPT_INDEX(vAddr);
+  uint64_t *PDPTPtr = NULL;
+  uint64_t *PDTPtr = NULL;
+
+  PDPTPtr = getPDPTPointer(PML4TPtr, vAddr);
+
+  if (PDPTPtr != NULL &&
+      (PDPTPtr[PDPTEntryIndex] & PAGE_DIRECTORY_ENTRY_PRESENT) &&
+      !(PDPTPtr[PDPTEntryIndex] & PAGE_DIRECTORY_SIZE_1GB)) {
+    PDTPtr = (uint64_t *)PADDR_TO_VADDR(
+        EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(PDPTPtr[PDPTEntryIndex]));
+  }
+  return PDTPtr;
+}
+
+// Return pointer to virtual address of PT (first entry) for input virtual
+// address if PDT entry pointing to it exists or NULL if it does not exist or
+// if the PDT entry maps a 2MB page
+static uint64_t *getPTPointer(uint64_t *PML4TPtr, uint64_t vAddr) {
+  uint64_t PDTEntryIndex = VADDR_TO_PDT_INDEX(vAddr);
+  uint64_t *PDTPtr = NULL;
+  uint64_t *PTPtr = NULL;
+
+  PDTPtr = getPDTPointer(PML4TPtr, vAddr);
+
+  if (PDTPtr != NULL &&
+      (PDTPtr[PDTEntryIndex] & PAGE_DIRECTORY_ENTRY_PRESENT) &&
+      !(PDTPtr[PDTEntryIndex] & PAGE_DIRECTORY_SIZE_2MB)) {
+    PTPtr = (uint64_t *)PADDR_TO_VADDR(
+        EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(PDTPtr[PDTEntryIndex]));
+  }
+  return PTPtr;
+}
+
+// Return pointer to the PDT entry mapping vAddr with a 2MB page, NULL if vAddr
+// is not mapped by a 2MB page
+static uint64_t *getHugePageEntryPointer(uint64_t *PML4TPtr, uint64_t vAddr) {
+  uint64_t *PDTPtr = getPDTPointer(PML4TPtr, vAddr);
+  if (PDTPtr == NULL) {
+    return NULL;
+  }
+  uint64_t *entryPtr = &PDTPtr[VADDR_TO_PDT_INDEX(vAddr)];
+  if ((*entryPtr & PAGE_DIRECTORY_ENTRY_PRESENT) &&
+      (*entryPtr & PAGE_DIRECTORY_SIZE_2MB)) {
+    return entryPtr;
+  }
+  return NULL;
+}
+
+// Return pointer to the entry mapping the page containing vAddr: PDT entry of
+// a 2MB page or PT entry (possibly not present), NULL if there is neither
+// PAGE_DIRECTORY_SIZE_2MB tells them apart (PAT bit in PT entries, never set)
+static uint64_t *getPageEntryPointer(uint64_t *PML4TPtr, uint64_t vAddr) {
+  uint64_t *PTPtr = getPTPointer(PML4TPtr, vAddr);
+  if (PTPtr != NULL) {
+    return &PTPtr[VADDR_TO_PT_INDEX(vAddr)];
+  }
+  return getHugePageEntryPointer(PML4TPtr, vAddr);
+}
+
+// Return pointer to the next level table referenced by entry tablePtr[index]:
+// if the entry is not present allocate a page for the next level table, zero
+// initialize it and create the entry
+// Return NULL if the entry maps a large page (no next level table, errCode is
+// SUCCESS) or if the table could not be allocated (errCode is set)
+static uint64_t *getOrAllocateNextLevelTable(uint64_t *tablePtr,
+                                             uint64_t index,
+                                             uint64_t attributes,
+                                             int64_t *errCode) {
+  uint64_t *nextLevelTablePtr = NULL;
+
+  *errCode = SUCCESS;
+  if (tablePtr[index] & PAGE_DIRECTORY_ENTRY_PRESENT) {
+    if (tablePtr[index] & PAGE_DIRECTORY_SIZE_2MB) {  // same bit for 1GB pages
+      return NULL;
+    }
+    return (uint64_t *)PADDR_TO_VADDR(
+        EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(tablePtr[index]));
+  }
+  nextLevelTablePtr = kAllocZeroedPage(errCode);
+  if (nextLevelTablePtr == NULL) {
+    printk("ERROR getOrAllocateNextLevelTable: kAllocZeroedPage failed\n");
+    return NULL;
+  }
+  kSetPageTag((uint64_t)nextLevelTablePtr, 0, PAGE_TAG_PAGE_TABLE);
+  tablePtr[index] = VADDR_TO_PADDR(nextLevelTablePtr) | attributes;
+  return nextLevelTablePtr;
+}
+
+// If a PML4T entry pointing to a PDPT for the input virtual address does not
+// exist: allocate a zero-initialized page for the PDPT and create the entry
+// Return NULL if the PDPT could not be allocated (errCode is set)
+static uint64_t *createPML4TEntryAllocatePDPT(uint64_t *PML4TPtr,
+                                              uint64_t vAddr,
+                                              uint64_t attributes,
+                                              int64_t *errCode) {
+  return getOrAllocateNextLevelTable(PML4TPtr, VADDR_TO_PML4T_INDEX(vAddr),
+                                     attributes, errCode);
+}
+
+// If a PDPT entry pointing to a PDT for the input virtual address does not
+// exist: allocate a zero-initialized page for the PDT and create the entry
+// Recursively allocate PDPT for vAddr if it does not exist
+// Return NULL if vAddr is mapped by a 1GB page (errCode is SUCCESS) or if a
+// table could not be allocated (errCode is set)
+static uint64_t *createPDPTEntryAllocatePDT(uint64_t *PML4TPtr, uint64_t vAddr,
+                                            uint64_t attributes,
+                                            int64_t *errCode) {
+  uint64_t *PDPTPtr =
+      createPML4TEntryAllocatePDPT(PML4TPtr, vAddr, attributes, errCode);
+  if (PDPTPtr == NULL) {
+    return NULL;
+  }
+  return getOrAllocateNextLevelTable(PDPTPtr, VADDR_TO_PDPT_INDEX(vAddr),
+                                     attributes, errCode);
+}
+
+// If a PDT entry pointing to a PT (first
+// entry) for the input virtual address does not exist: allocate a page for
+// PT, zero initialize the page, create PDT entry and return pointer to
+// zero-initialized page
+// Recursively allocate PDPT and PDT for vAddr if they do not exist
+// Return NULL if vAddr is mapped by a 1GB or 2MB page (errCode is SUCCESS) or
+// if a table could not be allocated (errCode is set)
+static uint64_t *createPDTEntryAllocatePT(uint64_t *PML4TPtr, uint64_t vAddr,
+                                          uint64_t attributes,
+                                          int64_t *errCode) {
+  uint64_t *PDTPtr =
+      createPDPTEntryAllocatePDT(PML4TPtr, vAddr, attributes, errCode);
+  if (PDTPtr == NULL) {
+    return NULL;
+  }
+  return getOrAllocateNextLevelTable(PDTPtr, VADDR_TO_PDT_INDEX(vAddr),
+                                     attributes, errCode);
+}
+
+// Return the end of the part of [vAddr, vEndAddr[ mapped by the same PT as
+// vAddr (next 2MB boundary or vEndAddr)
+static uint64_t getPTRangeEnd(uint64_t vAddr, uint64_t vEndAddr) {
+  uint64_t ptEndAddr = (vAddr + PAGE_SIZE_2MB) & ~(PAGE_SIZE_2MB - 1);
+  return ptEndAddr < vEndAddr ? ptEndAddr : vEndAddr;
+}
+
+// Map the nPages virtual pages starting at page-aligned vStartAddr: page i is
+// mapped to pAddrArray[i] (skipped if 0) if pAddrArray is not NULL, to
+// pStartAddr + i * PAGE_SIZE otherwise
+// The page table tree is walked (and missing tables are allocated) once per PT
+// and up to N_PAGE_TABLE_ENTRIES consecutive entries are filled per walk
+static int64_t mapPages(uint64_t *pml4tPtr, uint64_t vStartAddr,
+                        uint64_t nPages, uint64_t *pAddrArray,
+                        uint64_t pStartAddr, uint64_t pageAttributes) {
+  // intermediate tables must not restrict the access rights of the pages
+  uint64_t tableAttributes = PAGE_DIRECTORY_ENTRY_PRESENT |
+                             PAGE_DIRECTORY_ENTRY_WRITABLE |
+                             (pageAttributes & PAGE_DIRECTORY_ENTRY_U);
+  uint64_t i = 0;
+  int64_t errCode = SUCCESS;
+
+  while (i < nPages) {
+    uint64_t vAddr = vStartAddr + i * PAGE_SIZE;
+    uint64_t ptIndex = VADDR_TO_PT_INDEX(vAddr);
+    uint64_t ptEndIndex = N_PAGE_TABLE_ENTRIES;
+    if (nPages - i < ptEndIndex - ptIndex) {
+      ptEndIndex = ptIndex + nPages - i;
+    }
+    uint64_t *ptPtr =
+        createPDTEntryAllocatePT(pml4tPtr, vAddr, tableAttributes, &errCode);
+    if (ptPtr == NULL && errCode != SUCCESS) {
+      printk("ERROR mapPages: page table allocation failed\n");
+      return errCode;
+    }
+    if (ptPtr == NULL) {
+      printk("ERROR mapPages: %x is already mapped by a large page\n", vAddr);
+      return ERR_PAGE_IS_ALREADY_MAPPED;
+    }
+    for (; ptIndex < ptEndIndex; ptIndex++, i++) {
+      uint64_t pAddr =
+          pAddrArray != NULL ? pAddrArray[i] : pStartAddr + i * PAGE_SIZE;
+      if (pAddrArray != NULL && pAddr == 0) {
+        continue;
+      }
+      if (ptPtr[ptIndex] & PAGE_DIRECTORY_ENTRY_PRESENT) {
+        printk(
+            "ERROR mapPages: attempt to map a page that was already mapped: "
+            "%d (%x)\n",
+            ptIndex, vStartAddr + i * PAGE_SIZE);
+        return ERR_PAGE_IS_ALREADY_MAPPED;
+      }
+      ptPtr[ptIndex] = pAddr | pageAttributes;
+    }
+  }
+  return SUCCESS;
+}
+
+// Create page table mappings for all physical pages between pStartAddr and
+// (pStartAddr + vEndAddr - vStartAddr) to virtual pages between vStartAddr and
+// vEndAddr (after aligning virtual addresses to page boundaries)
+// pStartAddr must be page-aligned
+int kMapPagesForAddrRange(uint64_t *pml4tPtr, uint64_t vStartAddr,
+                          uint64_t vEndAddr, uint64_t pStartAddr,
+                          uint64_t pageAttributes) {
+  uint64_t vStartAddrAligned = PAGE_ALIGN_ADDR_DOWN(vStartAddr);
+  uint64_t vEndAddrAligned = PAGE_ALIGN_ADDR_UP(vEndAddr);
+
+  if (vEndAddr < vStartAddr) {
+    printk("ERROR kMapPagesForAddrRange: negative address range\n");
+    return ERR_NEG_ADDR_RANGE;
+  }
+  if (pStartAddr & (PAGE_SIZE - 1)) {  // % PAGE_SIZE
+    printk("ERROR kMapPagesForAddrRange: pStartAddr is not page-aligned\n");
+    return ERR_MISALIGNED_ADDR;
+  }
+  if (vEndAddrAligned > KERNEL_DIRECT_MAP_END_VIRTUAL_ADDRESS) {
+    printk(
+        "ERROR kMapPagesForAddrRange: vEndAddrAligned larger than kernel "
+        "limit\n");
+    return ERR_KERNEL_ADDR_LARGER_THAN_LIMIT;
+  }
+  return mapPages(pml4tPtr, vStartAddrAligned,
+                  (vEndAddrAligned - vStartAddrAligned) / PAGE_SIZE, NULL,
+                  pStartAddr, pageAttributes);
+}
+
+// Map the nPages physical pages in pAddrArray to consecutive virtual pages
+// starting at vStartAddr (entries equal to 0 are left unmapped)
+int64_t kMapPageArray(uint64_t *pml4tPtr, uint64_t vStartAddr,
+                      uint64_t *pAddrArray, uint64_t nPages,
+                      uint64_t pageAttributes) {
+  if (vStartAddr & (PAGE_SIZE - 1)) {  // % PAGE_SIZE
+    printk("ERROR kMapPageArray: vStartAddr is not page-aligned\n");
+    return ERR_MISALIGNED_ADDR;
+  }
+  if (nPages > (UINT64_MAX - vStartAddr) / PAGE_SIZE) {
+    printk("ERROR kMapPageArray: address range overflow\n");
+    return ERR_NEG_ADDR_RANGE;
+  }
+  return mapPages(pml4tPtr, vStartAddr, nPages, pAddrArray, 0,
+                  pageAttributes);
+}
+
+// Create page table mappings for all physical pages between pStartAddr and
+// (pStartAddr + vEndAddr - vStartAddr) to virtual pages between vStartAddr and
+// vEndAddr (after aligning virtual addresses to page boundaries) using the
+// largest page size that fits: 1GB pages (if supported by the CPU), then 2MB
+// pages, then 4KB pages for the unaligned head and tail of the range
+// pStartAddr must be page-aligned, pageAttributes must not include
+// PAGE_DIRECTORY_SIZE_2MB/PAGE_DIRECTORY_SIZE_1GB
+int kMapLargePagesForAddrRange(uint64_t *pml4tPtr, uint64_t vStartAddr,
+                               uint64_t vEndAddr, uint64_t pStartAddr,
+                               uint64_t pageAttributes) {
+  uint64_t vAddr = PAGE_ALIGN_ADDR_DOWN(vStartAddr);
+  uint64_t vEndAddrAligned = PAGE_ALIGN_ADDR_UP(vEndAddr);
+  uint64_t pAddr = pStartAddr;
+  int64_t errCode = SUCCESS;
+
+  if (vEndAddr < vStartAddr) {
+    printk("ERROR kMapLargePagesForAddrRange: negative address range\n");
+    return ERR_NEG_ADDR_RANGE;
+  }
+  if (pStartAddr & (PAGE_SIZE - 1)) {  // % PAGE_SIZE
+    printk(
+        "ERROR kMapLargePagesForAddrRange: pStartAddr is not page-aligned\n");
+    return ERR_MISALIGNED_ADDR;
+  }
+
+  while (vAddr < vEndAddrAligned) {
+    uint64_t remainingSize = vEndAddrAligned - vAddr;
+    uint64_t pageSize = PAGE_SIZE;
+    if (largePage1GBSupported && remainingSize >= PAGE_SIZE_1GB &&
+        !((vAddr | pAddr) & (PAGE_SIZE_1GB - 1))) {
+      uint64_t *pdptPtr = createPML4TEntryAllocatePDPT(
+          pml4tPtr, vAddr, pageAttributes, &errCode);
+      if (pdptPtr == NULL) {
+        return errCode;
+      }
+      uint64_t pdptIndex = VADDR_TO_PDPT_INDEX(vAddr);
+      if (pdptPtr[pdptIndex] & PAGE_DIRECTORY_ENTRY_PRESENT) {
+        printk(
+            "ERROR kMapLargePagesForAddrRange PDPT: attempt to map a page "
+            "that was already mapped: %d (%x)\n",
+            pdptIndex, vAddr);
+        return ERR_PAGE_IS_ALREADY_MAPPED;
+      }
+      pdptPtr[pdptIndex] = pAddr | pageAttributes | PAGE_DIRECTORY_SIZE_1GB;
+      pageSize = PAGE_SIZE_1GB;
+    } else if (remainingSize >= PAGE_SIZE_2MB &&
+               !((vAddr | pAddr) & (PAGE_SIZE_2MB - 1))) {
+      uint64_t *pdtPtr =
+          createPDPTEntryAllocatePDT(pml4tPtr, vAddr, pageAttributes, &errCode);
+      if (pdtPtr == NULL && errCode != SUCCESS) {
+        return errCode;
+      }
+      uint64_t pdtIndex = VADDR_TO_PDT_INDEX(vAddr);
+      if (pdtPtr == NULL || (pdtPtr[pdtIndex] & PAGE_DIRECTORY_ENTRY_PRESENT)) {
+        printk(
+            "ERROR kMapLargePagesForAddrRange PDT: attempt to map a page that "
+            "was already mapped: %d (%x)\n",
+            pdtIndex, vAddr);
+        return ERR_PAGE_IS_ALREADY_MAPPED;
+      }
+      pdtPtr[pdtIndex] = pAddr | pageAttributes | PAGE_DIRECTORY_SIZE_2MB;
+      pageSize = PAGE_SIZE_2MB;
+    } else {
+      // 4KB pages up to the next 2MB boundary, where a large page may fit
+      pageSize = getPTRangeEnd(vAddr, vEndAddrAligned) - vAddr;
+      errCode = mapPages(pml4tPtr, vAddr, pageSize / PAGE_SIZE, NULL, pAddr,
+                         pageAttributes);
+      if (errCode != SUCCESS) {
+        return errCode;
+      }
+    }
+    vAddr += pageSize;
+    pAddr += pageSize;
+  }
+  return SUCCESS;
+}
+
+// Identity map the 2MB-aligned block containing pAddr (LAPIC and IOAPIC
+// registers) with a single 2MB page, unless a previous call already mapped it
+// 1GB pages are not used here: the block lies in the APIC range reserved by
+// the chipset right below 4GB, while a 1GB page would also cover RAM and PCI
+// memory-mapped device ranges
+static int kIdentityMapDeviceWindow(uint64_t *pml4tPtr, uint64_t pAddr) {
+  uint64_t blockAddr = pAddr & ~((uint64_t)PAGE_SIZE_2MB - 1);
+  uint64_t *pdtPtr = getPDTPointer(pml4tPtr, blockAddr);
+  if (pdtPtr != NULL && (pdtPtr[VADDR_TO_PDT_INDEX(blockAddr)] &
+                         PAGE_DIRECTORY_ENTRY_PRESENT)) {
+    return SUCCESS;
+  }
+  return kMapLargePagesForAddrRange(
+      pml4tPtr, blockAddr, blockAddr + PAGE_SIZE_2MB, blockAddr,
+      PAGE_DIRECTORY_ENTRY_PRESENT | PAGE_DIRECTORY_ENTRY_WRITABLE);
+}
+
+// Create Page Table structure for first 1GB of phisycal memory starting at
+// KERNEL_SPACE_BASE_VIRTUAL_ADDRESS (one 1GB page if supported by the CPU,
+// 512 2MB pages otherwise), extend the direct map to the RAM regions above
+// 1GB (high zone) and identity map LAPIC and IOAPIC addresses (2MB
+// pages) NOTE: when this function is called in the kernel by the
+// Bootstrap Processor, the first 1GB of physical memory is already mapped as a
+// single 1GB page at KERNEL_SPACE_BASE_VIRTUAL_ADDRESS (loader.asm)
+// Called only once by kInitVM: the resulting tables are shared by all
+// processes (see kSetupVM)
+static uint64_t *kBuildKernelVM() {
+  // Allocage page for PML4T (Page Map Level-4 Table)
+
+  int64_t errCode = SUCCESS;
+  uint64_t *pml4TPageMapPtr = kAllocPage(&errCode);
+  if (pml4TPageMapPtr == NULL) {
+    printk("kBuildKernelVM ERROR: kAllocPage for PML4T failed\n");
+    KERNEL_PANIC(errCode);
+  }
+  kSetPageTag((uint64_t)pml4TPageMapPtr, 0, PAGE_TAG_PAGE_TABLE);
+
+  // printk("High memory 1GB Kernel mapping %x\n",
+  // KERNEL_SPACE_BASE_VIRTUAL_ADDRESS);
+  // zero out PML4T page
+  memset(pml4TPageMapPtr, 0, PAGE_SIZE);
+  errCode = kMapLargePagesForAddrRange(
+      pml4TPageMapPtr, KERNEL_SPACE_BASE_VIRTUAL_ADDRESS,
+      KERNEL_SPACE_END_VIRTUAL_ADDRESS,
+      VADDR_TO_PADDR(KERNEL_SPACE_BASE_VIRTUAL_ADDRESS),
+      PAGE_DIRECTORY_ENTRY_PRESENT | PAGE_DIRECTORY_ENTRY_WRITABLE |
+          PAGE_DIRECTORY_ENTRY_GLOBAL);
+  if (errCode != 0) {
+    printk("ERROR kBuildKernelVM: kMapLargePagesForAddrRange failed\n");
+    KERNEL_PANIC(errCode);
+  }
+
+  // Direct map RAM above the first 1GB: holes between regions (PCI
+  // memory-mapped device ranges below 4GB) are not mapped, so that they are
+  // never accessed through cacheable mappings
+  for (int64_t i = 0; i < nMemoryRegions; i++) {
+    uint64_t pBaseAddr = PAGE_ALIGN_ADDR_UP(memoryRegions[i].baseAddr);
+    uint64_t pEndAddr =
+        PAGE_ALIGN_ADDR_DOWN(memoryRegions[i].baseAddr + memoryRegions[i].size);
+    if (pBaseAddr < KERNEL_PHYSICAL_MEMORY_LIMIT) {
+      pBaseAddr = KERNEL_PHYSICAL_MEMORY_LIMIT;
+    }
+    if (pEndAddr <= pBaseAddr) {
+      continue;
+    }
+    errCode = kMapLargePagesForAddrRange(
+        pml4TPageMapPtr, PADDR_TO_VADDR(pBaseAddr), PADDR_TO_VADDR(pEndAddr),
+        pBaseAddr,
+        PAGE_DIRECTORY_ENTRY_PRESENT | PAGE_DIRECTORY_ENTRY_WRITABLE |
+            PAGE_DIRECTORY_ENTRY_GLOBAL);
+    if (errCode != 0) {
+      printk(
+          "ERROR kBuildKernelVM: high memory kMapLargePagesForAddrRange "
+          "failed\n");
+      KERNEL_PANIC(errCode);
+    }
+  }
+
+  // printk("Identity mapping for LAPIC address: %x\n",
+  //        PAGE_ALIGN_ADDR_DOWN(gLocalApicAddress));
+  errCode = kIdentityMapDeviceWindow(pml4TPageMapPtr,
+                                     (uint64_t)gLocalApicAddress);
+  if (errCode != 0) {
+    printk(
+        "ERROR kBuildKernelVM: LAPIC address identity mapping in "
+        "kIdentityMapDeviceWindow failed\n");
+    KERNEL_PANIC(errCode);
+  }
+
+  for (int i = 0; i < acpiNIoApics; i++) {
+    // printk("Identity mapping for IOAPIC address: %x\n",
+    //       PAGE_ALIGN_ADDR_DOWN(ioApicAddresses[i]));
+    errCode = kIdentityMapDeviceWindow(pml4TPageMapPtr,
+                                       (uint64_t)ioApicAddresses[i]);
+    if (errCode != 0) {
+      printk(
+          "ERROR kBuildKernelVM: IOAPIC address identity mapping in "
+          "kIdentityMapDeviceWindow failed\n");
+      KERNEL_PANIC(errCode);
+    }
+  }
+  return pml4TPageMapPtr;
+}
+
+// Allocate and return a new PML4T for a process
+// The kernel half of the virtual address space is not rebuilt: the upper-half
+// PML4T entries are copied from the kernel PML4T (gPML4TPageMapPtr), so all
+// processes reference the same PDPT (and PDTs and PTs) for kernel space.
+// The LAPIC and IOAPIC identity mappings (normally right below 4GB) share the
+// first PML4T entry (first 512GB) with user space: the process gets its own
+// PDPT for that entry, whose entries are copied from the kernel PDPT and
+// therefore reference the kernel PDTs for the identity mapped ranges
+// Process creation costs 2 pages (PML4T and user space PDPT)
+uint64_t *kSetupVM() {
+  int64_t errCode = SUCCESS;
+  uint64_t *pml4TPageMapPtr = kAllocZeroedPage(&errCode);
+  if (pml4TPageMapPtr == NULL) {
+    printk("KSetupVM ERROR: kAllocZeroedPage for PML4T failed\n");
+    KERNEL_PANIC(errCode);
+  }
+  kSetPageTag((uint64_t)pml4TPageMapPtr, 0, PAGE_TAG_PAGE_TABLE);
+
+  // Link kernel half by reference
+  for (int i = N_PAGE_TABLE_ENTRIES / 2; i < N_PAGE_TABLE_ENTRIES; i++) {
+    pml4TPageMapPtr[i] = gPML4TPageMapPtr[i];
+  }
+
+  uint64_t userPML4TEntryIndex =
+      VADDR_TO_PML4T_INDEX((uint64_t)USER_PROGRAM_COUNTER);
+  for (int i = 0; i < N_PAGE_TABLE_ENTRIES / 2; i++) {
+    if (!(gPML4TPageMapPtr[i] & PAGE_DIRECTORY_ENTRY_PRESENT)) {
+      continue;
+    }
+    if (i != userPML4TEntryIndex) {  // no user pages: share PDPT
+      pml4TPageMapPtr[i] = gPML4TPageMapPtr[i];
+      continue;
+    }
+    uint64_t *pdptPtr = kAllocPage(&errCode);
+    if (pdptPtr == NULL) {
+      printk("KSetupVM ERROR: kAllocPage for PDPT failed\n");
+      KERNEL_PANIC(errCode);
+    }
+    kSetPageTag((uint64_t)pdptPtr, 0, PAGE_TAG_PAGE_TABLE);
+    memcpy(pdptPtr,
+           (void *)PADDR_TO_VADDR(
+               EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(gPML4TPageMapPtr[i])),
+           PAGE_SIZE);
+    // The PDT entries for the identity mappings are supervisor only, so user
+    // mode access can be enabled at PML4T level
+    pml4TPageMapPtr[i] = VADDR_TO_PADDR(pdptPtr) |
+                         PAGE_DIRECTORY_ENTRY_PRESENT |
+                         PAGE_DIRECTORY_ENTRY_WRITABLE | PAGE_DIRECTORY_ENTRY_U;
+  }
+  return pml4TPageMapPtr;
+}
+
+// Normally called by AP after BP as initialized Page Table
+void loadPageTable() {
+  loadCR3((uint64_t)VADDR_TO_PADDR(gPML4TPageMapPtr));
+  tlbStateArray[getCoreId()].loadedPml4tPtr = gPML4TPageMapPtr;
+  enableWriteProtect();
+  enableGlobalPages();
+  if (pcidEnabled) {
+    enablePCID();
+  }
+}
+
+// Initialize kernel space virtual memory
+void kInitVM() {
+  largePage1GBSupported = cpuSupports1GBPages();
+  pcidEnabled = cpuSupportsPCID();
+  gPML4TPageMapPtr = kBuildKernelVM();
+  loadPageTable();
+  initHighMemory();
+  printk("PCID support: %s\n", pcidEnabled ? "enabled" : "not available");
+  printk("Kernel Virtual memory initialization complete!\n");
+}
+
+// Set up the virtual memory areas of a process image; no page is allocated
+int initUserSpaceVM(struct vmSpace *vmSpacePtr, uint16_t fileClusterIndex,
+                    uint32_t fileSize, uint64_t processTotalSize) {
+  if (fileSize > processTotalSize) {
+    printk("ERROR initUserSpaceVM: fileSize > processTotalSize\n");
+    return ERR_VM;
+  }
+  uint64_t fileEndAddr = PAGE_ALIGN_ADDR_UP(USER_PROGRAM_COUNTER + fileSize);
+  uint64_t processEndAddr =
+      PAGE_ALIGN_ADDR_UP(USER_PROGRAM_COUNTER + processTotalSize);
+
+  memset(vmSpacePtr->areaArray, 0, sizeof(vmSpacePtr->areaArray));
+  // code and data: the last file page is zero-filled past the end of the file
+  vmSpacePtr->areaArray[0].vStartAddr = USER_PROGRAM_COUNTER;
+  vmSpacePtr->areaArray[0].vEndAddr = fileEndAddr;
+  vmSpacePtr->areaArray[0].flags = VM_AREA_WRITABLE | VM_AREA_FILE;
+  vmSpacePtr->areaArray[0].fileSize = fileSize;
+  vmSpacePtr->areaArray[0].fileClusterIndex = fileClusterIndex;
+  // bss and stack
+  if (processEndAddr > fileEndAddr) {
+    vmSpacePtr->areaArray[1].vStartAddr = fileEndAddr;
+    vmSpacePtr->areaArray[1].vEndAddr = processEndAddr;
+    vmSpacePtr->areaArray[1].flags = VM_AREA_WRITABLE;
+  }
+  // empty heap (see kBrk)
+  vmSpacePtr->areaArray[2].vStartAddr = processEndAddr;
+  vmSpacePtr->areaArray[2].vEndAddr = processEndAddr;
+  vmSpacePtr->areaArray[2].flags = VM_AREA_WRITABLE | VM_AREA_HEAP;
+  vmSpacePtr->brk = processEndAddr;
+  return SUCCESS;
+}
+
+// Remove user pages in [vStartAddr, vEndAddr[ of the current address space and
+// flush their TLB entries (the whole TLB for large ranges) on the cores running
+// the address space
+static int64_t unmapUserPages(struct vmSpace *vmSpacePtr, uint64_t *pml4tPtr,
+                              uint64_t vStartAddr, uint64_t vEndAddr) {
+  struct tlbShootdownBatch batch;
+  int64_t errCode = kFreePagesInAddrRange(pml4tPtr, vStartAddr, vEndAddr);
+  tlbShootdownInit(&batch, vmSpacePtr, pml4tPtr);
+  tlbShootdownAddRange(&batch, vStartAddr, vEndAddr);
+  tlbShootdownFlush(&batch);
+  return errCode;
+}
+
+/*** SHARED MEMORY SEGMENTS ***/
+// Segment pages are allocated and zeroed on the first access by any attached
+// process (see populatePage): the segment holds one reference to each
+// populated page and each PT entry mapping it holds another one, so a page is
+// freed once the segment is destroyed and no process maps it anymore
+// Attachments are VM_AREA_SHM areas: they are never merged with other areas
+// and fork shares their pages with the child instead of copy-on-write
+// A segment is destroyed when its last attachment is removed; a segment that
+// was never attached is kept until then
+struct shmSegment {
+  uint64_t key;
+  uint64_t nPages;        // 0: unused segment
+  uint64_t nAttachments;  // VM_AREA_SHM areas referencing the segment
+  uint64_t *pAddrArray;   // physical page addresses, 0 if not populated yet
+  uint64_t isRemoved;     // removed (see kShmRemove), freed at last detach
+};
+
+static struct shmSegment shmSegmentArray[MAX_N_SHM_SEGMENTS];
+static volatile uint8_t shmLock;  // lock for shmSegmentArray
+
+// Add an attachment to segment shmId (fork)
+static void attachShmSegment(uint64_t shmId) {
+  spinLock(&shmLock);
+  shmSegmentArray[shmId].nAttachments++;
+  spinUnlock(&shmLock);
+}
+
+// Free segment: the segment references to its pages are removed
+// shmLock must be held
+static void destroyShmSegment(struct shmSegment *segment) {
+  for (uint64_t i = 0; i < segment->nPages; i++) {
+    if (segment->pAddrArray[i] != 0) {
+      putUserPage(segment->pAddrArray[i]);
+    }
+  }
+  kFreePage((uint64_t)segment->pAddrArray);
+  memset(segment, 0, sizeof(struct shmSegment));
+}
+
+// Remove an attachment from segment shmId and destroy the segment if it was
+// the last one
+static void detachShmSegment(uint64_t shmId) {
+  struct shmSegment *segment = &shmSegmentArray[shmId];
+  spinLock(&shmLock);
+  if (--segment->nAttachments == 0) {
+    destroyShmSegment(segment);
+  }
+  spinUnlock(&shmLock);
+}
+
+// Store in pAddr the physical address of the page of segment attachment area
+// containing vAddr, allocating a zeroed out page if no process has accessed it
+// yet; a reference is added for the PT entry that maps the page
+static int64_t getShmPage(struct vmSpace *vmSpacePtr, struct vmArea *area,
+                          uint64_t vAddr, uint64_t *pAddr) {
+  int64_t errCode = SUCCESS;
+  struct shmSegment *segment = &shmSegmentArray[area->shmId];
+  uint64_t pageIndex = (vAddr - area->vStartAddr) / PAGE_SIZE;
+  spinLock(&shmLock);
+  if (segment->pAddrArray[pageIndex] == 0) {
+    uint8_t *page = kAllocZeroedUserPage(&errCode);
+    if (page == NULL) {
+      spinUnlock(&shmLock);
+      printk("ERROR getShmPage: page allocation failed\n");
+      return errCode;
+    }
+    setUserPageRefCount(VADDR_TO_PADDR(page), 1);
+    segment->pAddrArray[pageIndex] = VADDR_TO_PADDR(page);
+    __atomic_add_fetch(&vmSpacePtr->stats.nZeroFillFaults, 1,
+                       __ATOMIC_RELAXED);
+    __atomic_add_fetch(&nZeroFillFaults, 1, __ATOMIC_RELAXED);
+  }
+  *pAddr = segment->pAddrArray[pageIndex];
+  getUserPage(*pAddr);
+  spinUnlock(&shmLock);
+  return SUCCESS;
+}
+
+// Remove all virtual memory areas of the current address space and free their
+// pages
+void kClearUserSpaceVM(uint64_t *pml4tPtr, struct vmSpace *vmSpacePtr) {
+  for (int i = 0; i < MAX_N_VM_AREAS; i++) {
+    struct vmArea *area = &vmSpacePtr->areaArray[i];
+    if (area->vEndAddr != 0 &&
+        kFreePagesInAddrRange(pml4tPtr, area->vStartAddr, area->vEndAddr) !=
+            SUCCESS) {
+      printk("ERROR kClearUserSpaceVM: kFreePagesInAddrRange failed\n");
+      KERNEL_PANIC(ERR_VM);
+    }
+    if (area->flags & VM_AREA_SHM) {
+      detachShmSegment(area->shmId);
+    }
+  }
+  memset(vmSpacePtr->areaArray, 0, sizeof(vmSpacePtr->areaArray));
+  vmSpacePtr->brk = 0;
+  flushTLB();
+  tlbGenIncrement(vmSpacePtr);
+}
+
+// Map the 2MB page of source PDT entry srcPdtEntryPtr at virtual address
+// vAddr of virtual memory area area in the destination page table, shared
+// copy-on-write (see copyUserSpaceVM)
+static int64_t copyHugePageEntry(uint64_t *dstPml4tPtr,
+                                 uint64_t *srcPdtEntryPtr, uint64_t vAddr,
+                                 struct vmArea *area) {
+  vAddr &= ~(PAGE_SIZE_2MB - 1);
+  if ((*srcPdtEntryPtr & PAGE_DIRECTORY_ENTRY_WRITABLE) &&
+      !(area->flags & VM_AREA_SHM)) {
+    *srcPdtEntryPtr = (*srcPdtEntryPtr & ~PAGE_DIRECTORY_ENTRY_WRITABLE) |
+                      PAGE_DIRECTORY_ENTRY_COW;
+    flushTLBPage(vAddr);
+  }
+  int64_t errCode = SUCCESS;
+  uint64_t *dstPdtPtr = createPDPTEntryAllocatePDT(
+      dstPml4tPtr, vAddr,
+      PAGE_DIRECTORY_ENTRY_PRESENT | PAGE_DIRECTORY_ENTRY_WRITABLE |
+          PAGE_DIRECTORY_ENTRY_U,
+      &errCode);
+  if (dstPdtPtr == NULL && errCode != SUCCESS) {
+    printk("ERROR copyHugePageEntry: page table allocation failed\n");
+    return errCode;
+  }
+  uint64_t pdtIndex = VADDR_TO_PDT_INDEX(vAddr);
+  if (dstPdtPtr == NULL ||
+      (dstPdtPtr[pdtIndex] & PAGE_DIRECTORY_ENTRY_PRESENT)) {
+    printk("ERROR copyHugePageEntry: page %x is already mapped\n", vAddr);
+    return ERR_PAGE_IS_ALREADY_MAPPED;
+  }
+  dstPdtPtr[pdtIndex] = *srcPdtEntryPtr;
+  getHugeUserPage(EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(*srcPdtEntryPtr));
+  return SUCCESS;
+}
+
+// Set up page table for user space sharing the source process pages
+// copy-on-write: writable pages are mapped read-only with the COW flag set in
+// both page tables and are copied on the first write (see handlePageFault)
+// Pages not populated yet in the source process are skipped: they are
+// populated on first access in each process
+// Pages of shared memory segment attachments stay shared and writable
+// The source page table must be the one loaded on the running core (fork)
+// On failure the pages mapped so far keep their references in the destination
+// page table (freeVM releases them) and no segment attachment is added
+int copyUserSpaceVM(uint64_t *dstPml4tPtr, uint64_t *srcPml4tPtr,
+                    struct vmSpace *vmSpacePtr) {
+  int64_t errCode = SUCCESS;
+  for (int i = 0; i < MAX_N_VM_AREAS && errCode == SUCCESS; i++) {
+    struct vmArea *area = &vmSpacePtr->areaArray[i];
+    uint64_t vAddr = area->vStartAddr;
+    // one PT (up to 512 pages) per iteration
+    while (vAddr < area->vEndAddr && errCode == SUCCESS) {
+      uint64_t vPTEndAddr = getPTRangeEnd(vAddr, area->vEndAddr);
+      uint64_t *srcPtPtr = getPTPointer(srcPml4tPtr, vAddr);
+      uint64_t *dstPtPtr = NULL;
+      if (srcPtPtr == NULL) {  // 2MB page or no page populated in this range
+        uint64_t *srcPdtEntryPtr = getHugePageEntryPointer(srcPml4tPtr, vAddr);
+        if (srcPdtEntryPtr != NULL) {
+          errCode =
+              copyHugePageEntry(dstPml4tPtr, srcPdtEntryPtr, vAddr, area);
+        }
+        vAddr = vPTEndAddr;
+        continue;
+      }
+      for (; vAddr < vPTEndAddr && errCode == SUCCESS; vAddr += PAGE_SIZE) {
+        uint64_t ptIndex = VADDR_TO_PT_INDEX(vAddr);
+        if (!(srcPtPtr[ptIndex] & PAGE_DIRECTORY_ENTRY_PRESENT)) {
+          continue;
+        }
+
+        if ((srcPtPtr[ptIndex] & PAGE_DIRECTORY_ENTRY_WRITABLE) &&
+            !(area->flags & VM_AREA_SHM)) {
+          srcPtPtr[ptIndex] =
+              (srcPtPtr[ptIndex] & ~PAGE_DIRECTORY_ENTRY_WRITABLE) |
+              PAGE_DIRECTORY_ENTRY_COW;
+          flushTLBPage(vAddr);
+        }
+
+        if (dstPtPtr == NULL) {
+          dstPtPtr = createPDTEntryAllocatePT(
+              dstPml4tPtr, vAddr,
+              PAGE_DIRECTORY_ENTRY_PRESENT | PAGE_DIRECTORY_ENTRY_WRITABLE |
+                  PAGE_DIRECTORY_ENTRY_U,
+              &errCode);
+          if (dstPtPtr == NULL) {
+            printk("ERROR copyUserSpaceVM: createPDTEntryAllocatePT failed\n");
+            if (errCode == SUCCESS) {
+              errCode = ERR_VM;
+            }
+            break;
+          }
+        }
+        if (dstPtPtr[ptIndex] & PAGE_DIRECTORY_ENTRY_PRESENT) {
+          printk("ERROR copyUserSpaceVM: page %x is already mapped\n", vAddr);
+          errCode = ERR_PAGE_IS_ALREADY_MAPPED;
+          break;
+        }
+        dstPtPtr[ptIndex] = srcPtPtr[ptIndex];
+        getUserPage(EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(srcPtPtr[ptIndex]));
+      }
+    }
+  }
+  // writable pages of the source address space are now read-only (also if
+  // the copy failed part of the way)
+  tlbGenIncrement(vmSpacePtr);
+  if (errCode != SUCCESS) {
+    return errCode;
+  }
+  for (int i = 0; i < MAX_N_VM_AREAS; i++) {
+    if (vmSpacePtr->areaArray[i].flags & VM_AREA_SHM) {
+      attachShmSegment(vmSpacePtr->areaArray[i].shmId);
+    }
+  }
+  return SUCCESS;
+}
+
+// Replace copy-on-write page mapped by PT entry ptEntryPtr at virtual address
+// vAddr with a private writable page: if other processes still reference the
+// page, copy its content
+static int64_t breakCoW(uint64_t *ptEntryPtr, uint64_t vAddr) {
+  int64_t errCode = SUCCESS;
+  uint64_t pAddr = EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(*ptEntryPtr);
+  uint64_t flags = (*ptEntryPtr & PAGE_DIRECTORY_ENTRY_FLAGS_MASK &
+                    ~PAGE_DIRECTORY_ENTRY_COW) |
+                   PAGE_DIRECTORY_ENTRY_WRITABLE;
+
+  if (__atomic_load_n(&pageFrameArray[pAddr / PAGE_SIZE].refCount,
+                      __ATOMIC_SEQ_CST) == 1) {
+    // last reference: take over the page
+    *ptEntryPtr = pAddr | flags;
+    flushTLBPage(vAddr);
+    return SUCCESS;
+  }
+
+  uint64_t *page = kAllocUserPage(&errCode);
+  if (page == NULL) {
+    printk("ERROR breakCoW: kAllocUserPage failed\n");
+    return errCode;
+  }
+  memcpy(page, (void *)PADDR_TO_VADDR(pAddr), PAGE_SIZE);
+  setUserPageRefCount(VADDR_TO_PADDR(page), 1);
+  *ptEntryPtr = VADDR_TO_PADDR(page) | flags;
+  flushTLBPage(vAddr);
+  return putUserPage(pAddr);
+}
+
+// Replace the 2MB mapping of PDT entry pdtEntryPtr with a PT mapping the same
+// 512 pages with the same flags (the references of the 2MB mapping are moved
+// to the PT entries)
+// The caller flushes the TLB entries of the 2MB page
+static int64_t splitHugePage(uint64_t *pdtEntryPtr) {
+  int64_t errCode = SUCCESS;
+  uint64_t pAddr = EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(*pdtEntryPtr);
+  uint64_t flags = *pdtEntryPtr & PAGE_DIRECTORY_ENTRY_FLAGS_MASK &
+                   ~PAGE_DIRECTORY_SIZE_2MB;
+  uint64_t *ptPtr = kAllocZeroedPage(&errCode);
+  if (ptPtr == NULL) {
+    printk("ERROR splitHugePage: kAllocZeroedPage failed\n");
+    return errCode;
+  }
+  kSetPageTag((uint64_t)ptPtr, 0, PAGE_TAG_PAGE_TABLE);
+  for (uint64_t i = 0; i < N_PAGE_TABLE_ENTRIES; i++) {
+    ptPtr[i] = (pAddr + i * PAGE_SIZE) | flags;
+  }
+  *pdtEntryPtr = VADDR_TO_PADDR(ptPtr) | PAGE_DIRECTORY_ENTRY_PRESENT |
+                 PAGE_DIRECTORY_ENTRY_WRITABLE | PAGE_DIRECTORY_ENTRY_U;
+  __atomic_add_fetch(&nHugePageSplits, 1, __ATOMIC_RELAXED);
+  return SUCCESS;
+}
+
+// Replace copy-on-write 2MB page mapped by PDT entry pdtEntryPtr at virtual
+// address vAddr with a private writable page: take the page over if no other
+// process references it, copy it to a new 2MB page otherwise, or split the
+// mapping and copy only the 4KB page containing vAddr if there is no free 2MB
+// block
+static int64_t breakHugeCoW(uint64_t *pdtEntryPtr, uint64_t vAddr) {
+  uint64_t pAddr = EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(*pdtEntryPtr);
+  uint64_t vBlockAddr = vAddr & ~(PAGE_SIZE_2MB - 1);
+  uint64_t flags = (*pdtEntryPtr & PAGE_DIRECTORY_ENTRY_FLAGS_MASK &
+                    ~PAGE_DIRECTORY_ENTRY_COW) |
+                   PAGE_DIRECTORY_ENTRY_WRITABLE;
+
+  if (isHugeUserPageExclusive(pAddr)) {
+    *pdtEntryPtr = pAddr | flags;
+    flushTLBPage(vBlockAddr);
+    return SUCCESS;
+  }
+
+  uint8_t *page = allocHugeUserPage(0);
+  if (page == NULL) {
+    __atomic_add_fetch(&nHugePageFallbacks, 1, __ATOMIC_RELAXED);
+    int64_t errCode = splitHugePage(pdtEntryPtr);
+    flushTLBPage(vBlockAddr);
+    if (errCode != SUCCESS) {
+      return errCode;
+    }
+    uint64_t *ptPtr = (uint64_t *)PADDR_TO_VADDR(
+        EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(*pdtEntryPtr));
+    return breakCoW(&ptPtr[VADDR_TO_PT_INDEX(vAddr)],
+                    PAGE_ALIGN_ADDR_DOWN(vAddr));
+  }
+  memcpy(page, (void *)PADDR_TO_VADDR(pAddr), PAGE_SIZE_2MB);
+  *pdtEntryPtr = VADDR_TO_PADDR(page) | flags;
+  flushTLBPage(vBlockAddr);
+  return putHugeUserPage(pAddr);
+}
+
+// Returns the virtual memory area containing vAddr, NULL if there is none
+static struct vmArea *findVMArea(struct vmSpace *vmSpacePtr, uint64_t vAddr) {
+  for (int i = 0; i < MAX_N_VM_AREAS; i++) {
+    struct vmArea *area = &vmSpacePtr->areaArray[i];
+    if (vAddr >= area->vStartAddr && vAddr < area->vEndAddr) {
+      return area;
+    }
+  }
+  return NULL;
+}
+
+// Map the 2MB-aligned block containing vAddr with a zeroed out 2MB page if
+// the block lies within anonymous virtual memory area area and none of its
+// pages is populated yet (no PT)
+// Returns 1 if the 2MB page was mapped, 0 if a 4KB page must be used
+static int populateHugePage(struct vmSpace *vmSpacePtr, uint64_t *pml4tPtr,
+                            struct vmArea *area, uint64_t vAddr) {
+  uint64_t vBlockAddr = vAddr & ~(PAGE_SIZE_2MB - 1);
+  if ((area->flags & (VM_AREA_FILE | VM_AREA_SHM)) ||
+      vBlockAddr < area->vStartAddr ||
+      vBlockAddr + PAGE_SIZE_2MB > area->vEndAddr) {
+    return 0;
+  }
+  int64_t errCode = SUCCESS;
+  uint64_t *pdtPtr = createPDPTEntryAllocatePDT(
+      pml4tPtr, vBlockAddr,
+      PAGE_DIRECTORY_ENTRY_PRESENT | PAGE_DIRECTORY_ENTRY_WRITABLE |
+          PAGE_DIRECTORY_ENTRY_U,
+      &errCode);
+  uint64_t pdtIndex = VADDR_TO_PDT_INDEX(vBlockAddr);
+  if (pdtPtr == NULL || (pdtPtr[pdtIndex] & PAGE_DIRECTORY_ENTRY_PRESENT)) {
+    return 0;
+  }
+  uint8_t *page = allocHugeUserPage(1);
+  if (page == NULL) {
+    __atomic_add_fetch(&nHugePageFallbacks, 1, __ATOMIC_RELAXED);
+    return 0;
+  }
 
-  return 0;
+  uint64_t flags = PAGE_DIRECTORY_ENTRY_PRESENT | PAGE_DIRECTORY_ENTRY_U |
+                   PAGE_DIRECTORY_SIZE_2MB;
+  if (area->flags & VM_AREA_WRITABLE) {
+    flags |= PAGE_DIRECTORY_ENTRY_WRITABLE;
+  }
+  pdtPtr[pdtIndex] = VADDR_TO_PADDR(page) | flags;
+  __atomic_add_fetch(&vmSpacePtr->stats.nZeroFillFaults, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&nZeroFillFaults, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&nHugePageFaults, 1, __ATOMIC_RELAXED);
+  return 1;
 }
 
-// Create 4-level 4KB Page Table structure for first 1GB of phisycal memory
-// starting at KERNEL_SPACE_BASE_VIRTUAL_ADDRESS and identity map LAPIC and
-// IOAPIC addresses NOTE: when this function is called in the kernel by the
-// Bootstrap Processor, the first 1GB of physical memory is already mapped as a
-// single 1GB page at KERNEL_SPACE_BASE_VIRTUAL_ADDRESS (loader.asm)
-uint64_t *kSetupVM() {
-  // Allocage page for PML4T (Page Map Level-4 Table)
-
+// Allocate and map the page of virtual memory area area containing vAddr:
+// read its content from the area file or zero it out (see populateHugePage
+// for anonymous memory)
+static int64_t populatePage(struct vmSpace *vmSpacePtr, uint64_t *pml4tPtr,
+                            struct vmArea *area, uint64_t vAddr) {
   int64_t errCode = SUCCESS;
-  uint64_t *pml4TPageMapPtr = kAllocPage(&errCode);
-  if (pml4TPageMapPtr == NULL) {
-    printk("KSetupVM ERROR: kAllocPage for PML4T failed\n");
-    KERNEL_PANIC(errCode);
+  vAddr = PAGE_ALIGN_ADDR_DOWN(vAddr);
+  uint64_t fileOffset = vAddr - area->vStartAddr;
+
+  if (populateHugePage(vmSpacePtr, pml4tPtr, area, vAddr)) {
+    return SUCCESS;
+  }
+  uint64_t *ptPtr = getPTPointer(pml4tPtr, vAddr);
+  if (ptPtr == NULL) {
+    ptPtr = createPDTEntryAllocatePT(
+        pml4tPtr, vAddr,
+        PAGE_DIRECTORY_ENTRY_PRESENT | PAGE_DIRECTORY_ENTRY_WRITABLE |
+            PAGE_DIRECTORY_ENTRY_U,
+        &errCode);
+    if (ptPtr == NULL) {
+      printk("ERROR populatePage: createPDTEntryAllocatePT failed\n");
+      // out of memory for a page table: the faulting process is killed
+      return errCode != SUCCESS ? errCode : ERR_VM;
+    }
   }
 
-  // printk("High memory 1GB Kernel mapping %x\n",
-  // KERNEL_SPACE_BASE_VIRTUAL_ADDRESS);
-  // zero out PML4T page
-  memset(pml4TPageMapPtr, 0, PAGE_SIZE);
-  errCode = kMapPagesForAddrRange(
-      pml4TPageMapPtr, KERNEL_SPACE_BASE_VIRTUAL_ADDRESS,
-      KERNEL_SPACE_END_VIRTUAL_ADDRESS,
-      VADDR_TO_PADDR(KERNEL_SPACE_BASE_VIRTUAL_ADDRESS),
-      PAGE_DIRECTORY_ENTRY_PRESENT | PAGE_DIRECTORY_ENTRY_WRITABLE);
-  if (errCode != 0) {
-    printk("ERROR kSetupVM: kMapPagesForAddrRange failed\n");
-    KERNEL_PANIC(errCode);
+  uint64_t flags = PAGE_DIRECTORY_ENTRY_PRESENT | PAGE_DIRECTORY_ENTRY_U;
+  if (area->flags & VM_AREA_WRITABLE) {
+    flags |= PAGE_DIRECTORY_ENTRY_WRITABLE;
+  }
+  if (area->flags & VM_AREA_SHM) {
+    uint64_t pAddr = 0;
+    errCode = getShmPage(vmSpacePtr, area, vAddr, &pAddr);
+    if (errCode == SUCCESS) {
+      ptPtr[VADDR_TO_PT_INDEX(vAddr)] = pAddr | flags;
+    }
+    return errCode;
   }
 
-  // printk("Identity mapping for LAPIC address: %x\n",
-  //        PAGE_ALIGN_ADDR_DOWN(gLocalApicAddress));
-  errCode = kMapPagesForAddrRange(
-      pml4TPageMapPtr, PAGE_ALIGN_ADDR_DOWN(gLocalApicAddress),
-      PAGE_ALIGN_ADDR_DOWN(gLocalApicAddress) + PAGE_SIZE,
-      PAGE_ALIGN_ADDR_DOWN(gLocalApicAddress),
-      PAGE_DIRECTORY_ENTRY_PRESENT | PAGE_DIRECTORY_ENTRY_WRITABLE);
-  if (errCode != 0) {
-    printk(
-        "ERROR kSetupVM: LAPIC address identity mapping in "
-        "kMapPagesForAddrRange failed\n");
-    KERNEL_PANIC(errCode);
+  int isFilePage = (area->flags & VM_AREA_FILE) && fileOffset < area->fileSize;
+  // zero-filled pages come from the zeroed page pools
+  uint8_t *page = isFilePage ? kAllocUserPage(&errCode)
+                             : kAllocZeroedUserPage(&errCode);
+  if (page == NULL) {
+    printk("ERROR populatePage: page allocation failed\n");
+    return errCode;
+  }
+  if (isFilePage) {
+    uint64_t size = area->fileSize - fileOffset;
+    if (size > PAGE_SIZE) {
+      size = PAGE_SIZE;
+    }
+    memset(page + size, 0, PAGE_SIZE - size);
+    if (readFileData(area->fileClusterIndex, fileOffset, page, size) !=
+        size) {
+      printk("ERROR populatePage: readFileData failed\n");
+      kFreePage((uint64_t)page);
+      return ERR_FAT16;
+    }
+    __atomic_add_fetch(&vmSpacePtr->stats.nFileFaults, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&nFileFaults, 1, __ATOMIC_RELAXED);
+  } else {
+    __atomic_add_fetch(&vmSpacePtr->stats.nZeroFillFaults, 1,
+                       __ATOMIC_RELAXED);
+    __atomic_add_fetch(&nZeroFillFaults, 1, __ATOMIC_RELAXED);
   }
 
-  for (int i = 0; i < acpiNIoApics; i++) {
-    // printk("Identity mapping for IOAPIC address: %x\n",
-    //       PAGE_ALIGN_ADDR_DOWN(ioApicAddresses[i]));
-    errCode = kMapPagesForAddrRange(
-        pml4TPageMapPtr, PAGE_ALIGN_ADDR_DOWN(ioApicAddresses[i]),
-        PAGE_ALIGN_ADDR_DOWN(ioApicAddresses[i]) + PAGE_SIZE,
-        PAGE_ALIGN_ADDR_DOWN(ioApicAddresses[i]),
-        PAGE_DIRECTORY_ENTRY_PRESENT | PAGE_DIRECTORY_ENTRY_WRITABLE);
-    if (errCode != 0) {
-      printk(
-          "ERROR kSetupVM: LAPIC address identity mapping in "
-          "kMapPagesForAddrRange failed\n");
-      KERNEL_PANIC(errCode);
+  setUserPageRefCount(VADDR_TO_PADDR(page), 1);
+  ptPtr[VADDR_TO_PT_INDEX(vAddr)] = VADDR_TO_PADDR(page) | flags;
+  return SUCCESS;
+}
+
+// Handle page fault at virtual address vAddr in the current address space
+int64_t handlePageFault(struct vmSpace *vmSpacePtr, uint64_t vAddr,
+                        uint64_t errorCode) {
+  uint64_t *pml4tPtr = (uint64_t *)PADDR_TO_VADDR(
+      EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(readCR3()));
+
+  if (!(errorCode & PAGE_FAULT_ERROR_PRESENT)) {
+    // first access to a page of a virtual memory area
+    struct vmArea *area = findVMArea(vmSpacePtr, vAddr);
+    if (area == NULL) {
+      return ERR_PAGE_IS_NOT_PRESENT;
+    }
+    if ((errorCode & PAGE_FAULT_ERROR_WRITE) &&
+        !(area->flags & VM_AREA_WRITABLE)) {
+      return ERR_VM;
     }
+    return populatePage(vmSpacePtr, pml4tPtr, area, vAddr);
   }
-  return pml4TPageMapPtr;
+
+  if (!(errorCode & PAGE_FAULT_ERROR_WRITE)) {
+    return ERR_VM;
+  }
+  uint64_t *entryPtr = getPageEntryPointer(pml4tPtr, vAddr);
+  if (entryPtr == NULL || !(*entryPtr & PAGE_DIRECTORY_ENTRY_COW)) {
+    return ERR_VM;
+  }
+  __atomic_add_fetch(&vmSpacePtr->stats.nCoWFaults, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&nCoWFaults, 1, __ATOMIC_RELAXED);
+  int64_t errCode = (*entryPtr & PAGE_DIRECTORY_SIZE_2MB)
+                        ? breakHugeCoW(entryPtr, vAddr)
+                        : breakCoW(entryPtr, PAGE_ALIGN_ADDR_DOWN(vAddr));
+  // the page is mapped writable or to a new physical page
+  tlbGenIncrement(vmSpacePtr);
+  return errCode;
 }
-// Initialize kernel space virtual memory
-void kInitVM() {
-  gPML4TPageMapPtr = kSetupVM();
-  loadCR3((uint64_t)VADDR_TO_PADDR(gPML4TPageMapPtr));
-  printk("Kernel Virtual memory initialization complete!\n");
+
+// Populate the user pages in [vAddr, vAddr + size[ of the current address space
+int64_t kPrefaultUserPages(struct vmSpace *vmSpacePtr, uint64_t vAddr,
+                           uint64_t size, int write) {
+  uint64_t *pml4tPtr = (uint64_t *)PADDR_TO_VADDR(
+      EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(readCR3()));
+  uint64_t vEndAddr = vAddr + size;
+  if (vEndAddr < vAddr || vEndAddr > USER_SPACE_END) {
+    return ERR_VM;
+  }
+
+  for (vAddr = PAGE_ALIGN_ADDR_DOWN(vAddr); vAddr < vEndAddr;
+       vAddr += PAGE_SIZE) {
+    uint64_t *entryPtr = getPageEntryPointer(pml4tPtr, vAddr);
+    uint64_t errorCode = write ? PAGE_FAULT_ERROR_WRITE : 0;
+    if (entryPtr != NULL && (*entryPtr & PAGE_DIRECTORY_ENTRY_PRESENT)) {
+      if (!write || (*entryPtr & PAGE_DIRECTORY_ENTRY_WRITABLE)) {
+        continue;
+      }
+      errorCode |= PAGE_FAULT_ERROR_PRESENT;
+    }
+    int64_t errCode = handlePageFault(vmSpacePtr, vAddr, errorCode);
+    if (errCode != SUCCESS) {
+      return errCode;
+    }
+  }
+  return SUCCESS;
 }
 
-// Set up page table for user space and load user process image
-// processTotalSize must include processCodeSize (currently code + stack size)
-int initUserSpaceVM(uint64_t *pml4tPtr, uint64_t *processImageBuffer,
-                    uint64_t processCodeSize, uint64_t processTotalSize) {
-  int64_t errCode = SUCCESS;
+// Set the program break of the current process
+uint64_t kBrk(struct vmSpace *vmSpacePtr, uint64_t brk) {
+  struct vmArea *heap = NULL;
+  for (int i = 0; i < MAX_N_VM_AREAS; i++) {
+    if (vmSpacePtr->areaArray[i].flags & VM_AREA_HEAP) {
+      heap = &vmSpacePtr->areaArray[i];
+      break;
+    }
+  }
+  if (heap == NULL || brk < heap->vStartAddr || brk > USER_MMAP_BASE) {
+    return vmSpacePtr->brk;
+  }
 
-  if (processCodeSize > processTotalSize) {
-    printk("ERROR initUserSpaceVM: processCodeSize > processTotalSize\n");
-    KERNEL_PANIC(errCode);
+  uint64_t heapEndAddr = PAGE_ALIGN_ADDR_UP(brk);
+  if (heapEndAddr < heap->vEndAddr) {
+    uint64_t *pml4tPtr = (uint64_t *)PADDR_TO_VADDR(
+        EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(readCR3()));
+    if (unmapUserPages(vmSpacePtr, pml4tPtr, heapEndAddr, heap->vEndAddr) !=
+        SUCCESS) {
+      return vmSpacePtr->brk;
+    }
   }
+  heap->vEndAddr = heapEndAddr;
+  vmSpacePtr->brk = brk;
+  return brk;
+}
 
-  uint64_t nProcessPages =
-      (processTotalSize / PAGE_SIZE) + ((processTotalSize % PAGE_SIZE) != 0);
-  uint64_t nProcessCodePages =
-      (processCodeSize / PAGE_SIZE) + ((processCodeSize % PAGE_SIZE) != 0);
-
-  for (uint64_t i = 0; i < nProcessPages; i++) {
-    uint64_t *page = kAllocPage(&errCode);
-    if (page != NULL) {
-      memset(page, 0, PAGE_SIZE);
-
-      // Using this function here is a bit of an  overkill as we map only one
-      // physical page at a time
-      errCode = kMapPagesForAddrRange(
-          pml4tPtr, USER_PROGRAM_COUNTER + i * PAGE_SIZE,
-          USER_PROGRAM_COUNTER + (i + 1) * PAGE_SIZE, VADDR_TO_PADDR(page),
-          PAGE_DIRECTORY_ENTRY_PRESENT | PAGE_DIRECTORY_ENTRY_WRITABLE |
-              PAGE_DIRECTORY_ENTRY_U);
-
-      if (errCode == SUCCESS) {
-        if (i < nProcessCodePages) {
-          uint64_t size = PAGE_SIZE;
-          // If last page, adjust size if process code size is not divisible by
-          // PAGE_SIZE
-          if ((i == (nProcessCodePages - 1)) && (processCodeSize % PAGE_SIZE)) {
-            size = processCodeSize % PAGE_SIZE;
-          }
+// Returns 1 if no virtual memory area overlaps [vStartAddr, vEndAddr[, 0
+// otherwise
+static int isVMRangeFree(struct vmSpace *vmSpacePtr, uint64_t vStartAddr,
+                         uint64_t vEndAddr) {
+  for (int i = 0; i < MAX_N_VM_AREAS; i++) {
+    struct vmArea *area = &vmSpacePtr->areaArray[i];
+    if (area->vEndAddr != 0 && vStartAddr < area->vEndAddr &&
+        area->vStartAddr < vEndAddr) {
+      return 0;
+    }
+  }
+  return 1;
+}
 
-          uint64_t *vAddr =
-              processImageBuffer + (i * PAGE_SIZE / sizeof(uint64_t));
-          memcpy(page, vAddr, size);
-        }
-      } else {
-        errCode = kFreePage((uint64_t)page);
-        if (errCode != SUCCESS) {
-          printk(
-              "ERROR initUserSpaceVM: kFreePage failed after "
-              "kMapPagesForAddrRange error\n");
-          KERNEL_PANIC(errCode);
+// Returns the lowest address of a free range of length bytes in
+// [USER_MMAP_BASE, USER_SPACE_END[, 0 if there is none
+static uint64_t findFreeVMRange(struct vmSpace *vmSpacePtr, uint64_t length) {
+  uint64_t vAddr = USER_MMAP_BASE;
+  int i = 0;
+  while (i < MAX_N_VM_AREAS) {
+    if (vAddr + length > USER_SPACE_END) {
+      return 0;
+    }
+    struct vmArea *area = &vmSpacePtr->areaArray[i];
+    if (area->vEndAddr != 0 && vAddr < area->vEndAddr &&
+        area->vStartAddr < vAddr + length) {
+      // skip past overlapping area and check all areas again
+      vAddr = area->vEndAddr;
+      i = 0;
+      continue;
+    }
+    i++;
+  }
+  return vAddr;
+}
+
+// Add virtual memory area [vStartAddr, vEndAddr[ (free range), merging it with
+// adjacent areas with the same flags
+static int64_t insertVMArea(struct vmSpace *vmSpacePtr, uint64_t vStartAddr,
+                            uint64_t vEndAddr, uint64_t flags) {
+  struct vmArea *prev = NULL;
+  struct vmArea *next = NULL;
+  struct vmArea *unused = NULL;
+  for (int i = 0; i < MAX_N_VM_AREAS; i++) {
+    struct vmArea *area = &vmSpacePtr->areaArray[i];
+    if (area->vEndAddr == 0) {
+      if (unused == NULL) {
+        unused = area;
+      }
+    } else if (area->flags == flags && area->vEndAddr == vStartAddr) {
+      prev = area;
+    } else if (area->flags == flags && area->vStartAddr == vEndAddr) {
+      next = area;
+    }
+  }
+
+  if (prev != NULL && next != NULL) {
+    prev->vEndAddr = next->vEndAddr;
+    memset(next, 0, sizeof(struct vmArea));
+  } else if (prev != NULL) {
+    prev->vEndAddr = vEndAddr;
+  } else if (next != NULL) {
+    next->vStartAddr = vStartAddr;
+  } else if (unused != NULL) {
+    unused->vStartAddr = vStartAddr;
+    unused->vEndAddr = vEndAddr;
+    unused->flags = flags;
+  } else {
+    return ERR_VM;
+  }
+  return SUCCESS;
+}
+
+// Map length bytes of zero-filled memory in the current address space
+uint64_t kMmap(struct vmSpace *vmSpacePtr, uint64_t vAddr, uint64_t length,
+               uint64_t prot, uint64_t flags) {
+  if (length == 0 || length > USER_SPACE_END - USER_MMAP_BASE ||
+      !(prot & PROT_READ) || (prot & ~(PROT_READ | PROT_WRITE)) ||
+      flags != (MAP_PRIVATE | MAP_ANONYMOUS)) {
+    return 0;
+  }
+  length = PAGE_ALIGN_ADDR_UP(length);
+
+  // the address is only a hint; it is compared with USER_SPACE_END - length
+  // (length is bounded) because vAddr + length can overflow
+  if (vAddr == 0 || (vAddr & (PAGE_SIZE - 1)) || vAddr < USER_MMAP_BASE ||
+      vAddr > USER_SPACE_END - length ||
+      !isVMRangeFree(vmSpacePtr, vAddr, vAddr + length)) {
+    vAddr = findFreeVMRange(vmSpacePtr, length);
+    if (vAddr == 0) {
+      return 0;
+    }
+  }
+
+  uint64_t areaFlags = VM_AREA_MMAP;
+  if (prot & PROT_WRITE) {
+    areaFlags |= VM_AREA_WRITABLE;
+  }
+  if (insertVMArea(vmSpacePtr, vAddr, vAddr + length, areaFlags) != SUCCESS) {
+    return 0;
+  }
+  return vAddr;
+}
+
+// Unmap the pages of anonymous mappings in [vAddr, vAddr + length[ of the
+// current address space
+int64_t kMunmap(struct vmSpace *vmSpacePtr, uint64_t vAddr, uint64_t length) {
+  uint64_t vEndAddr = PAGE_ALIGN_ADDR_UP(vAddr + length);
+  if ((vAddr & (PAGE_SIZE - 1)) || length == 0 || vEndAddr < vAddr ||
+      vEndAddr > USER_SPACE_END) {
+    return ERR_VM;
+  }
+  uint64_t *pml4tPtr = (uint64_t *)PADDR_TO_VADDR(
+      EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(readCR3()));
+
+  for (int i = 0; i < MAX_N_VM_AREAS; i++) {
+    struct vmArea *area = &vmSpacePtr->areaArray[i];
+    if (!(area->flags & VM_AREA_MMAP) || vAddr >= area->vEndAddr ||
+        area->vStartAddr >= vEndAddr) {
+      continue;
+    }
+    uint64_t vUnmapStartAddr =
+        vAddr > area->vStartAddr ? vAddr : area->vStartAddr;
+    uint64_t vUnmapEndAddr =
+        vEndAddr < area->vEndAddr ? vEndAddr : area->vEndAddr;
+
+    if (vUnmapStartAddr == area->vStartAddr &&
+        vUnmapEndAddr == area->vEndAddr) {
+      memset(area, 0, sizeof(struct vmArea));
+    } else if (vUnmapStartAddr == area->vStartAddr) {
+      area->vStartAddr = vUnmapEndAddr;
+    } else if (vUnmapEndAddr == area->vEndAddr) {
+      area->vEndAddr = vUnmapStartAddr;
+    } else {  // split area in two
+      struct vmArea *tail = NULL;
+      for (int j = 0; j < MAX_N_VM_AREAS; j++) {
+        if (vmSpacePtr->areaArray[j].vEndAddr == 0) {
+          tail = &vmSpacePtr->areaArray[j];
+          break;
         }
       }
+      if (tail == NULL) {
+        return ERR_VM;
+      }
+      *tail = *area;
+      tail->vStartAddr = vUnmapEndAddr;
+      area->vEndAddr = vUnmapStartAddr;
+    }
 
-    } else {
-      return ERR_ALLOC_FAILED;
+    int64_t errCode =
+        unmapUserPages(vmSpacePtr, pml4tPtr, vUnmapStartAddr, vUnmapEndAddr);
+    if (errCode != SUCCESS) {
+      return errCode;
     }
   }
-  return errCode;
+  return SUCCESS;
 }
 
-// Set up page table for user space and copy process image from source process
-int copyUserSpaceVM(uint64_t *dstPml4tPtr, uint64_t *srcPml4tPtr,
-                    uint64_t *processImageBuffer, uint64_t processTotalSize) {
+// Return id of the shared memory segment with given key (create it if needed)
+int64_t kShmGet(uint64_t key, uint64_t size) {
   int64_t errCode = SUCCESS;
+  int64_t unusedId = -1;
+  if (size == 0 || size > MAX_SHM_SEGMENT_SIZE) {
+    return ERR_VM;
+  }
+  uint64_t nPages = PAGE_ALIGN_ADDR_UP(size) / PAGE_SIZE;
+
+  spinLock(&shmLock);
+  for (int64_t i = 0; i < MAX_N_SHM_SEGMENTS; i++) {
+    struct shmSegment *segment = &shmSegmentArray[i];
+    if (segment->nPages == 0) {
+      if (unusedId < 0) {
+        unusedId = i;
+      }
+    } else if (segment->key == key && !segment->isRemoved) {
+      spinUnlock(&shmLock);
+      return nPages <= segment->nPages ? i : ERR_VM;
+    }
+  }
+  if (unusedId < 0) {
+    spinUnlock(&shmLock);
+    printk("ERROR kShmGet: no free shared memory segments\n");
+    return ERR_VM;
+  }
+  struct shmSegment *segment = &shmSegmentArray[unusedId];
+  segment->pAddrArray = kAllocZeroedPage(&errCode);
+  if (segment->pAddrArray == NULL) {
+    spinUnlock(&shmLock);
+    printk("ERROR kShmGet: kAllocZeroedPage failed\n");
+    return errCode;
+  }
+  segment->key = key;
+  segment->nPages = nPages;
+  spinUnlock(&shmLock);
+  return unusedId;
+}
 
-  uint64_t nProcessPages =
-      (processTotalSize / PAGE_SIZE) + ((processTotalSize % PAGE_SIZE) != 0);
-
-  for (uint64_t i = 0; i < nProcessPages; i++) {
-    uint64_t *page = kAllocPage(&errCode);
-    if (page != NULL) {
-      memset(page, 0, PAGE_SIZE);
-
-      // Using this function here is a bit of an  overkill as we map only one
-      // physical page at a time
-
-      errCode = kMapPagesForAddrRange(
-          dstPml4tPtr, USER_PROGRAM_COUNTER + i * PAGE_SIZE,
-          USER_PROGRAM_COUNTER + (i + 1) * PAGE_SIZE, VADDR_TO_PADDR(page),
-          PAGE_DIRECTORY_ENTRY_PRESENT | PAGE_DIRECTORY_ENTRY_WRITABLE |
-              PAGE_DIRECTORY_ENTRY_U);
-
-      if (errCode == SUCCESS) {
-        uint64_t size = PAGE_SIZE;
-        // If last page, adjust size if processTotalSize is not divisible by
-        // PAGE_SIZE
-        if ((i == (nProcessPages - 1)) && (processTotalSize % PAGE_SIZE)) {
-          size = processTotalSize % PAGE_SIZE;
-        }
-
-        uint64_t *vAddr =
-            processImageBuffer + (i * PAGE_SIZE / sizeof(uint64_t));
-        uint64_t *ptPtr = getPTPointer(srcPml4tPtr, (uint64_t)vAddr);
-        if (ptPtr == NULL) {
-          printk("ERROR copyUserSpaceVM: getPTPointer returned NULL\n");
-          return ERR_VM;
-        }
-        uint64_t ptIndex = VADDR_TO_PT_INDEX((uint64_t)vAddr);
-        if (!(ptPtr[ptIndex] & PAGE_DIRECTORY_ENTRY_PRESENT)) {
-          printk("ERROR copyUserSpaceVM: PT entry present page flag not set\n");
-          return ERR_VM;
-        }
+// Map shared memory segment shmId in the current address space
+uint64_t kShmAttach(struct vmSpace *vmSpacePtr, uint64_t shmId, uint64_t vAddr,
+                    uint64_t prot) {
+  struct vmArea *area = NULL;
+  if (shmId >= MAX_N_SHM_SEGMENTS || !(prot & PROT_READ) ||
+      (prot & ~(PROT_READ | PROT_WRITE))) {
+    return 0;
+  }
+  for (int i = 0; i < MAX_N_VM_AREAS; i++) {
+    if (vmSpacePtr->areaArray[i].vEndAddr == 0) {
+      area = &vmSpacePtr->areaArray[i];
+      break;
+    }
+  }
+  if (area == NULL) {
+    return 0;
+  }
 
-        memcpy(page, vAddr, size);
-      } else {
-        errCode = kFreePage((uint64_t)page);
-        if (errCode != SUCCESS) {
-          printk(
-              "ERROR copyUserSpaceVM: kFreePage failed after "
-              "kMapPagesForAddrRange error\n");
-          KERNEL_PANIC(errCode);
-        }
+  struct shmSegment *segment = &shmSegmentArray[shmId];
+  spinLock(&shmLock);
+  uint64_t length = segment->nPages * PAGE_SIZE;
+  if (length == 0 || segment->isRemoved) {
+    spinUnlock(&shmLock);
+    return 0;
+  }
+  // the address is only a hint; it is compared with USER_SPACE_END - length
+  // (length is bounded) because vAddr + length can overflow
+  if (vAddr == 0 || (vAddr & (PAGE_SIZE - 1)) || vAddr < USER_MMAP_BASE ||
+      vAddr > USER_SPACE_END - length ||
+      !isVMRangeFree(vmSpacePtr, vAddr, vAddr + length)) {
+    vAddr = findFreeVMRange(vmSpacePtr, length);
+    if (vAddr == 0) {
+      spinUnlock(&shmLock);
+      return 0;
+    }
+  }
+  area->vStartAddr = vAddr;
+  area->vEndAddr = vAddr + length;
+  area->flags = VM_AREA_SHM;
+  if (prot & PROT_WRITE) {
+    area->flags |= VM_AREA_WRITABLE;
+  }
+  area->shmId = shmId;
+  segment->nAttachments++;
+
+  // map the pages already populated by other processes in one pass instead
+  // of one page fault per page
+  uint64_t *pml4tPtr = (uint64_t *)PADDR_TO_VADDR(
+      EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(readCR3()));
+  uint64_t flags = PAGE_DIRECTORY_ENTRY_PRESENT | PAGE_DIRECTORY_ENTRY_U;
+  if (prot & PROT_WRITE) {
+    flags |= PAGE_DIRECTORY_ENTRY_WRITABLE;
+  }
+  int64_t errCode = kMapPageArray(pml4tPtr, vAddr, segment->pAddrArray,
+                                  segment->nPages, flags);
+  if (errCode != SUCCESS) {
+    // out of memory for page tables: undo the attachment and fail the call
+    // The range was free, so its present entries were all created by
+    // kMapPageArray, which does not take page references
+    for (uint64_t i = 0; i < segment->nPages; i++) {
+      uint64_t *entryPtr = getPageEntryPointer(pml4tPtr, vAddr + i * PAGE_SIZE);
+      if (entryPtr != NULL) {
+        *entryPtr = 0;
       }
+    }
+    flushTLB();
+    memset(area, 0, sizeof(struct vmArea));
+    segment->nAttachments--;
+    spinUnlock(&shmLock);
+    printk("ERROR kShmAttach: kMapPageArray failed\n");
+    return 0;
+  }
+  for (uint64_t i = 0; i < segment->nPages; i++) {
+    if (segment->pAddrArray[i] != 0) {
+      getUserPage(segment->pAddrArray[i]);
+    }
+  }
+  spinUnlock(&shmLock);
+  return vAddr;
+}
 
-    } else {
-      printk("ERROR copyUserSpaceVM: kAlloc failed\n");
-      return ERR_ALLOC_FAILED;
+// Remove shared memory segment shmId
+int64_t kShmRemove(uint64_t shmId) {
+  if (shmId >= MAX_N_SHM_SEGMENTS) {
+    return ERR_VM;
+  }
+  struct shmSegment *segment = &shmSegmentArray[shmId];
+  spinLock(&shmLock);
+  if (segment->nPages == 0 || segment->isRemoved) {
+    spinUnlock(&shmLock);
+    return ERR_VM;
+  }
+  if (segment->nAttachments == 0) {
+    destroyShmSegment(segment);
+  } else {
+    segment->isRemoved = 1;
+  }
+  spinUnlock(&shmLock);
+  return SUCCESS;
+}
+
+// Unmap the shared memory segment attached at vAddr
+int64_t kShmDetach(struct vmSpace *vmSpacePtr, uint64_t vAddr) {
+  for (int i = 0; i < MAX_N_VM_AREAS; i++) {
+    struct vmArea *area = &vmSpacePtr->areaArray[i];
+    if (!(area->flags & VM_AREA_SHM) || area->vStartAddr != vAddr) {
+      continue;
     }
+    uint64_t *pml4tPtr = (uint64_t *)PADDR_TO_VADDR(
+        EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(readCR3()));
+    uint64_t shmId = area->shmId;
+    int64_t errCode =
+        unmapUserPages(vmSpacePtr, pml4tPtr, area->vStartAddr, area->vEndAddr);
+    memset(area, 0, sizeof(struct vmArea));
+    detachShmSegment(shmId);
+    return errCode;
   }
+  return ERR_VM;
+}
 
-  return errCode;
+// Remove the shared memory segment attachments of a process being freed
+void kDetachSharedMemory(struct vmSpace *vmSpacePtr) {
+  for (int i = 0; i < MAX_N_VM_AREAS; i++) {
+    struct vmArea *area = &vmSpacePtr->areaArray[i];
+    if (area->flags & VM_AREA_SHM) {
+      detachShmSegment(area->shmId);
+      memset(area, 0, sizeof(struct vmArea));
+    }
+  }
 }
 
 // If there there are virtual pages that are mapped to phyisical pages in the
-// address range, add them to to the free list and clear the PDT entry
+// address range, remove the page reference (add the page to the free list if
+// it was the last one) and clear the PT entry
 int64_t kFreePagesInAddrRange(uint64_t *pml4tPtr, uint64_t vStartAddr,
                               uint64_t vEndAddr) {
   if (vStartAddr & (PAGE_SIZE - 1)) {  // % PAGE_SIZE
@@ -608,107 +2697,486 @@ int64_t kFreePagesInAddrRange(uint64_t *pml4tPtr, uint64_t vStartAddr,
     return ERR_NEG_ADDR_RANGE;
   }
 
-  do {
-    uint64_t ptIndex = VADDR_TO_PT_INDEX(vStartAddr);
+  // one PT (up to 512 pages) per iteration
+  while (vStartAddr < vEndAddr) {
+    uint64_t vPTEndAddr = getPTRangeEnd(vStartAddr, vEndAddr);
     uint64_t *ptPtr = getPTPointer(pml4tPtr, vStartAddr);
-    if (ptPtr) {
+    uint64_t *pdtEntryPtr =
+        ptPtr == NULL ? getHugePageEntryPointer(pml4tPtr, vStartAddr) : NULL;
+    if (pdtEntryPtr != NULL) {
+      if (!(vStartAddr & (PAGE_SIZE_2MB - 1)) &&
+          vPTEndAddr - vStartAddr == PAGE_SIZE_2MB) {
+        int64_t errCode =
+            putHugeUserPage(EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(*pdtEntryPtr));
+        *pdtEntryPtr = 0;
+        if (errCode != SUCCESS) {
+          return errCode;
+        }
+        vStartAddr = vPTEndAddr;
+        continue;
+      }
+      // part of the 2MB page is removed
+      int64_t errCode = splitHugePage(pdtEntryPtr);
+      if (errCode != SUCCESS) {
+        return errCode;
+      }
+      ptPtr = getPTPointer(pml4tPtr, vStartAddr);
+    }
+    if (ptPtr == NULL) {  // no page mapped in this 2MB range
+      vStartAddr = vPTEndAddr;
+      continue;
+    }
+    for (; vStartAddr < vPTEndAddr; vStartAddr += PAGE_SIZE) {
+      uint64_t ptIndex = VADDR_TO_PT_INDEX(vStartAddr);
       if ((ptPtr[ptIndex] & PAGE_DIRECTORY_ENTRY_PRESENT)) {
-        kFreePage(PADDR_TO_VADDR(
-            EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(ptPtr[ptIndex])));
+        putUserPage(EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(ptPtr[ptIndex]));
         ptPtr[ptIndex] = 0;
       }
     }
-    vStartAddr += PAGE_SIZE;
-  } while (vStartAddr + PAGE_SIZE <= vEndAddr);
+  }
   return SUCCESS;
 }
 
-// For each of the 512 PML4T entries, for each of the 512 PDPT entries, for each
-// of the 512 PDT entries free the page containing one PT pointed to by the PDT
-// entry and zero out PDT entry
-static void kFreePT(uint64_t *pml4tPtr) {
+// Returns 1 if the PML4T entry at index i references page tables shared with
+// the kernel PML4T (see kSetupVM), 0 otherwise
+static int isSharedPML4TEntry(uint64_t *pml4tPtr, int i) {
+  return (i >= N_PAGE_TABLE_ENTRIES / 2) ||
+         (pml4tPtr[i] == gPML4TPageMapPtr[i]);
+}
+
+// Returns 1 if entry ii of the process PDPT referenced by PML4T entry i is a
+// copy of the kernel PDPT entry (shared identity mapping PDT), 0 otherwise
+static int isSharedPDPTEntry(int i, uint64_t *pdptPtr, int ii) {
+  if (!(gPML4TPageMapPtr[i] & PAGE_DIRECTORY_ENTRY_PRESENT)) {
+    return 0;
+  }
+  uint64_t *kernelPdptPtr = (uint64_t *)PADDR_TO_VADDR(
+      EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(gPML4TPageMapPtr[i]));
+  return pdptPtr[ii] == kernelPdptPtr[ii];
+}
+
+// Free page holding a page table (PDPT, PDT or PT) referenced by entry
+// tableEntry
+static void kFreePageTable(uint64_t tableEntry) {
+  int64_t errCode = kFreePage(
+      PADDR_TO_VADDR(EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(tableEntry)));
+  if (errCode != SUCCESS) {
+    printk("ERROR kFreePageTable: kFreePage failed\n");
+    KERNEL_PANIC(errCode);
+  }
+}
+
+// Remove the references to the user pages mapped by PT ptPtr (pages are freed
+// when the last reference is removed)
+static void kPutPTPages(uint64_t *ptPtr) {
   for (int i = 0; i < N_PAGE_TABLE_ENTRIES; i++) {
-    if (pml4tPtr[i] & PAGE_DIRECTORY_ENTRY_PRESENT) {
-      uint64_t *pdptPtr = (uint64_t *)PADDR_TO_VADDR(
-          EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(pml4tPtr[i]));
-      for (int ii = 0; ii < N_PAGE_TABLE_ENTRIES; ii++) {
-        if ((pdptPtr[ii] & PAGE_DIRECTORY_ENTRY_PRESENT)) {
-          uint64_t *pdtPtr = (uint64_t *)PADDR_TO_VADDR(
-              EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(pdptPtr[ii]));
-          for (int iii = 0; iii < N_PAGE_TABLE_ENTRIES; iii++) {
-            if (pdtPtr[iii] & PAGE_DIRECTORY_ENTRY_PRESENT) {
-              uint64_t errCode = kFreePage(PADDR_TO_VADDR(
-                  EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(pdtPtr[iii])));
-
-              if (errCode != SUCCESS) {
-                printk("ERROR kFreePT kFreePage failed\n");
-                KERNEL_PANIC(errCode);
-              }
-              pdtPtr[iii] = 0;
-            }
-          }
-        }
+    if (ptPtr[i] & PAGE_DIRECTORY_ENTRY_PRESENT) {
+      int64_t errCode =
+          putUserPage(EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(ptPtr[i]));
+      if (errCode != SUCCESS) {
+        printk("ERROR kPutPTPages: putUserPage failed\n");
+        KERNEL_PANIC(errCode);
       }
     }
   }
 }
 
-// For each of the 512 PML4T entries, for each of the 512 PDPT entries free the
-// page containing one PDT pointed to by the PDPT entry and zero out PDTP entry
-static void kFreePDT(uint64_t *pml4tPtr) {
-  for (int i = 0; i < N_PAGE_TABLE_ENTRIES; i++) {
-    if (pml4tPtr[i] & PAGE_DIRECTORY_ENTRY_PRESENT) {
-      uint64_t *pdptPtr = (uint64_t *)PADDR_TO_VADDR(
-          EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(pml4tPtr[i]));
-      for (int ii = 0; ii < N_PAGE_TABLE_ENTRIES; ii++) {
-        if (pdptPtr[ii] & PAGE_DIRECTORY_ENTRY_PRESENT) {
-          uint64_t errCode = kFreePage(PADDR_TO_VADDR(
-              EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(pdptPtr[ii])));
+// Free user half of the page directory tree in a single pass: only present
+// entries are followed, so the cost is proportional to the number of page
+// tables of the process (512 entries each) rather than to the size of the
+// address space: user pages mapped by each PT are released, then the PT, PDT
+// and PDPT pages themselves
+// Page tables shared with the kernel PML4T are skipped
+static void kFreeUserPageTables(uint64_t *pml4tPtr) {
+  for (int i = 0; i < N_PAGE_TABLE_ENTRIES / 2; i++) {
+    if (!(pml4tPtr[i] & PAGE_DIRECTORY_ENTRY_PRESENT) ||
+        isSharedPML4TEntry(pml4tPtr, i)) {
+      continue;
+    }
+    uint64_t *pdptPtr = (uint64_t *)PADDR_TO_VADDR(
+        EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(pml4tPtr[i]));
+    for (int ii = 0; ii < N_PAGE_TABLE_ENTRIES; ii++) {
+      if (!(pdptPtr[ii] & PAGE_DIRECTORY_ENTRY_PRESENT) ||
+          isSharedPDPTEntry(i, pdptPtr, ii)) {
+        continue;
+      }
+      uint64_t *pdtPtr = (uint64_t *)PADDR_TO_VADDR(
+          EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(pdptPtr[ii]));
+      for (int iii = 0; iii < N_PAGE_TABLE_ENTRIES; iii++) {
+        if (!(pdtPtr[iii] & PAGE_DIRECTORY_ENTRY_PRESENT)) {
+          continue;
+        }
+        if (pdtPtr[iii] & PAGE_DIRECTORY_SIZE_2MB) {
+          int64_t errCode = putHugeUserPage(
+              EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(pdtPtr[iii]));
           if (errCode != SUCCESS) {
-            printk("ERROR kFreePDT kFreePage failed\n");
+            printk("ERROR kFreeUserPageTables: putHugeUserPage failed\n");
             KERNEL_PANIC(errCode);
           }
-          pdptPtr[ii] = 0;
+          continue;
         }
+        kPutPTPages((uint64_t *)PADDR_TO_VADDR(
+            EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(pdtPtr[iii])));
+        kFreePageTable(pdtPtr[iii]);
       }
+      kFreePageTable(pdptPtr[ii]);
     }
+    kFreePageTable(pml4tPtr[i]);
   }
 }
 
-// For each of the 512 PML4T entries free the page containing one PDPT pointed
-// to by the PML4T entry and zero out PML4T entry
-static void kFreePDPT(uint64_t *pml4tPtr) {
-  for (int i = 0; i < N_PAGE_TABLE_ENTRIES; i++) {
-    if (pml4tPtr[i] & PAGE_DIRECTORY_ENTRY_PRESENT) {
-      uint64_t errCode = kFreePage(
-          PADDR_TO_VADDR(EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(pml4tPtr[i])));
-      if (errCode != SUCCESS) {
-        printk("ERROR kFreePDPT kFreePage failed\n");
-        KERNEL_PANIC(errCode);
+// Free (add to free page list) user pages and pages used for the user half of
+// the PML4T -> PDPT -> PDT -> PT page directory tree structure, then the PML4T
+// Kernel space page tables are shared and are not freed
+// The page table must not be loaded on any core
+static void kFreeVM(uint64_t *pml4tPtr) {
+  kFreeUserPageTables(pml4tPtr);
+  // free page containing PML4T
+  int64_t errCode = kFreePage((uint64_t)pml4tPtr);
+  if (errCode != SUCCESS) {
+    printk("ERROR kFreeVM kFreePage for PML4T failed\n");
+    KERNEL_PANIC(errCode);
+  }
+}
+
+// Returns 1 if page table pml4tPtr is loaded on a core, 0 otherwise
+static int isPageTableLoaded(uint64_t *pml4tPtr) {
+  for (int i = 0; i < MAX_N_CORES_SUPPORTED; i++) {
+    if (__atomic_load_n(&tlbStateArray[i].loadedPml4tPtr, __ATOMIC_SEQ_CST) ==
+        pml4tPtr) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Take over the release of page table pml4tPtr if freeVM deferred it and no
+// core has it loaded any more
+// Returns 1 if the caller must free the page table (kFreeVM), 0 otherwise
+static int claimDeferredVM(uint64_t *pml4tPtr) {
+  struct pageFrame *frame = getPageFrame((uint64_t)pml4tPtr);
+  if (!(__atomic_load_n(&frame->flags, __ATOMIC_SEQ_CST) &
+        PAGE_FRAME_FREE_DEFERRED)) {
+    return 0;
+  }
+  uint64_t flags = saveFlagsAndCli();
+  spinLock(&deferredFreeLock);
+  int isFreeable = (frame->flags & PAGE_FRAME_FREE_DEFERRED) &&
+                   !isPageTableLoaded(pml4tPtr);
+  if (isFreeable) {
+    __atomic_and_fetch(&frame->flags, ~PAGE_FRAME_FREE_DEFERRED,
+                       __ATOMIC_SEQ_CST);
+  }
+  spinUnlock(&deferredFreeLock);
+  restoreFlags(flags);
+  return isFreeable;
+}
+
+// Last PML4T entry: kernel space entry, not used by kFreeVM, that links the
+// page tables of the released list of a core (the page tables are no longer
+// loaded)
+#define RELEASED_PML4T_LINK_INDEX (N_PAGE_TABLE_ENTRIES - 1)
+
+// Free the page tables released by switchAddressSpace on the running core
+// Called after switching process, once the run queue lock is released
+// (schedule), and by the idle loop: a whole address space is not torn down
+// while the scheduler lock of the core is held
+void freeReleasedAddressSpaces() {
+  uint64_t flags = saveFlagsAndCli();
+  struct tlbState *state = &tlbStateArray[getCoreId()];
+  uint64_t *pml4tPtr = state->releasedPml4tPtr;
+  state->releasedPml4tPtr = NULL;
+  restoreFlags(flags);
+  while (pml4tPtr != NULL) {
+    uint64_t *nextPml4tPtr = (uint64_t *)pml4tPtr[RELEASED_PML4T_LINK_INDEX];
+    kFreeVM(pml4tPtr);
+    pml4tPtr = nextPml4tPtr;
+  }
+}
+
+// Free process page table pml4tPtr and the user pages it maps
+// An idle process keeps the page table of the previous process loaded (lazy
+// TLB): if a core still has the page table loaded, it is freed by that core
+// when it loads another page table (see switchAddressSpace and
+// releaseLazyAddressSpace)
+void freeVM(uint64_t *pml4tPtr) {
+  struct pageFrame *frame = getPageFrame((uint64_t)pml4tPtr);
+  uint64_t flags = saveFlagsAndCli();
+  spinLock(&deferredFreeLock);
+  __atomic_or_fetch(&frame->flags, PAGE_FRAME_FREE_DEFERRED, __ATOMIC_SEQ_CST);
+  int isLoaded = isPageTableLoaded(pml4tPtr);
+  if (!isLoaded) {
+    __atomic_and_fetch(&frame->flags, ~PAGE_FRAME_FREE_DEFERRED,
+                       __ATOMIC_SEQ_CST);
+  }
+  spinUnlock(&deferredFreeLock);
+  restoreFlags(flags);
+  if (!isLoaded) {
+    kFreeVM(pml4tPtr);
+  }
+}
+
+// Load page table pml4tPtr of address space vmSpacePtr on the running core
+// Kernel-only (idle) processes borrow the page table that is already loaded
+// (lazy TLB) and the CR3 load is skipped when the page table does not change
+// Interrupts must be disabled
+void switchAddressSpace(uint64_t *pml4tPtr, struct vmSpace *vmSpacePtr) {
+  struct tlbState *state = &tlbStateArray[getCoreId()];
+  uint64_t *prevPml4tPtr = state->loadedPml4tPtr;
+  if (pml4tPtr == gPML4TPageMapPtr) {
+    state->stats.nLazySwitches++;
+    __atomic_store_n(&state->isLazy, 1, __ATOMIC_SEQ_CST);
+    return;
+  }
+  // tlbShootdownFlush checks isLazy after incrementing the TLB generation: the
+  // core is marked active before the TLB generation is read
+  __atomic_store_n(&state->isLazy, 0, __ATOMIC_SEQ_CST);
+  uint64_t tlbGen = __atomic_load_n(&vmSpacePtr->tlbGen, __ATOMIC_SEQ_CST);
+  if (pml4tPtr == prevPml4tPtr && tlbGen == state->loadedTlbGen) {
+    state->stats.nSkippedSwitches++;
+    return;
+  }
+
+  // freeVM checks loadedPml4tPtr after marking a page table for deferred
+  // release: the page table is published before the CR3 load
+  __atomic_store_n(&state->loadedPml4tPtr, pml4tPtr, __ATOMIC_SEQ_CST);
+  state->loadedTlbGen = tlbGen;
+  uint64_t cr3 = VADDR_TO_PADDR(pml4tPtr);
+  if (!pcidEnabled) {
+    state->stats.nFlushSwitches++;
+    loadCR3(cr3);
+  } else {
+    if (vmSpacePtr->addressSpaceId == 0) {
+      vmSpacePtr->addressSpaceId =
+          __atomic_add_fetch(&nextAddressSpaceId, 1, __ATOMIC_RELAXED);
+    }
+    int slot = -1;
+    int noFlush = 0;
+    for (int i = 0; i < N_PCID_SLOTS; i++) {
+      if (state->slotArray[i].addressSpaceId == vmSpacePtr->addressSpaceId) {
+        slot = i;
+        noFlush = state->slotArray[i].tlbGen == tlbGen;
+        break;
       }
-      pml4tPtr[i] = 0;
     }
+    if (slot < 0) {  // evict least recently assigned slot
+      slot = state->nextVictimSlot;
+      state->nextVictimSlot = (state->nextVictimSlot + 1) % N_PCID_SLOTS;
+      state->slotArray[slot].addressSpaceId = vmSpacePtr->addressSpaceId;
+    }
+    state->slotArray[slot].tlbGen = tlbGen;
+    if (noFlush) {
+      state->stats.nNoFlushSwitches++;
+      loadCR3(cr3 | (slot + 1) | CR3_NO_FLUSH);
+    } else {
+      state->stats.nFlushSwitches++;
+      loadCR3(cr3 | (slot + 1));
+    }
+  }
+  // the previous page table is only queued here: freeing it walks the whole
+  // address space and this runs with the run queue lock held (schedule)
+  if (prevPml4tPtr != NULL && prevPml4tPtr != pml4tPtr &&
+      prevPml4tPtr != gPML4TPageMapPtr && claimDeferredVM(prevPml4tPtr)) {
+    prevPml4tPtr[RELEASED_PML4T_LINK_INDEX] = (uint64_t)state->releasedPml4tPtr;
+    state->releasedPml4tPtr = prevPml4tPtr;
   }
 }
 
-// Zero out and free (add to free page list) pages used for 3-level PML4T ->
-// PDPT -> PDT page directory tree strucure
-void freeVM(uint64_t *pml4tPtr, uint64_t processTotalSize) {
-  uint64_t errCode = kFreePagesInAddrRange(
-      pml4tPtr, USER_PROGRAM_COUNTER, USER_PROGRAM_COUNTER + processTotalSize);
-  if (errCode != SUCCESS) {
-    printk("ERROR freeVM kFreePagesInAddrRange failed\n");
-    KERNEL_PANIC(errCode);
+// If the page table borrowed by the idle process of the running core was
+// released by freeVM, load the kernel page table and free it
+// Called by the idle loop (kernel.asm)
+void releaseLazyAddressSpace() {
+  uint64_t flags = saveFlagsAndCli();
+  struct tlbState *state = &tlbStateArray[getCoreId()];
+  uint64_t *pml4tPtr = state->loadedPml4tPtr;
+  if (pml4tPtr != gPML4TPageMapPtr &&
+      (__atomic_load_n(&getPageFrame((uint64_t)pml4tPtr)->flags,
+                       __ATOMIC_SEQ_CST) &
+       PAGE_FRAME_FREE_DEFERRED)) {
+    __atomic_store_n(&state->loadedPml4tPtr, gPML4TPageMapPtr,
+                     __ATOMIC_SEQ_CST);
+    state->loadedTlbGen = 0;
+    state->stats.nFlushSwitches++;
+    loadCR3(VADDR_TO_PADDR(gPML4TPageMapPtr));
+    if (claimDeferredVM(pml4tPtr)) {
+      kFreeVM(pml4tPtr);
+    }
   }
-  kFreePT(pml4tPtr);
-  kFreePDT(pml4tPtr);
-  kFreePDPT(pml4tPtr);
-  // free page containing PML4T
-  errCode = kFreePage((uint64_t)pml4tPtr);
-  if (errCode != SUCCESS) {
-    printk("ERROR kFreeVM kFreePage for PML4T failed\n");
-    KERNEL_PANIC(errCode);
+  restoreFlags(flags);
+  freeReleasedAddressSpaces();
+}
+
+// Copy TLB counters summed over all cores into stats
+void getTLBStats(struct tlbStats *stats) {
+  memset(stats, 0, sizeof(struct tlbStats));
+  for (int i = 0; i < MAX_N_CORES_SUPPORTED; i++) {
+    stats->nFlushSwitches += tlbStateArray[i].stats.nFlushSwitches;
+    stats->nNoFlushSwitches += tlbStateArray[i].stats.nNoFlushSwitches;
+    stats->nLazySwitches += tlbStateArray[i].stats.nLazySwitches;
+    stats->nSkippedSwitches += tlbStateArray[i].stats.nSkippedSwitches;
+    stats->nFullFlushes += tlbStateArray[i].stats.nFullFlushes;
+    stats->nPageInvalidations += tlbStateArray[i].stats.nPageInvalidations;
+    stats->nShootdowns += tlbStateArray[i].stats.nShootdowns;
+    stats->nShootdownIPIs += tlbStateArray[i].stats.nShootdownIPIs;
+  }
+  stats->pcidEnabled = pcidEnabled;
+}
+
+// Returns the average number of CPU cycles (time stamp counter) taken by
+// nTargetCores other cores to invalidate nPages kernel pages over
+// TLB_SHOOTDOWN_BENCHMARK_ITERATIONS shootdowns: batched sends the whole batch
+// in one IPI per core, otherwise one IPI per core is sent for each page
+// Returns -1 if fewer than nTargetCores other cores are online or nPages is
+// larger than 2 * TLB_SHOOTDOWN_BATCH_SIZE (batches larger than
+// TLB_SHOOTDOWN_BATCH_SIZE flush the whole TLB)
+int64_t benchmarkTLBShootdown(uint64_t nTargetCores, uint64_t nPages,
+                              uint64_t batched) {
+  uint64_t otherCoreMask = getOnlineCoreMask() & ~(1ULL << getCoreId());
+  uint64_t coreMask = 0;
+  for (uint64_t i = 0; i < MAX_N_CORES_SUPPORTED && nTargetCores > 0; i++) {
+    if (otherCoreMask & (1ULL << i)) {
+      coreMask |= 1ULL << i;
+      nTargetCores--;
+    }
+  }
+  if (nTargetCores > 0 || nPages == 0 ||
+      nPages > 2 * TLB_SHOOTDOWN_BATCH_SIZE) {
+    return -1;
+  }
+
+  // kernel space pages: invalidating them only costs TLB misses
+  struct tlbShootdownBatch batch;
+  tlbShootdownInit(&batch, NULL, gPML4TPageMapPtr);
+  uint64_t start = readTimeStampCounter();
+  for (int i = 0; i < TLB_SHOOTDOWN_BENCHMARK_ITERATIONS; i++) {
+    if (batched) {
+      tlbShootdownAddRange(&batch, PADDR_TO_VADDR(0),
+                           PADDR_TO_VADDR(nPages * PAGE_SIZE));
+      smpCallFunction(coreMask, tlbShootdownRemote, &batch);
+      batch.flushAll = 0;
+      batch.nPages = 0;
+      continue;
+    }
+    for (uint64_t p = 0; p < nPages; p++) {
+      tlbShootdownAddRange(&batch, PADDR_TO_VADDR(p * PAGE_SIZE),
+                           PADDR_TO_VADDR((p + 1) * PAGE_SIZE));
+      smpCallFunction(coreMask, tlbShootdownRemote, &batch);
+      batch.nPages = 0;
+    }
+  }
+  return (readTimeStampCounter() - start) / TLB_SHOOTDOWN_BENCHMARK_ITERATIONS;
+}
+
+// Fill in the system-wide fields of stats
+void getMemoryStats(struct memoryStats *stats) {
+  memset(stats, 0, sizeof(struct memoryStats));
+  for (uint32_t n = 0; n < nNumaNodes; n++) {
+    for (int z = 0; z < N_MEMORY_ZONES; z++) {
+      uint64_t nFreePages = zoneArray[n][z].nFreePages +
+                            zeroedPagePoolArray[n][z].nPages;
+      stats->nTotalPages += zoneArray[n][z].nTotalPages;
+      stats->nFreePages += nFreePages;
+      if (z == ZONE_KERNEL) {
+        stats->nKernelZonePages += zoneArray[n][z].nTotalPages;
+        stats->nKernelZoneFreePages += nFreePages;
+      }
+    }
+  }
+  for (int i = 0; i < MAX_N_CORES_SUPPORTED; i++) {
+    stats->nFreePages += pageCacheArray[i][ZONE_KERNEL].nPages +
+                         pageCacheArray[i][ZONE_HIGH].nPages;
+    stats->nKernelZoneFreePages += pageCacheArray[i][ZONE_KERNEL].nPages;
+    for (int tag = 0; tag < N_PAGE_TAGS; tag++) {
+      stats->nTaggedPagesArray[tag] +=
+          __atomic_load_n(&pageTagCountersArray[i].nPagesArray[tag],
+                          __ATOMIC_RELAXED);
+    }
+  }
+  stats->nKernelImagePages =
+      (PAGE_ALIGN_ADDR_UP(&kernelEnd) - KERNEL_CODE_BASE) / PAGE_SIZE +
+      PAGE_ALIGN_ADDR_UP(nPageFrames * sizeof(struct pageFrame)) / PAGE_SIZE;
+  stats->nHugePageFaults = __atomic_load_n(&nHugePageFaults, __ATOMIC_RELAXED);
+  stats->nHugePageFallbacks =
+      __atomic_load_n(&nHugePageFallbacks, __ATOMIC_RELAXED);
+  stats->nHugePageSplits = __atomic_load_n(&nHugePageSplits, __ATOMIC_RELAXED);
+}
+
+// Count resident and shared user pages mapped by PT ptPtr
+static void countPTPages(uint64_t *ptPtr, struct processMemoryStats *stats) {
+  for (int i = 0; i < N_PAGE_TABLE_ENTRIES; i++) {
+    if (!(ptPtr[i] & PAGE_DIRECTORY_ENTRY_PRESENT)) {
+      continue;
+    }
+    uint64_t pfn = EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(ptPtr[i]) / PAGE_SIZE;
+    stats->nResidentPages++;
+    if (__atomic_load_n(&pageFrameArray[pfn].refCount, __ATOMIC_RELAXED) > 1) {
+      stats->nSharedPages++;
+    }
+  }
+}
+
+// Count the pages of the 2MB page mapped by PDT entry pdtEntry as resident
+// (and shared if another mapping references them)
+static void countHugePage(uint64_t pdtEntry,
+                          struct processMemoryStats *stats) {
+  uint64_t pAddr = EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(pdtEntry);
+  stats->nResidentPages += N_HUGE_PAGE_PAGES;
+  stats->nHugePages++;
+  if (!isHugeUserPageExclusive(pAddr)) {
+    stats->nSharedPages += N_HUGE_PAGE_PAGES;
+  }
+}
+
+// Count resident, shared and page table pages of the user space of pml4tPtr
+// in a single pass over present entries (see kFreeUserPageTables)
+// The page tables of a process are freed only by freeVM: the caller must make
+// sure the process is not freed during the walk
+void getUserSpaceMemoryStats(uint64_t *pml4tPtr,
+                             struct processMemoryStats *stats) {
+  stats->nResidentPages = 0;
+  stats->nSharedPages = 0;
+  stats->nHugePages = 0;
+  stats->nPageTablePages = 1;  // PML4T
+  for (int i = 0; i < N_PAGE_TABLE_ENTRIES / 2; i++) {
+    if (!(pml4tPtr[i] & PAGE_DIRECTORY_ENTRY_PRESENT) ||
+        isSharedPML4TEntry(pml4tPtr, i)) {
+      continue;
+    }
+    uint64_t *pdptPtr = (uint64_t *)PADDR_TO_VADDR(
+        EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(pml4tPtr[i]));
+    stats->nPageTablePages++;
+    for (int ii = 0; ii < N_PAGE_TABLE_ENTRIES; ii++) {
+      if (!(pdptPtr[ii] & PAGE_DIRECTORY_ENTRY_PRESENT) ||
+          isSharedPDPTEntry(i, pdptPtr, ii)) {
+        continue;
+      }
+      uint64_t *pdtPtr = (uint64_t *)PADDR_TO_VADDR(
+          EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(pdptPtr[ii]));
+      stats->nPageTablePages++;
+      for (int iii = 0; iii < N_PAGE_TABLE_ENTRIES; iii++) {
+        if (!(pdtPtr[iii] & PAGE_DIRECTORY_ENTRY_PRESENT)) {
+          continue;
+        }
+        if (pdtPtr[iii] & PAGE_DIRECTORY_SIZE_2MB) {
+          countHugePage(pdtPtr[iii], stats);
+          continue;
+        }
+        countPTPages((uint64_t *)PADDR_TO_VADDR(
+                         EXTRACT_PAGE_DIRECTORY_ENTRY_ADDRESS(pdtPtr[iii])),
+                     stats);
+        stats->nPageTablePages++;
+      }
+    }
   }
 }
 
-uint64_t getMemorySize() { return totMemorySize; }
+// Return size in bytes of the physical memory managed by the page allocator
+uint64_t getMemorySize() {
+  uint64_t nPages = 0;
+  for (uint32_t n = 0; n < nNumaNodes; n++) {
+    for (int z = 0; z < N_MEMORY_ZONES; z++) {
+      nPages += zoneArray[n][z].nTotalPages;
+    }
+  }
+  return nPages * PAGE_SIZE;
+}
@@ -36,6 +36,11 @@
   (KERNEL_SPACE_END_VIRTUAL_ADDRESS - KERNEL_SPACE_BASE_VIRTUAL_ADDRESS)
 /// The kernel uses the first 1GB of physical memory including the kernel image
 /// and memory reserved for system usage as inidicated by the bios
+/// RAM above 1GB (high zone, used for user pages) is added to the direct map
+/// by kInitVM, up to MAX_PHYSICAL_MEMORY_SIZE (RAM above it is not used)
+#define MAX_PHYSICAL_MEMORY_SIZE 0x1000000000ULL  // 64GB
+#define KERNEL_DIRECT_MAP_END_VIRTUAL_ADDRESS \
+  (KERNEL_SPACE_BASE_VIRTUAL_ADDRESS + MAX_PHYSICAL_MEMORY_SIZE)
 
 #define MAX_N_MEMORY_REGIONS 100
 #define PAGE_SIZE (4 * 1024)  // 4KB
@@ -69,45 +74,360 @@ struct memoryRegion {
   uint64_t size;
 };
 
-// Page struct: contains pointer to next free page struct
+// Page struct: stored at the start of a free page (or free block of pages),
+// contains pointers to next and previous free page structs
 struct page {
   struct page *next;
+  struct page *prev;
+};
+
+/*** Buddy allocator ***/
+// Free physical memory is kept in blocks of 2^order contiguous pages, aligned
+// to their size in physical memory, with one free list per order
+#define MAX_PAGE_ORDER 10  // largest block: 2^10 pages (4MB)
+#define N_PAGE_ORDERS (MAX_PAGE_ORDER + 1)
+
+struct kmemCache;
+struct vmSpace;
+
+// Physical page frame descriptor, one per physical page of the kernel space
+// direct map
+struct pageFrame {
+  uint8_t flags;
+  uint8_t nodeId;     // NUMA node of the page (see acpi.h)
+  uint8_t order;      // order of the free block starting at this frame
+  uint8_t tag;        // owner of the allocated page (PAGE_TAG_*)
+  uint32_t refCount;  // number of user space PT entries mapping the page
+  struct kmemCache *slabCache;  // object cache owning the page (slab.c)
+};
+
+// pageFrame flags
+#define PAGE_FRAME_FREE 1  // first page frame of a free block
+// PML4T released by freeVM while loaded on a core (see switchAddressSpace)
+#define PAGE_FRAME_FREE_DEFERRED 2
+
+/*** Page ownership accounting ***/
+// Each allocated page is tagged with the subsystem owning it: kAllocPage and
+// kAllocPages tag pages as PAGE_TAG_KERNEL, kAllocUserPage as PAGE_TAG_USER,
+// owners of other kinds of pages retag them with kSetPageTag
+#define PAGE_TAG_KERNEL 0       // other kernel data structures
+#define PAGE_TAG_PAGE_TABLE 1   // PML4Ts, PDPTs, PDTs and PTs
+#define PAGE_TAG_RING0_STACK 2  // process ring0 (syscall/interrupt) stacks
+#define PAGE_TAG_USER 3         // user pages (process images, heap, mappings)
+#define PAGE_TAG_FS_BUFFER 4    // file system objects (FAT16)
+#define PAGE_TAG_SLAB 5         // slab allocator object caches
+#define N_PAGE_TAGS 6
+
+// Per-process memory usage
+struct processMemoryStats {
+  int64_t pid;
+  uint64_t state;            // enum processState (process.h)
+  uint64_t nResidentPages;   // user pages mapped by the process (RSS)
+  uint64_t nSharedPages;     // resident pages mapped by other processes too
+  uint64_t nPageTablePages;  // page tables of the process user space
+  uint64_t nRing0StackPages;
+  uint64_t nHugePages;  // 2MB pages mapped (512 resident pages each)
+};
+
+#define MAX_N_MEMORY_STATS_PROCESSES 32
+
+// System memory usage snapshot (in pages)
+struct memoryStats {
+  uint64_t nTotalPages;           // pages managed by the page allocator
+  uint64_t nFreePages;            // including page caches and zeroed pools
+  uint64_t nKernelZonePages;      // pages in the first GB (all nodes)
+  uint64_t nKernelZoneFreePages;  // free pages in the first GB
+  uint64_t nKernelImagePages;     // kernel image and page frame array
+  uint64_t nTaggedPagesArray[N_PAGE_TAGS];  // allocated pages per owner
+  uint64_t nHugePageFaults;     // 2MB user pages populated by page faults
+  uint64_t nHugePageFallbacks;  // 4KB pages used for lack of a free 2MB block
+  uint64_t nHugePageSplits;     // 2MB mappings split into 4KB pages
+  uint64_t nProcesses;            // entries of processArray
+  struct processMemoryStats processArray[MAX_N_MEMORY_STATS_PROCESSES];
 };
 
 /***  Memory allocation functions ***/
 
+// Return size in bytes of the physical memory managed by the page allocator
 uint64_t getMemorySize();
 void printFreeMemoryRegionList();
 
-// Print pages stats
+// Print pages stats (including per-core page cache hit rate and buddy
+// allocator fragmentation)
 void printPagesStats();
 
-// Populate free page list (use all free memory regions in first GB of physical
-// memory)
+// Populate kernel zone buddy allocator free lists (use all free memory regions
+// in first GB of physical memory): the high zone is populated by kInitVM
+// Memory is split in one kernel and one high zone per NUMA node (acpiInit must
+// have parsed the SRAT)
 void initMemory();
+// Allocate/free one page from/to the running core's page cache, which is
+// refilled from/drained to the zone buddy allocator in batches
+// Pages are allocated from the running core's NUMA node if possible, then
+// from the other nodes by increasing distance
+// kAllocPage prefers kernel zone pages (first GB of physical memory) and uses
+// the high zone of the node if its kernel zone is exhausted,
+// kAllocUserPage returns high zone pages if available (user pages)
 int64_t kFreePage(uint64_t addr);
 void *kAllocPage(int64_t *status);
+void *kAllocUserPage(int64_t *status);
+// Allocate a zeroed out page (kernel zone/user page): pages are taken from
+// zeroed page pools that idle cores refill in the background and are zeroed
+// synchronously only if the pool is empty
+void *kAllocZeroedPage(int64_t *status);
+void *kAllocZeroedUserPage(int64_t *status);
+// Zero out free pages to refill the zeroed page pools (called by idle loop)
+void refillZeroedPagePools();
+// Allocate 2^order physically contiguous pages (aligned to 2^order pages)
+// from the kernel zone (same NUMA node order as kAllocPage)
+void *kAllocPages(uint64_t order, int64_t *status);
+// Free 2^order contiguous pages allocated by kAllocPages and coalesce them
+// with free buddy blocks
+int64_t kFreePages(uint64_t addr, uint64_t order);
+// Return page frame descriptor of the page containing kernel space virtual
+// address addr (NULL if addr is outside the kernel space direct map)
+struct pageFrame *getPageFrame(uint64_t addr);
+// Change owner tag of the 2^order allocated pages starting at addr
+void kSetPageTag(uint64_t addr, uint64_t order, uint64_t tag);
+// Fill in the system-wide fields of stats (page counts per owner tag and free
+// memory); the process entries are filled in by getProcessMemoryStats
+void getMemoryStats(struct memoryStats *stats);
+// Count resident, shared, page table and 2MB pages of the user space of page
+// table pml4tPtr
+void getUserSpaceMemoryStats(uint64_t *pml4tPtr,
+                             struct processMemoryStats *stats);
 // Initialize kernel space virtual memory
 void kInitVM();
-// Zero out and free (add to free page list) physical pages used for 4-level
-// PML4T -> PDPT -> PDT -> PT page directory tree structure and physical pages
-// allocated to the process
-void freeVM(uint64_t *pml4tPtr, uint64_t processTotalSize);
+// Free (add to free page list) physical pages used for 4-level
+// PML4T -> PDPT -> PDT -> PT page directory tree structure and the user pages
+// they map, in a single pass over present entries (cost proportional to the
+// number of page tables of the process)
+// Shared kernel space page tables are not freed
+// If a core still has the page table loaded (idle process borrowing it), the
+// release is deferred until that core loads another page table
+void freeVM(uint64_t *pml4tPtr);
 // Normally called by AP after BP as initialized Page Table
 void loadPageTable();
-// Set up page table for user space and load user process image
-// processTotalSize must include processCodeSize (currently code + stack size)
-int initUserSpaceVM(uint64_t *pml4tPtr, uint64_t *vAddrStart,
-                    uint64_t processCodeSize, uint64_t processTotalSize);
-// Set up page table for user space and copy process image from source process
+/*** User space virtual memory areas (demand paging) ***/
+// No user page is allocated when a process image is loaded: the address space
+// of each process is described by a few virtual memory areas and user pages are
+// allocated and populated by the page fault handler on first access
+// Anonymous areas (bss and stack, heap, kMmap) are populated with 2MB pages
+// in the 2MB-aligned blocks they fully contain when a free 2MB block of
+// physical memory is available, with 4KB pages otherwise
+#define MAX_N_VM_AREAS 16
+
+// User space layout: process image (code, data, bss and stack) at
+// USER_PROGRAM_COUNTER (process.h), heap right after the image growing up to
+// USER_MMAP_BASE, anonymous mappings in [USER_MMAP_BASE, USER_SPACE_END[
+// User space ends at 3GB: the PDPT entries for the LAPIC and IOAPIC identity
+// mappings right below 4GB reference kernel page tables (see kSetupVM)
+#define USER_MMAP_BASE 0x40000000ULL  // 1GB
+#define USER_SPACE_END 0xC0000000ULL  // 3GB
+
+// vmArea flags
+#define VM_AREA_WRITABLE 1
+// Pages are populated with file content (the part of the area past the end of
+// the file is zero-filled), otherwise pages are zero-filled
+#define VM_AREA_FILE 2
+#define VM_AREA_HEAP 4  // heap: [end of image, program break[ (see kBrk)
+#define VM_AREA_MMAP 8  // anonymous mapping (see kMmap)
+// Shared memory segment attachment (see kShmAttach): pages are shared with
+// the other processes attached to the segment, also after fork
+#define VM_AREA_SHM 16
+
+// kMmap protection and flags (Linux values)
+#define PROT_READ 1
+#define PROT_WRITE 2
+#define MAP_PRIVATE 2
+#define MAP_ANONYMOUS 0x20
+
+struct vmArea {
+  uint64_t vStartAddr;        // page-aligned start address
+  uint64_t vEndAddr;          // page-aligned end address, 0 if area is unused
+  uint64_t flags;             // VM_AREA_* flags
+  uint32_t fileSize;          // bytes of file content mapped at vStartAddr
+  uint16_t fileClusterIndex;  // FAT16 index of the first file cluster
+  uint16_t shmId;             // shared memory segment (VM_AREA_SHM)
+};
+
+// Per-process page fault counters
+struct vmStats {
+  uint64_t nZeroFillFaults;  // pages allocated and zero-filled
+  uint64_t nFileFaults;      // pages allocated and read from file
+  uint64_t nCoWFaults;       // copy-on-write pages copied or taken over
+};
+
+struct vmSpace {
+  struct vmArea areaArray[MAX_N_VM_AREAS];
+  uint64_t brk;  // program break: end of heap (not page-aligned)
+  struct vmStats stats;
+  uint64_t addressSpaceId;  // unique id used for PCID assignment (0: none yet)
+  uint64_t tlbGen;  // incremented when mappings are removed or downgraded
+};
+
+// TLB counters (summed over all cores)
+struct tlbStats {
+  uint64_t nFlushSwitches;      // address space switches flushing the TLB
+  uint64_t nNoFlushSwitches;    // address space switches keeping the TLB
+  uint64_t nLazySwitches;       // switches to idle keeping the page table
+  uint64_t nSkippedSwitches;    // switches to the page table already loaded
+  uint64_t nFullFlushes;        // TLB flushes of the current address space
+  uint64_t nPageInvalidations;  // single page TLB invalidations
+  uint64_t nShootdowns;         // batches invalidated on other cores
+  uint64_t nShootdownIPIs;      // shootdown IPIs sent (one per target core)
+  uint64_t pcidEnabled;         // 1 if address spaces are tagged with PCIDs
+};
+
+// Pages invalidated one by one by a TLB shootdown batch: larger batches flush
+// the whole TLB
+#define TLB_SHOOTDOWN_BATCH_SIZE 32
+
+// TLB invalidations gathered while changing the mappings of an address space
+// (or of the kernel space) and sent to the other cores in one IPI per core
+struct tlbShootdownBatch {
+  struct vmSpace *vmSpacePtr;  // NULL: kernel space mappings
+  uint64_t *pml4tPtr;
+  uint64_t flushAll;  // 1: flush the whole TLB instead of vAddrArray pages
+  uint64_t nPages;
+  uint64_t vAddrArray[TLB_SHOOTDOWN_BATCH_SIZE];
+};
+
+// Load page table pml4tPtr of address space vmSpacePtr on the running core:
+// with PCIDs the TLB entries of a recently run address space are kept, idle
+// processes (kernel page table) keep the loaded page table (lazy TLB)
+// Interrupts must be disabled
+void switchAddressSpace(uint64_t *pml4tPtr, struct vmSpace *vmSpacePtr);
+// Free the page table borrowed by the idle process of the running core if it
+// was released by freeVM (called by idle loop)
+void releaseLazyAddressSpace();
+// Free the page tables released while switching address space on the running
+// core (called after the run queue lock is released)
+void freeReleasedAddressSpaces();
+// Copy TLB counters into stats
+void getTLBStats(struct tlbStats *stats);
+// Start an empty TLB shootdown batch for address space vmSpacePtr with page
+// table pml4tPtr (vmSpacePtr NULL: kernel space mappings, shared by all cores)
+void tlbShootdownInit(struct tlbShootdownBatch *batch,
+                      struct vmSpace *vmSpacePtr, uint64_t *pml4tPtr);
+// Add the pages in [vStartAddr, vEndAddr[ to batch
+void tlbShootdownAddRange(struct tlbShootdownBatch *batch, uint64_t vStartAddr,
+                          uint64_t vEndAddr);
+// Invalidate the batch pages on the running core and on the other cores that
+// run the address space (all cores for kernel space batches), then empty the
+// batch; user space batches increment the address space TLB generation
+// The address space must be the one loaded on the running core
+// Must not be called while holding a lock (see smpCallFunction)
+void tlbShootdownFlush(struct tlbShootdownBatch *batch);
+// Returns the average number of CPU cycles taken by nTargetCores other cores
+// to invalidate nPages kernel pages, with the whole batch sent in one IPI per
+// core (batched) or one IPI per page, -1 if fewer cores are online or nPages
+// is too large
+int64_t benchmarkTLBShootdown(uint64_t nTargetCores, uint64_t nPages,
+                              uint64_t batched);
+
+// Set up the virtual memory areas of a process image: file content (code and
+// data) at USER_PROGRAM_COUNTER, followed by zero-filled pages (bss and stack)
+// up to USER_PROGRAM_COUNTER + processTotalSize, and an empty heap
+// No page is allocated: pages are populated on first access
+int initUserSpaceVM(struct vmSpace *vmSpacePtr, uint16_t fileClusterIndex,
+                    uint32_t fileSize, uint64_t processTotalSize);
+// Remove all virtual memory areas of the current address space and free their
+// pages (exec)
+void kClearUserSpaceVM(uint64_t *pml4tPtr, struct vmSpace *vmSpacePtr);
+// Set up page table for user space sharing the source process pages in the
+// virtual memory areas of vmSpacePtr copy-on-write: pages are copied on the
+// first write (see handlePageFault)
+// Pages not populated yet in the source process are left unmapped
 int copyUserSpaceVM(uint64_t *dstPml4tPtr, uint64_t *srcPml4tPtr,
-                    uint64_t *vAddrStart, uint64_t processTotalSize);
+                    struct vmSpace *vmSpacePtr);
+// Set the program break of the current process to brk: heap pages past the
+// new break are freed, new heap pages are populated on first access
+// Returns the new program break, or the current one if brk is invalid
+uint64_t kBrk(struct vmSpace *vmSpacePtr, uint64_t brk);
+// Map length bytes (rounded up to pages) of zero-filled memory in the current
+// address space at vAddr, if vAddr is not 0, page-aligned and the range is
+// free, or at the lowest free range otherwise; prot: PROT_READ and optionally
+// PROT_WRITE, flags: MAP_PRIVATE | MAP_ANONYMOUS
+// Returns the start address of the mapping, 0 if it failed
+uint64_t kMmap(struct vmSpace *vmSpacePtr, uint64_t vAddr, uint64_t length,
+               uint64_t prot, uint64_t flags);
+// Unmap the pages of anonymous mappings in [vAddr, vAddr + length[ of the
+// current address space
+int64_t kMunmap(struct vmSpace *vmSpacePtr, uint64_t vAddr, uint64_t length);
+
+/*** Shared memory segments (zero-copy IPC) ***/
+// A segment is a set of physical pages identified by a key chosen by the
+// processes that share it: each process attaches the segment to its address
+// space and all attachments map the same pages (writes are visible to all the
+// processes without copies)
+#define MAX_N_SHM_SEGMENTS 32
+// Physical addresses of the pages of a segment are stored in one kernel page
+#define MAX_SHM_SEGMENT_SIZE ((PAGE_SIZE / sizeof(uint64_t)) * PAGE_SIZE)
+
+// Return id of the segment with given key, creating a segment of size bytes
+// (rounded up to pages) if there is none; returns a negative error code if
+// size is invalid or larger than the existing segment, or if there are no
+// free segments
+int64_t kShmGet(uint64_t key, uint64_t size);
+// Map segment shmId in the current address space at vAddr, if vAddr is not 0,
+// page-aligned and the range is free, or at the lowest free range otherwise;
+// prot: PROT_READ and optionally PROT_WRITE
+// Pages already populated by other processes are mapped right away, the
+// others on first access
+// Returns the start address of the mapping, 0 if it failed
+uint64_t kShmAttach(struct vmSpace *vmSpacePtr, uint64_t shmId, uint64_t vAddr,
+                    uint64_t prot);
+// Unmap the segment attached at vAddr from the current address space
+// The segment and its pages are freed when its last attachment is removed
+// (kShmDetach, exec or process exit)
+int64_t kShmDetach(struct vmSpace *vmSpacePtr, uint64_t vAddr);
+// Remove segment shmId: its key can be reused right away and it cannot be
+// attached anymore; the segment is freed now if it is not attached, otherwise
+// when its last attachment is removed
+// Returns ERR_VM if shmId is not a segment or was already removed
+int64_t kShmRemove(uint64_t shmId);
+// Remove the segment attachments of a process whose address space is freed
+// (freeVM releases the mapped pages)
+void kDetachSharedMemory(struct vmSpace *vmSpacePtr);
 
-// Create 4-level 4KB Page Table structure for first 1GB of phisycal memory
-// starting at KERNEL_SPACE_BASE_VIRTUAL_ADDRESS and identity map LAPIC and
-// IOAPIC addresses NOTE: when this function is called in the kernel by the
-// Bootstrap Processor, the first 1GB of physical memory is already mapped as a
-// single 1GB page at KERNEL_SPACE_BASE_VIRTUAL_ADDRESS (loader.asm)
+// Map the nPages physical pages in pAddrArray to consecutive virtual pages
+// starting at page-aligned vStartAddr with PT entry attributes pageAttributes;
+// entries equal to 0 are left unmapped
+// The page table tree is walked once per PT (up to 512 entries are filled per
+// walk) and missing tables are allocated; the caller holds the page references
+// Returns ERR_PAGE_IS_ALREADY_MAPPED if a page in the range is already mapped
+int64_t kMapPageArray(uint64_t *pml4tPtr, uint64_t vStartAddr,
+                      uint64_t *pAddrArray, uint64_t nPages,
+                      uint64_t pageAttributes);
+// Remove user pages in address range from the page table (the physical pages
+// are freed when the last reference is removed); 2MB pages partially in the
+// range are split into 4KB pages first
+// The TLB is not flushed
+int64_t kFreePagesInAddrRange(uint64_t *pml4tPtr, uint64_t vStartAddr,
+                              uint64_t vEndAddr);
+
+// Page fault error code bits
+#define PAGE_FAULT_ERROR_PRESENT 1  // 0: page not present, 1: protection
+#define PAGE_FAULT_ERROR_WRITE 2    // 0: read access, 1: write access
+#define PAGE_FAULT_ERROR_USER 4     // 0: ring0 access, 1: ring3 access
+
+// Handle page fault at virtual address vAddr in the current address space
+// described by vmSpacePtr: populate pages of virtual memory areas on first
+// access and resolve write faults on copy-on-write pages
+// Returns SUCCESS if the faulting instruction can be restarted
+int64_t handlePageFault(struct vmSpace *vmSpacePtr, uint64_t vAddr,
+                        uint64_t errorCode);
+// Populate the user pages in [vAddr, vAddr + size[ of the current address space
+// (and break copy-on-write sharing if write is set) so that the kernel can
+// access them without faulting, e.g. while holding a lock the page fault
+// handler needs
+int64_t kPrefaultUserPages(struct vmSpace *vmSpacePtr, uint64_t vAddr,
+                           uint64_t size, int write);
+
+// Allocate a PML4T for a new process: kernel space page tables (first 1GB of
+// physical memory at KERNEL_SPACE_BASE_VIRTUAL_ADDRESS, LAPIC and IOAPIC
+// identity mappings) are built once by kInitVM and linked by reference
 uint64_t *kSetupVM();
 
 /*** Virtual Memory ***/
@@ -142,7 +462,20 @@ typedef uint64_t pageDirectoryEntry;
 #define PAGE_DIRECTORY_ENTRY_WRITABLE 2
 #define PAGE_DIRECTORY_ENTRY_U \
   4  // 1: USER ring access; 0: SUPERVISOR ring access
+// Global page (PT entries and large page entries): the TLB entry is not
+// flushed by CR3 loads (CR4.PGE must be set)
+#define PAGE_DIRECTORY_ENTRY_GLOBAL 0x100
+// Available to software (ignored by the CPU): set in PT entries of user pages
+// shared copy-on-write (mapped read-only) after fork
+#define PAGE_DIRECTORY_ENTRY_COW 0x200
+#define PAGE_DIRECTORY_ENTRY_FLAGS_MASK 0xFFF
 // If set in PDT, 2MB pages are enabled and PT is not used
 #define PAGE_DIRECTORY_SIZE_2MB 0x80
+// If set in PDPT, 1GB pages are enabled and PDT and PT are not used
+#define PAGE_DIRECTORY_SIZE_1GB 0x80
+
+// Large page sizes
+#define PAGE_SIZE_2MB (2 * 1024 * 1024ULL)
+#define PAGE_SIZE_1GB (1024 * 1024 * 1024ULL)
 
 #endif
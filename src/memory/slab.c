@@ -0,0 +1,226 @@
+/*
+ * Copyright 2024 Andrea Miele
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "slab.h"
+
+#include "../kernel.h"       // Kernel error codes
+#include "../lib/lib.h"      // memset, strncpy
+#include "../stdio/stdio.h"  // printk
+#include "memory.h"          // kAllocPage, kAllocPages, kSetPageTag
+
+// Assembly lock and unlock implementations for mutex
+extern void spinLock(volatile uint8_t *lock);
+extern void spinUnlock(volatile uint8_t *lock);
+
+// returns core id
+extern uint64_t getCoreId();  // ../kernel.asm
+
+// Static variables, zero-initialized
+
+static struct kmemCache kmemCacheArray[MAX_N_KMEM_CACHES];
+static uint64_t nKmemCaches;
+static volatile uint8_t kmemCacheArrayLock;
+
+static struct kmemCache *kmallocCacheArray[N_KMALLOC_CACHES];
+
+// Free list link of an object (stored right after the object)
+#define OBJECT_LINK(cache, object) \
+  (*(void **)((uint8_t *)(object) + (((cache)->objectSize + 7) & ~7ULL)))
+
+// Create kmalloc size class caches
+void initKmemCaches() {
+  const char *nameArray[N_KMALLOC_CACHES] = {
+      "kmalloc-64",  "kmalloc-128",  "kmalloc-256",
+      "kmalloc-512", "kmalloc-1024", "kmalloc-2048"};
+  uint64_t size = KMALLOC_MIN_SIZE;
+  for (int i = 0; i < N_KMALLOC_CACHES; i++) {
+    // The free list link stored after the object takes 8 bytes: use size - 8
+    // as object size so that each object takes exactly size bytes
+    kmallocCacheArray[i] =
+        kmemCacheCreate(nameArray[i], size - sizeof(void *), NULL);
+    size *= 2;
+  }
+}
+
+// Create an object cache for objects of objectSize bytes
+struct kmemCache *kmemCacheCreate(const char *name, uint64_t objectSize,
+                                  void (*constructor)(void *object)) {
+  spinLock(&kmemCacheArrayLock);
+  if (nKmemCaches == MAX_N_KMEM_CACHES) {
+    spinUnlock(&kmemCacheArrayLock);
+    printk("ERROR kmemCacheCreate: no unused cache struct is available\n");
+    KERNEL_PANIC(ERR_ALLOC_FAILED);
+  }
+  struct kmemCache *cache = &kmemCacheArray[nKmemCaches++];
+  spinUnlock(&kmemCacheArrayLock);
+
+  memset(cache, 0, sizeof(struct kmemCache));
+  strncpy(cache->name, name, KMEM_CACHE_NAME_SIZE - 1);
+  cache->objectSize = objectSize;
+  cache->objectStride =
+      ((objectSize + 7) & ~7ULL) + sizeof(void *);  // object + link
+  cache->objectStride = (cache->objectStride + CACHE_LINE_SIZE - 1) &
+                        ~((uint64_t)CACHE_LINE_SIZE - 1);
+  cache->constructor = constructor;
+  cache->pageTag = PAGE_TAG_SLAB;
+
+  // smallest slab holding at least KMEM_CACHE_MIN_OBJECTS_PER_SLAB objects
+  while (cache->slabOrder < MAX_PAGE_ORDER &&
+         (PAGE_SIZE << cache->slabOrder) / cache->objectStride <
+             KMEM_CACHE_MIN_OBJECTS_PER_SLAB) {
+    cache->slabOrder++;
+  }
+  cache->nObjectsPerSlab =
+      (PAGE_SIZE << cache->slabOrder) / cache->objectStride;
+  if (cache->nObjectsPerSlab == 0) {
+    printk("ERROR kmemCacheCreate: %s object size %u is too large\n", name,
+           objectSize);
+    KERNEL_PANIC(ERR_ALLOC_FAILED);
+  }
+  return cache;
+}
+
+// Allocate a new slab, construct its objects and add them to the cache free
+// list
+// cache->lock must be held
+static int64_t growCache(struct kmemCache *cache) {
+  int64_t errCode = SUCCESS;
+  uint8_t *slab = NULL;
+  if (cache->slabOrder == 0) {
+    slab = kAllocPage(&errCode);
+  } else {
+    slab = kAllocPages(cache->slabOrder, &errCode);
+  }
+  if (slab == NULL) {
+    printk("ERROR growCache: %s slab allocation failed\n", cache->name);
+    return errCode;
+  }
+  kSetPageTag((uint64_t)slab, cache->slabOrder, cache->pageTag);
+  for (uint64_t i = 0; i < (1ULL << cache->slabOrder); i++) {
+    getPageFrame((uint64_t)slab + i * PAGE_SIZE)->slabCache = cache;
+  }
+  for (uint64_t i = 0; i < cache->nObjectsPerSlab; i++) {
+    void *object = slab + i * cache->objectStride;
+    if (cache->constructor != NULL) {
+      cache->constructor(object);
+    }
+    OBJECT_LINK(cache, object) = cache->freeList;
+    cache->freeList = object;
+  }
+  cache->nFree += cache->nObjectsPerSlab;
+  cache->nSlabs++;
+  return SUCCESS;
+}
+
+// Allocate object from cache
+void *kmemCacheAlloc(struct kmemCache *cache, int64_t *errCode) {
+  void *object = NULL;
+  *errCode = SUCCESS;
+  uint64_t flags = saveFlagsAndCli();
+  struct kmemCpuCache *cpuCache = &cache->cpuCacheArray[getCoreId()];
+  if (cpuCache->freeList == NULL) {
+    // refill per-core free list
+    spinLock(&cache->lock);
+    if (cache->freeList == NULL) {
+      *errCode = growCache(cache);
+    }
+    for (int i = 0; i < KMEM_CACHE_BATCH_SIZE && cache->freeList != NULL;
+         i++) {
+      void *batchObject = cache->freeList;
+      cache->freeList = OBJECT_LINK(cache, batchObject);
+      cache->nFree--;
+      OBJECT_LINK(cache, batchObject) = cpuCache->freeList;
+      cpuCache->freeList = batchObject;
+      cpuCache->nFree++;
+    }
+    spinUnlock(&cache->lock);
+    cpuCache->nRefills++;
+  }
+  if (cpuCache->freeList != NULL) {
+    object = cpuCache->freeList;
+    cpuCache->freeList = OBJECT_LINK(cache, object);
+    cpuCache->nFree--;
+    cpuCache->nAllocs++;
+  }
+  restoreFlags(flags);
+  return object;
+}
+
+// Return object to its cache
+void kmemCacheFree(struct kmemCache *cache, void *object) {
+  uint64_t flags = saveFlagsAndCli();
+  struct kmemCpuCache *cpuCache = &cache->cpuCacheArray[getCoreId()];
+  OBJECT_LINK(cache, object) = cpuCache->freeList;
+  cpuCache->freeList = object;
+  cpuCache->nFree++;
+  if (cpuCache->nFree > 2 * KMEM_CACHE_BATCH_SIZE) {
+    // drain per-core free list
+    spinLock(&cache->lock);
+    for (int i = 0; i < KMEM_CACHE_BATCH_SIZE; i++) {
+      void *batchObject = cpuCache->freeList;
+      cpuCache->freeList = OBJECT_LINK(cache, batchObject);
+      cpuCache->nFree--;
+      OBJECT_LINK(cache, batchObject) = cache->freeList;
+      cache->freeList = batchObject;
+      cache->nFree++;
+    }
+    spinUnlock(&cache->lock);
+  }
+  restoreFlags(flags);
+}
+
+// Allocate at most KMALLOC_MAX_SIZE bytes from the smallest fitting size class
+void *kmalloc(uint64_t size, int64_t *errCode) {
+  for (int i = 0; i < N_KMALLOC_CACHES; i++) {
+    if (size <= kmallocCacheArray[i]->objectSize) {
+      return kmemCacheAlloc(kmallocCacheArray[i], errCode);
+    }
+  }
+  printk("ERROR kmalloc: size %u larger than %u\n", size,
+         kmallocCacheArray[N_KMALLOC_CACHES - 1]->objectSize);
+  *errCode = ERR_ALLOC_FAILED;
+  return NULL;
+}
+
+// Free memory allocated by kmalloc (the owning cache is found through the page
+// frame descriptor)
+void kfree(void *ptr) {
+  struct pageFrame *frame = getPageFrame((uint64_t)ptr);
+  if (frame == NULL || frame->slabCache == NULL) {
+    printk("ERROR kfree: %x was not allocated by kmalloc\n", ptr);
+    KERNEL_PANIC(ERR_ALLOC_FAILED);
+  }
+  kmemCacheFree(frame->slabCache, ptr);
+}
+
+// Print slab allocator stats
+void printKmemCacheStats() {
+  for (uint64_t i = 0; i < nKmemCaches; i++) {
+    struct kmemCache *cache = &kmemCacheArray[i];
+    uint64_t nCpuFree = 0;
+    uint64_t nAllocs = 0;
+    uint64_t nRefills = 0;
+    for (int c = 0; c < MAX_N_CORES_SUPPORTED; c++) {
+      nCpuFree += cache->cpuCacheArray[c].nFree;
+      nAllocs += cache->cpuCacheArray[c].nAllocs;
+      nRefills += cache->cpuCacheArray[c].nRefills;
+    }
+    printk(
+        "%s: object size %u (stride %u), slabs: %u (%u pages each), objects "
+        "in use: %u, allocations: %u, refills: %u\n",
+        cache->name, cache->objectSize, cache->objectStride, cache->nSlabs,
+        1ULL << cache->slabOrder,
+        cache->nSlabs * cache->nObjectsPerSlab - cache->nFree - nCpuFree,
+        nAllocs, nRefills);
+  }
+}
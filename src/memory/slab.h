@@ -0,0 +1,86 @@
+/*
+ * Copyright 2024 Andrea Miele
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../acpi/acpi.h"  // MAX_N_CORES_SUPPORTED
+
+///*** SLAB ALLOCATOR: OBJECT CACHES FOR SMALL KERNEL OBJECTS ***///
+// Each cache hands out objects of a single type (size) carved from slabs of
+// 2^slabOrder contiguous pages obtained from the page allocator (memory.c)
+// Objects are cache line aligned so objects used by different cores do not
+// share cache lines
+// Free objects are kept in per-core free lists that are refilled from and
+// drained to the cache free list in batches: the cache lock is taken only when
+// the per-core free list is empty or too long
+// Free objects are linked through a pointer stored right after the object so
+// that the object content set by the constructor is preserved: objects must be
+// returned to the cache in their constructed state
+// Slabs are never returned to the page allocator
+
+#define CACHE_LINE_SIZE 64
+#define MAX_N_KMEM_CACHES 32
+#define KMEM_CACHE_NAME_SIZE 32
+#define KMEM_CACHE_BATCH_SIZE 16
+#define KMEM_CACHE_MIN_OBJECTS_PER_SLAB 8
+
+// kmalloc size classes: 64, 128, ..., 2048 bytes
+#define KMALLOC_MIN_SIZE 64
+#define KMALLOC_MAX_SIZE 2048
+#define N_KMALLOC_CACHES 6
+
+struct kmemCpuCache {
+  void *freeList;     // per-core free object list
+  uint64_t nFree;     // number of objects in free list
+  uint64_t nAllocs;   // allocations served by this core
+  uint64_t nRefills;  // batches moved from the cache free list
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct kmemCache {
+  char name[KMEM_CACHE_NAME_SIZE];
+  uint64_t objectSize;    // size requested by kmemCacheCreate
+  uint64_t objectStride;  // object + free list link, cache line aligned
+  uint64_t slabOrder;     // slab size: 2^slabOrder pages
+  uint64_t nObjectsPerSlab;
+  void (*constructor)(void *object);
+  uint64_t pageTag;       // owner tag of the slab pages (PAGE_TAG_SLAB)
+  volatile uint8_t lock;  // lock for free list and slab allocation
+  void *freeList;         // free objects not held by any core
+  uint64_t nFree;         // number of objects in freeList
+  uint64_t nSlabs;
+  struct kmemCpuCache cpuCacheArray[MAX_N_CORES_SUPPORTED];
+};
+
+// Create kmalloc size class caches
+// To be called by Bootstrap Processor after initMemory
+void initKmemCaches();
+// Create an object cache for objects of objectSize bytes; constructor (may be
+// NULL) is called once for each object when its slab is allocated
+struct kmemCache *kmemCacheCreate(const char *name, uint64_t objectSize,
+                                  void (*constructor)(void *object));
+// Allocate object from cache (grow the cache by one slab if needed)
+void *kmemCacheAlloc(struct kmemCache *cache, int64_t *errCode);
+// Return object to its cache
+void kmemCacheFree(struct kmemCache *cache, void *object);
+// Allocate at most KMALLOC_MAX_SIZE bytes from the smallest fitting size class
+// (larger buffers must be allocated with kAllocPages)
+void *kmalloc(uint64_t size, int64_t *errCode);
+// Free memory allocated by kmalloc
+void kfree(void *ptr);
+// Print slab allocator stats
+void printKmemCacheStats();
+#endif
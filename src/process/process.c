@@ -15,17 +15,14 @@
 
 #include <stddef.h>
 
-#include "../acpi/acpi.h"    // MAX_N_CORES_SUPPORTED
-#include "../fat16/fat16.h"  // loadFile and constants
+#include "../acpi/acpi.h"    // MAX_N_CORES_SUPPORTED, getOnlineCoreMask
+#include "../fat16/fat16.h"  // lookupFile and constants
 #include "../gdt/gdt.h"      // USER_CODE_SEG_SELECTOR, RING3_SELECTOR_BITS
 #include "../kernel.h"       // Kernel error codes
 #include "../lib/lib.h"      // memset, memcpy, List
+#include "../memory/slab.h"  // kmemCacheCreate, kmemCacheAlloc, kmemCacheFree
 #include "../stdio/stdio.h"  // printk
 
-// File buffer for exec
-static uint8_t
-    fileBuffer[MAX_SUPPORTED_FAT16_SECTORS_PER_CLUSTER * SECTOR_SIZE];
-
 // Array flags for tracking if a syscall is running for ISRs; one per CPU core
 extern uint64_t syscallRunningArray[MAX_N_CORES_SUPPORTED];
 
@@ -43,9 +40,13 @@ extern uint64_t getCoreId();  // ../kernel.asm
 // number of cores
 extern uint64_t acpiNCores;
 
-// switch process // ../idt/idt.asm
+// Try to acquire lock without spinning: returns 1 if acquired, 0 if held
+extern uint64_t spinTryLock(volatile uint8_t *lock);  // ../spinlock.asm
+
+// switch process and release run queue lock // ../idt/idt.asm
 void switchUserProcess(struct ring0ProcessContext **currProcRing0Context,
-                       struct ring0ProcessContext *nextProcRing0Context);
+                       struct ring0ProcessContext *nextProcRing0Context,
+                       volatile uint8_t *runQueueLock);
 
 // epilogue of timer ISR;
 extern void returnFromTimerInterrupt();  // ../idt/idt.asm
@@ -54,9 +55,6 @@ extern void returnFromTimerInterrupt();  // ../idt/idt.asm
 extern void startUserProcess(
     struct interruptFrame *interruptFramePtr);  // ../idt/idt.asm
 
-// Load cr3 register with page table address
-extern void loadCR3(uint64_t pageTableAddr);
-
 // Read cr3 register value
 extern uint64_t readCR3();
 
@@ -69,22 +67,56 @@ extern uint64_t *ring0SysCallStackPtrTable[MAX_N_CORES_SUPPORTED];
 // Array of pointers to current running process, one per core
 struct process *currentProcessArray[MAX_N_CORES_SUPPORTED];
 
-// Ready-state process list
-static struct ListHead readyProcessList;
-
-// Waiting-state process list
-static struct ListHead eventWaitProcessList;
+// Per-core run queue: ready processes waiting to run on the core, one list
+// per priority level (see N_PRIORITY_LEVELS)
+// A core with an empty run queue steals the highest priority process of the
+// busiest other core (work stealing); forked processes are placed on the least
+// loaded core and woken up processes go back to the core they last ran on
+// The lock of a core's run queue is held from the moment the running process
+// is put back in the queue (or on a wait or killed process list) until
+// switchUserProcess has saved its context and loaded the stack of the next
+// process: the process cannot be resumed or freed by another core before
+// Interrupts are disabled while the lock is held (ISRs and syscalls)
+// The run queue lock also protects the core's timer queue: processes sleeping
+// until a tick of the core, sorted by wake-up tick (see sleepUntilTick)
+struct runQueue {
+  volatile uint8_t lock;
+  struct ListHead readyProcessListArray[N_PRIORITY_LEVELS];
+  struct ListHead timerProcessList;  // sorted by wakeUpTick, earliest first
+  uint64_t nReadyProcesses;  // read without lock to pick cores to steal from
+  uint64_t nTicksSinceBoost;  // ticks since the last priority boost
+} __attribute__((aligned(64)));  // one cache line boundary per core
+
+static struct runQueue runQueueArray[MAX_N_CORES_SUPPORTED];
+
+// Exit wait queues: a process waiting for process pid to exit sleeps on
+// exitWaitQueueArray[pid % N_EXIT_WAIT_QUEUES] (processes whose pids share a
+// queue wake each other up spuriously, see wait)
+#define N_EXIT_WAIT_QUEUES 64
+static struct waitQueue exitWaitQueueArray[N_EXIT_WAIT_QUEUES];
 
 // Killed-state process list
 static struct ListHead killedProcessList;
 
-volatile uint8_t processLock;       // lock for SMP access to critical sections
+// lock for the killed process list and for pid allocation
+// Lock order: processLock, then a run queue lock (see sleepOnWaitQueue)
+volatile uint8_t processLock;
 extern volatile uint8_t fat16Lock;  // lock for FAT16 shared structures
+extern struct waitQueue keyboardWaitQueue;  // processes waiting for input
+
+// Idle processes, one per core (the idle process of core i has pid i)
+static struct process idleProcessArray[MAX_N_CORES_SUPPORTED];
 
-static struct process processTable[MAX_N_PROCESSES];
+// User processes are allocated from an object cache
+static struct kmemCache *processCache;
 
 static int pid = 0;
 
+// Return the wait queue of processes waiting for process pid to exit
+static struct waitQueue *getExitWaitQueue(int64_t pid) {
+  return &exitWaitQueueArray[(uint64_t)pid % N_EXIT_WAIT_QUEUES];
+}
+
 // Remove process waiting for a specific event type from list
 static struct ListNode *removeProcessWaitingForEventFromList(
     struct ListHead *list, int64_t eventWaitType) {
@@ -120,28 +152,173 @@ static struct ListNode *removeProcessWaitingForEventFromList(
   return proc;
 }
 
-// Find unused process entry in process table, create kernel memory mappings,
-// allocate stack, initalize process entry
-static struct process *allocateNewProcess() {
-  int64_t errCode = SUCCESS;
+// Move process proc to MLFQ level priority (not above its nice value) with a
+// full quantum of that level
+static void setProcessPriority(struct process *proc, uint64_t priority) {
+  if (priority < proc->nice) {
+    priority = proc->nice;
+  }
+  if (priority >= N_PRIORITY_LEVELS) {
+    priority = N_PRIORITY_LEVELS - 1;
+  }
+  proc->priority = priority;
+  proc->nTicksLeft = BASE_QUANTUM_TICKS << priority;
+}
+
+// Append ready process proc to run queue of core coreId (list of its priority
+// level)
+// The run queue lock must be held
+static void addToRunQueue(uint64_t coreId, struct process *proc) {
+  struct runQueue *runQueue = &runQueueArray[coreId];
+  proc->coreId = coreId;
+  appendToListTail(&runQueue->readyProcessListArray[proc->priority],
+                   (struct ListNode *)proc);
+  __atomic_add_fetch(&runQueue->nReadyProcesses, 1, __ATOMIC_RELAXED);
+}
+
+// Return the highest priority level (lowest index) with ready processes in run
+// queue of core coreId, N_PRIORITY_LEVELS if the queue is empty
+// The run queue lock must be held
+static uint64_t getHighestReadyPriority(uint64_t coreId) {
+  uint64_t priority = 0;
+  while (priority < N_PRIORITY_LEVELS &&
+         isListEmpty(&runQueueArray[coreId].readyProcessListArray[priority])) {
+    priority++;
+  }
+  return priority;
+}
+
+// Remove and return the oldest process of the highest priority level of run
+// queue of core coreId, NULL if the queue is empty
+// The run queue lock must be held
+static struct process *removeFromRunQueue(uint64_t coreId) {
+  struct runQueue *runQueue = &runQueueArray[coreId];
+  uint64_t priority = getHighestReadyPriority(coreId);
+  if (priority == N_PRIORITY_LEVELS) {
+    return NULL;
+  }
+  __atomic_sub_fetch(&runQueue->nReadyProcesses, 1, __ATOMIC_RELAXED);
+  return (struct process *)removeListHead(
+      &runQueue->readyProcessListArray[priority]);
+}
+
+// Insert sleeping process proc in timer queue of core coreId, after the
+// processes with the same or an earlier wake-up tick
+// The run queue lock must be held
+static void addToTimerQueue(uint64_t coreId, struct process *proc) {
+  struct ListHead *list = &runQueueArray[coreId].timerProcessList;
+  // prev points to list->next ptr (see removeProcessWaitingForEventFromList)
+  struct ListNode *prev = (struct ListNode *)list;
+  struct ListNode *curr = list->next;
+
+  while (curr != NULL &&
+         ((struct process *)curr)->wakeUpTick <= proc->wakeUpTick) {
+    prev = curr;
+    curr = curr->next;
+  }
+  proc->next = curr;
+  prev->next = (struct ListNode *)proc;
+  if (curr == NULL) {  // inserted at the tail
+    list->tail = (struct ListNode *)proc;
+  }
+}
+
+// Move all ready processes of run queue of core coreId to their top priority
+// level (anti-starvation boost)
+// The run queue lock must be held
+static void boostRunQueue(uint64_t coreId) {
+  struct runQueue *runQueue = &runQueueArray[coreId];
+  struct ListHead processList = {NULL, NULL};
+  for (uint64_t i = 0; i < N_PRIORITY_LEVELS; i++) {
+    struct ListNode *node = NULL;
+    while ((node = removeListHead(&runQueue->readyProcessListArray[i])) !=
+           NULL) {
+      appendToListTail(&processList, node);
+    }
+  }
   struct process *proc = NULL;
+  while ((proc = (struct process *)removeListHead(&processList)) != NULL) {
+    setProcessPriority(proc, proc->nice);
+    appendToListTail(&runQueue->readyProcessListArray[proc->priority],
+                     (struct ListNode *)proc);
+  }
+}
+
+// Move the oldest highest priority process of the other core with the most
+// ready processes to the (empty) run queue of core coreId
+// Returns 1 if a process was moved, 0 if no other core has ready processes
+// The run queue lock of core coreId must be held: the other run queue lock is
+// only tried (two cores stealing from each other must not deadlock)
+static int stealProcess(uint64_t coreId) {
+  uint64_t nMaxReadyProcesses = 0;
+  uint64_t victimCoreId = coreId;
+  for (uint64_t i = 0; i < acpiNCores; i++) {
+    uint64_t nReadyProcesses = __atomic_load_n(
+        &runQueueArray[i].nReadyProcesses, __ATOMIC_RELAXED);
+    if (i != coreId && nReadyProcesses > nMaxReadyProcesses) {
+      nMaxReadyProcesses = nReadyProcesses;
+      victimCoreId = i;
+    }
+  }
+  if (victimCoreId == coreId ||
+      !spinTryLock(&runQueueArray[victimCoreId].lock)) {
+    return 0;
+  }
+  struct process *proc = removeFromRunQueue(victimCoreId);
+  spinUnlock(&runQueueArray[victimCoreId].lock);
+  if (proc == NULL) {
+    return 0;
+  }
+  addToRunQueue(coreId, proc);
+  return 1;
+}
 
-  // serch for an unused process struct
-  int i = 0;
-  while ((i < MAX_N_PROCESSES) & (processTable[i].state != PROC_UNUSED)) {
-    i++;
+// Return core for a new process: the core running the fewest processes
+// (ready processes plus the running one unless it is the idle process),
+// preferring the running core on ties
+static uint64_t selectCoreForNewProcess() {
+  uint64_t coreId = getCoreId();
+  uint64_t onlineCoreMask = getOnlineCoreMask();
+  uint64_t selectedCoreId = coreId;
+  uint64_t minLoad = UINT64_MAX;
+  for (uint64_t i = 0; i < acpiNCores; i++) {
+    if (i != coreId && !(onlineCoreMask & (1ULL << i))) {
+      continue;
+    }
+    struct process *runningProcess = currentProcessArray[i];
+    uint64_t load = __atomic_load_n(&runQueueArray[i].nReadyProcesses,
+                                    __ATOMIC_RELAXED);
+    if (runningProcess != NULL && runningProcess != &idleProcessArray[i]) {
+      load++;
+    }
+    if (load < minLoad || (load == minLoad && i == coreId)) {
+      minLoad = load;
+      selectedCoreId = i;
+    }
   }
+  return selectedCoreId;
+}
 
-  if (i == MAX_N_PROCESSES) {
+// Process object constructor: zero out process struct (state: PROC_UNUSED)
+static void processConstructor(void *proc) {
+  memset(proc, 0, sizeof(struct process));
+}
+
+// Allocate process struct from process cache, create kernel memory mappings,
+// allocate stack, initalize process struct
+static struct process *allocateNewProcess() {
+  int64_t errCode = SUCCESS;
+  struct process *proc = kmemCacheAlloc(processCache, &errCode);
+
+  if (proc == NULL) {
     printk("ERROR allocateNewProcess: no unused process struct is avaiable\n");
     return NULL;
   }
 
-  proc = &processTable[i];
   proc->state = PROC_INIT;
 
-  // Create page table for kernel space (first 1GB of physical memory)
-  // Allocate page for PML4T (Page Map Level-4 Table)
+  // Allocate page for PML4T (Page Map Level-4 Table) linking the shared
+  // kernel space page tables
 
   uint64_t *pml4TPageMapPtr;
 
@@ -149,19 +326,19 @@ static struct process *allocateNewProcess() {
 
   proc->pml4tPtr = pml4TPageMapPtr;
 
-  // Allocate page for ring0 (syscall/interrupt) stack
-  proc->ring0StackBasePtr = kAllocPage(&errCode);
+  // Allocate zeroed out page for ring0 (syscall/interrupt) stack
+  proc->ring0StackBasePtr = kAllocZeroedPage(&errCode);
 
   if (errCode != SUCCESS) {
     printk(
-        "ERROR allocateNewProcess: kAllocPage for ring0 process stack "
+        "ERROR allocateNewProcess: kAllocZeroedPage for ring0 process stack "
         "failed\n");
-    freeVM(pml4TPageMapPtr, 0);
+    freeVM(pml4TPageMapPtr);
+    memset(proc, 0, sizeof(struct process));
+    kmemCacheFree(processCache, proc);
     return NULL;
   }
-
-  // zero out stack
-  memset(proc->ring0StackBasePtr, 0, PAGE_SIZE);
+  kSetPageTag((uint64_t)proc->ring0StackBasePtr, 0, PAGE_TAG_RING0_STACK);
 
   // Obtain unique pid
   proc->pid = pid;
@@ -201,32 +378,23 @@ static struct process *allocateNewProcess() {
 static void initIdleProcess() {
   spinLock(&processLock);
   for (int c = 0; c < acpiNCores; c++) {
-    uint64_t i = 0;
-    while ((i < MAX_N_PROCESSES) & (processTable[i].state != PROC_UNUSED)) {
-      i++;
-    }
-    // The processTable entry for each idle process has to be equal to the core
-    // id
-    if (i != c) {
+    // The pid of each idle process has to be equal to the core id
+    if (pid != c) {
       printk(
-          "ERROR initIdleProcess: idle process entry for core %d index "
-          "cannot be "
+          "ERROR initIdleProcess: idle process pid for core %d cannot be "
           "different than %d\n",
           c, c);
       KERNEL_PANIC(ERR_PROCESS);
     }
-    if (i >= MAX_N_PROCESSES) {
-      printk("ERROR initIdleProcess: no unused process entries available\n");
-      KERNEL_PANIC(ERR_PROCESS);
-    }
 
-    printk("Initializing idle process entry %u pid %u core\n", i, pid, c);
-    struct process *proc = &processTable[i];
+    printk("Initializing idle process pid %u core %u\n", pid, c);
+    struct process *proc = &idleProcessArray[c];
     proc->pid = pid;
     ++pid;
     proc->pml4tPtr =
         (uint64_t *)(PADDR_TO_VADDR(readCR3()));  // current kernel page table
     proc->state = PROC_READY;
+    proc->coreId = c;
   }
   spinUnlock(&processLock);
 }
@@ -239,9 +407,11 @@ void initStartupProcesses() {
                            [FAT16_FILENAME_SIZE + FAT16_FILE_EXTENSION_SIZE +
                             2] = {"SHELL.BIN", "USER1.BIN", "USER2.BIN"};
 
-  uint64_t processCodeSizeArray[N_START_USERSPACE_PROCESSES] = {
-      (11 * SECTOR_SIZE), (11 * SECTOR_SIZE), (11 * SECTOR_SIZE)};
-
+  processCache = kmemCacheCreate("process", sizeof(struct process),
+                                 processConstructor);
+  for (int i = 0; i < N_EXIT_WAIT_QUEUES; i++) {
+    exitWaitQueueArray[i].eventType = PROC_EXIT_EVENT;
+  }
   // initialize idle process
   initIdleProcess();
   for (int pi = 0; pi < N_START_USERSPACE_PROCESSES; pi++) {
@@ -254,37 +424,37 @@ void initStartupProcesses() {
       KERNEL_PANIC(ERR_PROCESS);
     }
 
-    // File for system processes launched at startup must fit in a single FAT16
-    // cluster
-
-    int64_t errCode = loadFile(processFileNameArray[pi], fileBuffer);
+    // Process image pages are read from the file on first access
+    uint16_t fileClusterIndex = 0;
+    uint32_t fileSize = 0;
+    int64_t errCode =
+        lookupFile(processFileNameArray[pi], &fileClusterIndex, &fileSize);
     if (errCode != 0) {
-      printk("ERROR initStartupProcesses: loadFile for %s failed\n",
+      printk("ERROR initStartupProcesses: lookupFile for %s failed\n",
              processFileNameArray[pi]);
       spinUnlock(&processLock);
       KERNEL_PANIC(ERR_FAT16);
     } else {
-      printk("initStartupProcesses: loading %s\n", processFileNameArray[pi]);
+      printk("initStartupProcesses: loading %s (%d bytes)\n",
+             processFileNameArray[pi], fileSize);
     }
 
-    printk("initUserSpaceVM\n");
-    errCode =
-        initUserSpaceVM(proc->pml4tPtr, (uint64_t *)fileBuffer,
-                        processCodeSizeArray[pi], DEFAULT_TOTAL_PROCESS_SIZE);
+    // keep at least one page for the stack
+    if (fileSize > DEFAULT_TOTAL_PROCESS_SIZE - PAGE_SIZE) {
+      printk("ERROR initStartupProcesses: %s is too large\n",
+             processFileNameArray[pi]);
+      spinUnlock(&processLock);
+      KERNEL_PANIC(ERR_PROCESS);
+    }
+    errCode = initUserSpaceVM(&proc->vmSpace, fileClusterIndex, fileSize,
+                              DEFAULT_TOTAL_PROCESS_SIZE);
     if (errCode != SUCCESS) {
       printk("ERROR initStartupProcesses: initUserSpaceVM failed\n");
       spinUnlock(&processLock);
-      freeVM(proc->pml4tPtr, DEFAULT_TOTAL_PROCESS_SIZE);
+      freeVM(proc->pml4tPtr);
       KERNEL_PANIC(ERR_PROCESS);
     }
 
-    // Make sure PML4T entry has user mode flag set up as it is most likely set
-    // to 0 (supervisor mode) by kSetupVM when mapping LAPIC and IOAPIC
-    // addresses, which are normally < 4GB and therefore less than 512GB
-    uint64_t PML4TEntryIndex =
-        VADDR_TO_PML4T_INDEX((uint64_t)USER_PROGRAM_COUNTER);
-    proc->pml4tPtr[PML4TEntryIndex] |= PAGE_DIRECTORY_ENTRY_U;
-
     proc->processTotalSize = DEFAULT_TOTAL_PROCESS_SIZE;
 
     proc->intFramePtr->rsp =
@@ -293,15 +463,20 @@ void initStartupProcesses() {
                                      // of process virtual address space
 
     proc->state = PROC_READY;
-    appendToListTail(&readyProcessList, (struct ListNode *)proc);
+    setProcessPriority(proc, 0);
     spinUnlock(&processLock);
+    // the other cores steal startup processes once they start scheduling
+    uint64_t coreId = getCoreId();
+    spinLock(&runQueueArray[coreId].lock);
+    addToRunQueue(coreId, proc);
+    spinUnlock(&runQueueArray[coreId].lock);
   }
 }
 
 // start idle process
 void startIdleProcess() {
   uint64_t coreId = getCoreId();
-  struct process *proc = &processTable[coreId];
+  struct process *proc = &idleProcessArray[coreId];
   if (proc == NULL) {
     printk("ERROR CORE %d startProcess: NULL idle process pointer\n", coreId);
     KERNEL_PANIC(ERR_PROCESS);
@@ -312,28 +487,26 @@ void startIdleProcess() {
   printk("Starting idle process %d on core %d\n", proc->pid, coreId);
 }
 
-// Run scheduler to switch process
+// Run scheduler to switch process: run the next process of the running core's
+// run queue, a process stolen from another core if the queue is empty, or the
+// idle process
+// The run queue lock of the running core must be held: it is released by
+// switchUserProcess
 static void schedule() {
   uint64_t coreId = getCoreId();
   struct process *currentProcess = currentProcessArray[coreId];
-  struct process *nextProcess = NULL;
+  struct process *nextProcess = removeFromRunQueue(coreId);
 
-  if (isListEmpty(&readyProcessList)) {
-    // printk("CORE %d schedule: empty Ready Process List; run idle process\n",
-    //        coreId);
+  if (nextProcess == NULL && stealProcess(coreId)) {
+    nextProcess = removeFromRunQueue(coreId);
+  }
+  if (nextProcess == NULL) {
     if (currentProcess->pid == coreId) {
       printk("ERROR CORE %d schedule: idle process already running", coreId);
-      spinUnlock(&processLock);
+      spinUnlock(&runQueueArray[coreId].lock);
       KERNEL_PANIC(ERR_SCHEDULER);
     }
-    nextProcess = &processTable[coreId];
-  }
-
-  else {
-    nextProcess = (struct process *)removeListHead(&readyProcessList);
-    // printk("CORE %d: Scheduling Process %d from %d\n", coreId,
-    // nextProcess->pid,
-    //        currentProcess->pid);
+    nextProcess = &idleProcessArray[coreId];
   }
   // Set ring0 TSS stack pointer to per process stack
   tssArray[coreId].rsp0 =
@@ -341,71 +514,164 @@ static void schedule() {
   // Set ring0 syscall stack pointer to per process stack
   ring0SysCallStackPtrTable[coreId] =
       (nextProcess->ring0StackBasePtr + PAGE_SIZE / sizeof(uint64_t));
-  loadCR3((uint64_t)VADDR_TO_PADDR(nextProcess->pml4tPtr));
+  switchAddressSpace(nextProcess->pml4tPtr, &nextProcess->vmSpace);
 
   nextProcess->state = PROC_RUNNING;
+  nextProcess->coreId = coreId;
   currentProcessArray[coreId] = nextProcess;
   // For idle processes, the ring0 process context pointer points to an address
   // within the initial kernel stack // This function pushes the 6 x64
   // callee-saved registers onto the stack and thens sets the ring0 process
   // context pointer to rsp
   switchUserProcess(&(currentProcess->ring0ProcessContextPtr),
-                    nextProcess->ring0ProcessContextPtr);
+                    nextProcess->ring0ProcessContextPtr,
+                    &runQueueArray[coreId].lock);
+  // currentProcess resumed: free the address spaces released by the switches
+  // of this core now that its run queue lock is not held
+  freeReleasedAddressSpaces();
 }
 
-// Have current process yield and run scheduler
+// Have current process yield and run scheduler (called on each timer tick)
+// The running process is moved one priority level down when its quantum is
+// used up and keeps running if no process of higher priority is ready and its
+// quantum is not used up; if the running core's run queue is empty, a process
+// is stolen from another core when the running process has to be switched
 void yield() {
   uint64_t coreId = getCoreId();
-  spinLock(&processLock);
+  struct runQueue *runQueue = &runQueueArray[coreId];
+  spinLock(&runQueue->lock);
+  struct process *currentProcess = currentProcessArray[coreId];
+  int isIdleProcess = currentProcess->pid == coreId;
 
-  if (isListEmpty(&readyProcessList)) {
-    // printk("Yield on core %d: empty Ready ProcessList, ", coreId);
-    if (currentProcessArray[coreId]->pid != 0) {
-      //    printk("keep running Process %d\n",
-      //    currentProcessArray[coreId]->pid);
-    } else {
-      //     printk("keep running Idle Process (%d)\n",
-      //            currentProcessArray[coreId]->pid);
+  if (++runQueue->nTicksSinceBoost >= PRIORITY_BOOST_PERIOD_TICKS) {
+    runQueue->nTicksSinceBoost = 0;
+    boostRunQueue(coreId);
+    if (!isIdleProcess) {
+      setProcessPriority(currentProcess, currentProcess->nice);
     }
-    spinUnlock(&processLock);
+  }
+  int isQuantumUsedUp = 0;
+  if (!isIdleProcess && --currentProcess->nTicksLeft == 0) {
+    isQuantumUsedUp = 1;
+    setProcessPriority(currentProcess, currentProcess->priority + 1);
+  }
+
+  uint64_t highestReadyPriority = getHighestReadyPriority(coreId);
+  if (highestReadyPriority == N_PRIORITY_LEVELS &&
+      (isIdleProcess || isQuantumUsedUp) && stealProcess(coreId)) {
+    highestReadyPriority = getHighestReadyPriority(coreId);
+  }
+  if (highestReadyPriority == N_PRIORITY_LEVELS ||
+      (!isIdleProcess && !isQuantumUsedUp &&
+       highestReadyPriority >= currentProcess->priority)) {
+    spinUnlock(&runQueue->lock);
     return;
   }
-  struct process *currentProcess = currentProcessArray[coreId];
   currentProcess->state = PROC_READY;
 
-  // idle process is not added to Ready Process List
-  if (currentProcess->pid != coreId) {
-    appendToListTail(&readyProcessList, (struct ListNode *)currentProcess);
+  // idle process is not added to the run queue
+  if (!isIdleProcess) {
+    addToRunQueue(coreId, currentProcess);
   }
 
   schedule();
 }
 
-// Put process on eventWait list
-void sleep(enum processEvent eventWaitType) {
+// Put current process on waitQueue and release conditionLock
+// The caller holds conditionLock and has checked that the condition the
+// process waits for is false: a process making it true takes conditionLock
+// before waking waitQueue up, so the wake-up cannot be missed
+// The run queue lock is held until the process context is saved: a wake-up
+// cannot put the process back in the run queue before
+// Lock order: conditionLock, the run queue lock, then the wait queue lock
+void sleepOnWaitQueue(struct waitQueue *waitQueue,
+                      volatile uint8_t *conditionLock) {
   uint64_t coreId = getCoreId();
   struct process *currentProcess = currentProcessArray[coreId];
+  spinLock(&runQueueArray[coreId].lock);
   currentProcess->state = PROC_SLEEPING;
-  currentProcess->eventWaitType = eventWaitType;
-  spinLock(&processLock);
-  appendToListTail(&eventWaitProcessList, (struct ListNode *)currentProcess);
+  currentProcess->eventWaitType = waitQueue->eventType;
+  spinLock(&waitQueue->lock);
+  appendToListTail(&waitQueue->processList, (struct ListNode *)currentProcess);
+  spinUnlock(&waitQueue->lock);
+  spinUnlock(conditionLock);
   schedule();
 }
 
-// Wake up processes waiting on specific event (remove from eventWait list and
-// add to ready list) from sleeping state
-void wakeUp(enum processEvent eventWaitType) {
-  spinLock(&processLock);
-  struct process *proc = (struct process *)removeProcessWaitingForEventFromList(
-      &eventWaitProcessList, eventWaitType);
+// Put current process in the timer queue of the running core until tick
+// wakeUpTick of the core (see getTicks)
+// The run queue lock is held until the process context is saved: the timer
+// interrupt cannot put the process back in the run queue before
+void sleepUntilTick(uint64_t wakeUpTick) {
+  uint64_t coreId = getCoreId();
+  struct process *currentProcess = currentProcessArray[coreId];
+  spinLock(&runQueueArray[coreId].lock);
+  currentProcess->state = PROC_SLEEPING;
+  currentProcess->eventWaitType = TIMER_WAKEUP_EVENT;
+  currentProcess->wakeUpTick = wakeUpTick;
+  addToTimerQueue(coreId, currentProcess);
+  schedule();
+}
 
-  while (proc != NULL) {
+// Move processes of the running core's timer queue whose wake-up tick is not
+// after currentTick to the run queue of the core (called on each timer tick)
+// Only the head of the sorted queue is checked: a tick with no expired timer
+// costs one comparison and processLock is not taken
+void wakeUpExpiredTimers(uint64_t currentTick) {
+  uint64_t coreId = getCoreId();
+  struct ListHead *timerProcessList = &runQueueArray[coreId].timerProcessList;
+  spinLock(&runQueueArray[coreId].lock);
+  while (!isListEmpty(timerProcessList) &&
+         ((struct process *)timerProcessList->next)->wakeUpTick <=
+             currentTick) {
+    struct process *proc = (struct process *)removeListHead(timerProcessList);
     proc->state = PROC_READY;
-    appendToListTail(&readyProcessList, (struct ListNode *)proc);
-    proc = (struct process *)removeProcessWaitingForEventFromList(
-        &eventWaitProcessList, eventWaitType);
+    addToRunQueue(coreId, proc);
+  }
+  spinUnlock(&runQueueArray[coreId].lock);
+}
+
+// Add sleeping processes of processList to the run queue of the core they last
+// ran on
+// Processes woken up by keyboard input (interactive processes) are moved to
+// their top priority level, the others keep their level and quantum left
+static void wakeUpProcessList(struct ListHead *processList,
+                              enum processEvent eventType) {
+  struct process *proc = NULL;
+  while ((proc = (struct process *)removeListHead(processList)) != NULL) {
+    uint64_t coreId = proc->coreId;
+    spinLock(&runQueueArray[coreId].lock);
+    proc->state = PROC_READY;
+    if (eventType == KEYBOARD_EVENT) {
+      setProcessPriority(proc, proc->nice);
+    }
+    addToRunQueue(coreId, proc);
+    spinUnlock(&runQueueArray[coreId].lock);
   }
-  spinUnlock(&processLock);
+}
+
+// Wake up the process that has waited longest on waitQueue, if any
+void wakeUpOne(struct waitQueue *waitQueue) {
+  struct ListHead wokenUpProcessList = {NULL, NULL};
+  spinLock(&waitQueue->lock);
+  struct ListNode *proc = removeListHead(&waitQueue->processList);
+  spinUnlock(&waitQueue->lock);
+  if (proc != NULL) {
+    appendToListTail(&wokenUpProcessList, proc);
+    wakeUpProcessList(&wokenUpProcessList, waitQueue->eventType);
+  }
+}
+
+// Wake up all processes waiting on waitQueue
+// The whole list is detached at once: the wait queue lock is held for a
+// constant time and run queue locks are taken without holding it
+void wakeUpAll(struct waitQueue *waitQueue) {
+  spinLock(&waitQueue->lock);
+  struct ListHead wokenUpProcessList = waitQueue->processList;
+  waitQueue->processList.next = NULL;
+  waitQueue->processList.tail = NULL;
+  spinUnlock(&waitQueue->lock);
+  wakeUpProcessList(&wokenUpProcessList, waitQueue->eventType);
 }
 
 // Exit process
@@ -420,12 +686,27 @@ void exit() {
   appendToListTail(&killedProcessList, (struct ListNode *)currentProcess);
   spinUnlock(&processLock);
 
-  wakeUp(
-      PROC_EXIT_EVENT);  // wake up process that cleans up killed process list
-  spinLock(&processLock);
+  // wake up processes waiting for this pid to clean up the killed process list
+  wakeUpAll(getExitWaitQueue(currentProcess->pid));
+  spinLock(&runQueueArray[coreId].lock);
   schedule();
 }
 
+// Wait until the core that ran proc has switched to another process (its
+// run queue lock is held until the context of proc is saved, see schedule)
+static void waitUntilDescheduled(struct process *proc) {
+  uint64_t coreId = proc->coreId;
+  while (1) {
+    spinLock(&runQueueArray[coreId].lock);
+    int isRunning = currentProcessArray[coreId] == proc;
+    spinUnlock(&runQueueArray[coreId].lock);
+    if (!isRunning) {
+      return;
+    }
+    __asm volatile("pause" ::: "memory");
+  }
+}
+
 // Clean up killed process list
 void wait(int64_t pid) {
   while (1) {
@@ -445,6 +726,11 @@ void wait(int64_t pid) {
           spinUnlock(&processLock);
           KERNEL_PANIC(ERR_SCHEDULER);
         }
+        // The process is no longer on any list: release its resources without
+        // holding processLock so that the other cores can keep scheduling
+        // (once the exiting core has stopped using its ring0 stack)
+        spinUnlock(&processLock);
+        waitUntilDescheduled(proc);
         // free ring0 stack (1 4KB page)
         // printk("Free ring0 stack\n");
         int64_t errCode = kFreePage((uint64_t)proc->ring0StackBasePtr);
@@ -453,11 +739,11 @@ void wait(int64_t pid) {
               "ERROR CORE %d wait(), kFreePage: freeing process ring0 stack "
               "page failed\n",
               coreId);
-          spinUnlock(&processLock);
           KERNEL_PANIC(errCode);
         }
-        // free process page table
-        freeVM(proc->pml4tPtr, proc->processTotalSize);
+        // drop shared memory segment attachments and free process page table
+        kDetachSharedMemory(&proc->vmSpace);
+        freeVM(proc->pml4tPtr);
 
         // clean up File Descriptor pointer array
         for (int i = 0; i < 0; i++) {
@@ -474,18 +760,17 @@ void wait(int64_t pid) {
           }
         }
 
-        // zero out struct process
+        // zero out struct process (constructed state) and return it to the
+        // process cache
         // notice: PROC_UNUSED = 0
         memset(proc, 0, sizeof(struct process));
-        spinUnlock(&processLock);
+        kmemCacheFree(processCache, proc);
         break;
       } else {
-        spinUnlock(&processLock);
-        sleep(PROC_EXIT_EVENT);
+        sleepOnWaitQueue(getExitWaitQueue(pid), &processLock);
       }
     } else {
-      spinUnlock(&processLock);
-      sleep(PROC_EXIT_EVENT);
+      sleepOnWaitQueue(getExitWaitQueue(pid), &processLock);
     }
   }
 }
@@ -506,26 +791,33 @@ int64_t fork(uint64_t rsp, uint64_t rbp, uint64_t rip, uint64_t rflags) {
     return -1;
   }
 
-  printk("fork: copyUserSpaceVM %d\n", currentProcess->processTotalSize);
+  printk("fork: copyUserSpaceVM (copy-on-write) %d\n",
+         currentProcess->processTotalSize);
+
+  // pages not populated yet are populated in the child on first access
+  memcpy(newProcess->vmSpace.areaArray, currentProcess->vmSpace.areaArray,
+         sizeof(currentProcess->vmSpace.areaArray));
+  newProcess->vmSpace.brk = currentProcess->vmSpace.brk;
 
   errCode = copyUserSpaceVM(newProcess->pml4tPtr, currentProcess->pml4tPtr,
-                            (uint64_t *)USER_PROGRAM_COUNTER,
-                            currentProcess->processTotalSize);
+                            &currentProcess->vmSpace);
 
   if (errCode != SUCCESS) {
+    // out of memory for the child page tables: fail the fork
+    // copyUserSpaceVM added no segment attachment and freeVM releases the
+    // pages mapped so far
     printk("ERROR fork: copyUserSpaceVM failed\n");
     spinUnlock(&processLock);
-    freeVM(newProcess->pml4tPtr, DEFAULT_TOTAL_PROCESS_SIZE);
-    KERNEL_PANIC(ERR_PROCESS);
+    freeVM(newProcess->pml4tPtr);
+    errCode = kFreePage((uint64_t)newProcess->ring0StackBasePtr);
+    if (errCode != SUCCESS) {
+      printk("ERROR fork: kFreePage for ring0 stack failed\n");
+      KERNEL_PANIC(errCode);
+    }
+    memset(newProcess, 0, sizeof(struct process));
+    kmemCacheFree(processCache, newProcess);
+    return -1;
   }
-  // Make sure PML4T entry has user mode flag set up as it is most likely set
-  // to 0 (supervisor mode) by kSetupVM when mapping LAPIC and IOAPIC
-  // addresses, which are normally < 4GB and therefore less than 512GB
-
-  uint64_t PML4TEntryIndex =
-      VADDR_TO_PML4T_INDEX((uint64_t)USER_PROGRAM_COUNTER);
-  newProcess->pml4tPtr[PML4TEntryIndex] |= PAGE_DIRECTORY_ENTRY_U;
-
   newProcess->processTotalSize = currentProcess->processTotalSize;
 
   memcpy(newProcess->fileDescPtrArray, currentProcess->fileDescPtrArray,
@@ -554,19 +846,50 @@ int64_t fork(uint64_t rsp, uint64_t rbp, uint64_t rip, uint64_t rflags) {
   newProcess->intFramePtr->rip = rip;
   newProcess->intFramePtr->rflags = rflags;
 
-  appendToListTail(&readyProcessList, (struct ListNode *)newProcess);
+  // the child starts at the top priority level of the parent
+  newProcess->nice = currentProcess->nice;
+  setProcessPriority(newProcess, newProcess->nice);
+
+  int64_t newPid = newProcess->pid;
   spinUnlock(&processLock);
 
-  return newProcess->pid;
+  // placing the child on a run queue does not need processLock
+  uint64_t newCoreId = selectCoreForNewProcess();
+  spinLock(&runQueueArray[newCoreId].lock);
+  addToRunQueue(newCoreId, newProcess);
+  spinUnlock(&runQueueArray[newCoreId].lock);
+
+  return newPid;
+}
+
+// Add increment to the nice value of the running process and return the new
+// nice value
+// Only the running core changes the priority of its running process: no lock
+// is needed
+int64_t nice(int64_t increment) {
+  struct process *currentProcess = currentProcessArray[getCoreId()];
+  int64_t niceValue = (int64_t)currentProcess->nice + increment;
+  if (niceValue < 0) {
+    niceValue = 0;
+  }
+  if (niceValue >= N_PRIORITY_LEVELS) {
+    niceValue = N_PRIORITY_LEVELS - 1;
+  }
+  currentProcess->nice = niceValue;
+  if (currentProcess->priority < currentProcess->nice) {
+    setProcessPriority(currentProcess, currentProcess->nice);
+  }
+  return niceValue;
 }
 
 // Execute program loaded from input file
+// fileName must be a kernel space buffer
 int64_t exec(struct process *proc, char *fileName) {
-  int64_t size;
+  uint16_t fileClusterIndex = 0;
+  uint32_t size = 0;
   uint64_t coreId = getCoreId();
-  int64_t fileDescIndex = openFile(proc, fileName);
 
-  if (fileDescIndex == -1) {
+  if (lookupFile(fileName, &fileClusterIndex, &size) != 0) {
     printk("ERROR exec core %d: could not read file\n", coreId);
     // before calling functions that call schedule, make sure to clear
     // syscallRunningArray for current core as syscall will not be running after
@@ -577,19 +900,6 @@ int64_t exec(struct process *proc, char *fileName) {
     syscallRunningArray[getCoreId()] = 1;
   }
 
-  size = getFileSize(proc, fileDescIndex);
-
-  if (size == -1) {
-    printk("ERROR exec core %d: getFileSize failed\n", coreId);
-    // before calling functions that call schedule, make sure to clear
-    // syscallRunningArray for current core as syscall will not be running after
-    // schedule is called
-    syscallRunningArray[getCoreId()] = 0;
-    exit();
-    // syscall is running now
-    syscallRunningArray[getCoreId()] = 1;
-  }
-
   if (size > (DEFAULT_TOTAL_PROCESS_SIZE - PAGE_SIZE)) {
     printk("ERROR exec core %d: file size can be at most %d bytes\n", coreId,
            DEFAULT_TOTAL_PROCESS_SIZE - PAGE_SIZE);
@@ -603,15 +913,13 @@ int64_t exec(struct process *proc, char *fileName) {
   }
 
   printk("exec: loading file %s (%d bytes)\n", fileName, size);
-  // Zero out process memory
-  memset((void *)USER_PROGRAM_COUNTER, 0, proc->processTotalSize);
-
-  // Read file content
-  int64_t bytesRead =
-      readFile(proc, fileDescIndex, (void *)USER_PROGRAM_COUNTER, size);
-
-  if (bytesRead < 0) {
-    printk("ERROR exec core %d: file content read failed\n", coreId);
+  // Drop the old image, heap and mappings (pages still shared copy-on-write
+  // with the parent process are only unreferenced): the new image is populated
+  // on first access
+  kClearUserSpaceVM(proc->pml4tPtr, &proc->vmSpace);
+  if (initUserSpaceVM(&proc->vmSpace, fileClusterIndex, size,
+                      DEFAULT_TOTAL_PROCESS_SIZE) != SUCCESS) {
+    printk("ERROR exec core %d: setting up process memory failed\n", coreId);
     // before calling functions that call schedule, make sure to clear
     // syscallRunningArray for current core as syscall will not be running after
     // schedule is called
@@ -620,18 +928,8 @@ int64_t exec(struct process *proc, char *fileName) {
     // syscall is running now
     syscallRunningArray[getCoreId()] = 1;
   }
+  proc->processTotalSize = DEFAULT_TOTAL_PROCESS_SIZE;
 
-  int64_t status = closeFile(proc, fileDescIndex);
-  if (status != 0) {
-    printk("ERROR exec core %d: file close failed\n", coreId);
-    // before calling functions that call schedule, make sure to clear
-    // syscallRunningArray for current core as syscall will not be running after
-    // schedule is called
-    syscallRunningArray[getCoreId()] = 0;
-    exit();
-    // syscall is running now
-    syscallRunningArray[getCoreId()] = 1;
-  }
   // Zero out interrupt frame
   memset(proc->intFramePtr, 0, sizeof(struct interruptFrame));
 
@@ -655,3 +953,73 @@ int64_t exec(struct process *proc, char *fileName) {
                                    // of process virtual address space
   return 0;
 }
+
+// Add memory usage of user process proc to stats (processes already in stats
+// are skipped: a process that is exiting can be both running and on the
+// killed process list)
+// The lock of the list holding proc (or of the run queue of the core running
+// it) must be held
+static void addProcessMemoryStats(struct memoryStats *stats,
+                                  struct process *proc) {
+  if (proc == NULL || (proc >= idleProcessArray &&
+                       proc < idleProcessArray + MAX_N_CORES_SUPPORTED)) {
+    return;
+  }
+  for (uint64_t i = 0; i < stats->nProcesses; i++) {
+    if (stats->processArray[i].pid == proc->pid) {
+      return;
+    }
+  }
+  if (stats->nProcesses == MAX_N_MEMORY_STATS_PROCESSES) {
+    return;
+  }
+  struct processMemoryStats *procStats =
+      &stats->processArray[stats->nProcesses++];
+  procStats->pid = proc->pid;
+  procStats->state = proc->state;
+  procStats->nRing0StackPages = STACK_SIZE / PAGE_SIZE;
+  getUserSpaceMemoryStats(proc->pml4tPtr, procStats);
+}
+
+// Add memory usage of the processes of list to stats
+// The lock of list must be held
+static void addProcessListMemoryStats(struct memoryStats *stats,
+                                      struct ListHead *list) {
+  for (struct ListNode *curr = list->next; curr != NULL; curr = curr->next) {
+    addProcessMemoryStats(stats, (struct process *)curr);
+  }
+}
+
+// Add the processes sleeping on waitQueue to stats
+static void addWaitQueueMemoryStats(struct memoryStats *stats,
+                                    struct waitQueue *waitQueue) {
+  spinLock(&waitQueue->lock);
+  addProcessListMemoryStats(stats, &waitQueue->processList);
+  spinUnlock(&waitQueue->lock);
+}
+
+// Fill in the process entries of stats: running, ready, waiting and killed
+// (not yet waited for) user processes
+void getProcessMemoryStats(struct memoryStats *stats) {
+  stats->nProcesses = 0;
+  // page tables of a process are freed only after it is removed from the
+  // killed process list (see wait)
+  // a core does not switch process while its run queue lock is held
+  for (int i = 0; i < acpiNCores; i++) {
+    spinLock(&runQueueArray[i].lock);
+    addProcessMemoryStats(stats, currentProcessArray[i]);
+    for (int priority = 0; priority < N_PRIORITY_LEVELS; priority++) {
+      addProcessListMemoryStats(
+          stats, &runQueueArray[i].readyProcessListArray[priority]);
+    }
+    addProcessListMemoryStats(stats, &runQueueArray[i].timerProcessList);
+    spinUnlock(&runQueueArray[i].lock);
+  }
+  addWaitQueueMemoryStats(stats, &keyboardWaitQueue);
+  for (int i = 0; i < N_EXIT_WAIT_QUEUES; i++) {
+    addWaitQueueMemoryStats(stats, &exitWaitQueueArray[i]);
+  }
+  spinLock(&processLock);
+  addProcessListMemoryStats(stats, &killedProcessList);
+  spinUnlock(&processLock);
+}
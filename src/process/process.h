@@ -23,7 +23,6 @@
 #include "../memory/memory.h"  // page size
 
 #define STACK_SIZE PAGE_SIZE  // 4KB
-#define MAX_N_PROCESSES 128
 #define USER_PROGRAM_COUNTER 0x400000
 #define PROC_RFLAGS \
   0x202  // set reserved bit to 1 (0x2) and enable interrupts(0x200)
@@ -32,6 +31,17 @@
 
 #define MAX_N_FILES_PER_PROCESS 100
 
+// Multi-level feedback queue (MLFQ) scheduling: a ready process waits in the
+// run queue of its priority level (0: highest) and the highest level runs
+// first; a process that uses up its quantum is moved one level down (longer
+// quantum), a process woken up by keyboard input goes back to its top level
+// and all ready processes of a core go back to their top level every
+// PRIORITY_BOOST_PERIOD_TICKS ticks (no starvation)
+// The nice value of a process (0 to N_PRIORITY_LEVELS - 1) is its top level
+#define N_PRIORITY_LEVELS 4
+#define BASE_QUANTUM_TICKS 1  // quantum of level 0, doubled at each level
+#define PRIORITY_BOOST_PERIOD_TICKS 100
+
 enum processState {
   PROC_UNUSED,
   PROC_INIT,
@@ -61,11 +71,29 @@ enum processEvent {
   KEYBOARD_EVENT = -4
 };
 
+// Wait queue: processes sleeping until an event of one source occurs (see
+// sleepOnWaitQueue), oldest first
+// A zeroed wait queue is empty; eventType is only used to give processes woken
+// up by keyboard input their top priority level
+struct waitQueue {
+  volatile uint8_t lock;
+  struct ListHead processList;
+  enum processEvent eventType;
+};
+
+#define WAIT_QUEUE_INITIALIZER(event) \
+  { 0, {NULL, NULL}, event }
+
 struct process {
   struct ListNode *next;            // Pointer to next process struct
   int64_t pid;                      // Process identifier
   enum processEvent eventWaitType;  // Type of event the process is waiting for
   enum processState state;          // Process state
+  uint64_t coreId;  // Core running the process or whose run queue holds it
+  uint64_t priority;    // MLFQ level (0: highest)
+  uint64_t nice;        // Highest MLFQ level the process can be given
+  uint64_t nTicksLeft;  // Ticks left in the quantum of the process
+  uint64_t wakeUpTick;  // Tick of its core a sleeping process wakes up at
   uint64_t *pml4tPtr;               // Page table pointer
   uint64_t *ring0StackBasePtr;  // Kernel mode / ring0 pointer to stack area:
                                 // [ring0StackPtr, ring0StackPtr + STACK_SIZE [
@@ -73,6 +101,8 @@ struct process {
   struct ring0ProcessContext
       *ring0ProcessContextPtr;  // Pointer to ring0ProcessContext struct
   uint64_t processTotalSize;    // Total process size (normally code + stack)
+  struct vmSpace vmSpace;       // User space virtual memory areas and page
+                                // fault counters
   struct fileDescriptor
       *fileDescPtrArray[MAX_N_FILES_PER_PROCESS];  // Array of file descriptor
                                                    // pointers for open files
@@ -83,12 +113,22 @@ void initStartupProcesses();
 // Start idle process on core calling this function
 void startIdleProcess();
 // process functions
-// process: yield
+// process: yield (called on each timer tick): switch process if the quantum
+// of the running process is used up or a higher priority process is ready
 void yield();
-// process: sleep until eventWaitType event occurs
-void sleep(enum processEvent eventWaitType);
-// wake up all processes waiting on eventWaitType event
-void wakeUp(enum processEvent eventWaitType);
+// process: put current process on waitQueue and release conditionLock (held
+// by the caller while checking the condition the process waits for)
+void sleepOnWaitQueue(struct waitQueue *waitQueue,
+                      volatile uint8_t *conditionLock);
+// process: sleep until tick wakeUpTick of the running core (see getTicks)
+void sleepUntilTick(uint64_t wakeUpTick);
+// process: wake up processes of the running core whose wake-up tick is not
+// after currentTick (called on each timer tick)
+void wakeUpExpiredTimers(uint64_t currentTick);
+// wake up the process that has waited longest on waitQueue
+void wakeUpOne(struct waitQueue *waitQueue);
+// wake up all processes waiting on waitQueue
+void wakeUpAll(struct waitQueue *waitQueue);
 // Exit process
 void exit();
 // Clean up killed process list
@@ -96,6 +136,13 @@ void wait();
 // Fork new process as copy of  current process
 // Returns non-negative pid if succesful, negative value otherwise
 int64_t fork(uint64_t rsp, uint64_t rbp, uint64_t rip, uint64_t rflags);
-// Execute program loaded from input file
+// Add increment to the nice value of the running process (the result is
+// clamped to [0, N_PRIORITY_LEVELS - 1]) and return the new nice value
+int64_t nice(int64_t increment);
+// Execute program loaded from input file (fileName must be a kernel space
+// buffer): program pages are read from the file on first access
 int64_t exec(struct process *proc, char *fileName);
+// Fill in the process entries of stats (RSS, page tables and ring0 stack of
+// each user process)
+void getProcessMemoryStats(struct memoryStats *stats);
 #endif
@@ -13,6 +13,7 @@
 
 global spinLock
 global spinUnlock
+global spinTryLock
 global spinLockCli
 global spinUnlockSti
 
@@ -37,6 +38,19 @@ spinLock:
         jnz .spin		; keep trying
         ret
  
+; uint64_t spinTryLock(uint8_t * lockAddress): acquire the lock if it is free
+; returns 1 if the lock was acquired, 0 if it is held
+spinTryLock:
+	mov dl, 1
+	xor rax, rax
+	lock cmpxchg byte [rdi], dl
+	jnz .busy
+	mov rax, 1
+	ret
+.busy:
+	xor rax, rax
+	ret
+
 ; void spinUnlock(uint8_t * lockAddress)
 spinUnlock:
 	xor rax, rax
@@ -19,13 +19,17 @@
 #include "../gdt/gdt.h"          // TSS
 #include "../idt/idt.h"          // getTicks
 #include "../kernel.h"           // SUCCESS
-#include "../lib/lib.h"          // memset
-#include "../memory/memory.h"    // kAllocPage, getMemorySize
+#include "../lib/lib.h"          // memset, memcpy, strncpy
+#include "../memory/memory.h"    // getMemorySize, kBrk, kShmGet, kShmRemove
 #include "../process/process.h"  // sleep
 #include "../stdio/stdio.h"      // printk
 #include "../vga/vga.h"          // printBuffer
 #include "drivers/keyboard.h"    // readFromKeyboardQueue
 
+// FAT16 file name: name, dot, extension and terminating null character
+#define FILE_NAME_BUFFER_SIZE \
+  (FAT16_FILENAME_SIZE + FAT16_FILE_EXTENSION_SIZE + 2)
+
 void printRsp(uint64_t rsp) { printk("RSP %x\n", rsp); }
 
 // Array of TSSs; one per CPU core; ../gdt/gdt.c
@@ -58,20 +62,22 @@ static uint64_t sysPrintBuffer(char *buffer, size_t size, char color) {
 }
 
 // Sleep for nTicks ticks (timer interrupts)
+// The process waits in the timer queue of the running core until the tick
+// count of the core reaches its deadline
 static uint64_t sysSleep(uint64_t sleepTicks) {
-  uint64_t previousTicks = getTicks();
-  uint64_t currentTicks = previousTicks;
-
-  while (currentTicks - previousTicks < sleepTicks) {
-    // before calling functions that call schedule, make sure to clear
-    // syscallRunningArray for current core as syscall will not be running after
-    // schedule is called
-    syscallRunningArray[getCoreId()] = 0;
-    sleep(TIMER_WAKEUP_EVENT);
-    // syscall is running now
-    syscallRunningArray[getCoreId()] = 1;
-    currentTicks = getTicks();
+  if (sleepTicks == 0) {
+    return 0;
   }
+  // interrupts are disabled: the deadline and the timer queue belong to the
+  // same core
+  uint64_t wakeUpTick = getTicks() + sleepTicks;
+  // before calling functions that call schedule, make sure to clear
+  // syscallRunningArray for current core as syscall will not be running after
+  // schedule is called
+  syscallRunningArray[getCoreId()] = 0;
+  sleepUntilTick(wakeUpTick);
+  // syscall is running now
+  syscallRunningArray[getCoreId()] = 1;
   return 0;
 }
 
@@ -107,8 +113,19 @@ static char sysReadCharFromKeyboardQueue() { return readFromKeyboardQueue(); }
 // Return total size of system  physical memory
 static uint64_t sysGetMemorySize() { return getMemorySize(); }
 
+// Copy null-terminated file name from user space into kernel buffer name
+// (FILE_NAME_BUFFER_SIZE bytes) so that FAT16 functions do not access user
+// pages while holding fat16Lock: the page fault handler takes fat16Lock to
+// read file-backed pages
+static void copyFileNameFromUser(char *name, char *userName) {
+  strncpy(name, userName, FILE_NAME_BUFFER_SIZE - 1);
+  name[FILE_NAME_BUFFER_SIZE - 1] = '\0';
+}
+
 // Open file given input name and return file descriptor index
-static int64_t sysOpenFile(char *name) {
+static int64_t sysOpenFile(char *userName) {
+  char name[FILE_NAME_BUFFER_SIZE];
+  copyFileNameFromUser(name, userName);
   return openFile(currentProcessArray[getCoreId()], name);
 }
 
@@ -116,8 +133,13 @@ static int64_t sysOpenFile(char *name) {
 // input file descriptor index and return number of bytes read
 static int64_t sysReadFile(int64_t fileDescriptorIndex, uint8_t *fileBuffer,
                            size_t size) {
-  return readFile(currentProcessArray[getCoreId()], fileDescriptorIndex,
-                  fileBuffer, size);
+  struct process *proc = currentProcessArray[getCoreId()];
+  // populate destination pages before fat16Lock is taken
+  if (kPrefaultUserPages(&proc->vmSpace, (uint64_t)fileBuffer, size, 1) !=
+      SUCCESS) {
+    return -1;
+  }
+  return readFile(proc, fileDescriptorIndex, fileBuffer, size);
 }
 
 // Close file given input file descriptor index
@@ -138,16 +160,132 @@ static int64_t sysFork(uint64_t rsp, uint64_t rbp, uint64_t rip,
 }
 
 // Execute program from input file
-static int64_t sysExec(char *fileName) {
+static int64_t sysExec(char *userFileName) {
+  char fileName[FILE_NAME_BUFFER_SIZE];
+  copyFileNameFromUser(fileName, userFileName);
   return exec(currentProcessArray[getCoreId()], fileName);
 }
 
 // Copies FAT16 root directory entries into input buffer and returns number of
 // entries
 static int64_t sysGetRootDirectory(struct fat16DirEntry *rootDirEntryBuffer) {
+  // populate destination pages before fat16Lock is taken
+  if (kPrefaultUserPages(&currentProcessArray[getCoreId()]->vmSpace,
+                         (uint64_t)rootDirEntryBuffer,
+                         MAX_SUPPORTED_FAT16_ROOT_DIR_ENTRIES *
+                             sizeof(struct fat16DirEntry),
+                         1) != SUCCESS) {
+    return -1;
+  }
   return getRootDirectory(rootDirEntryBuffer);
 }
 
+// Copies page fault counters of the current process into input buffer
+static int64_t sysGetPageFaultStats(struct vmStats *vmStatsBuffer) {
+  memcpy(vmStatsBuffer, &currentProcessArray[getCoreId()]->vmSpace.stats,
+         sizeof(struct vmStats));
+  return 0;
+}
+
+// Copies TLB counters (all cores) into input buffer
+static int64_t sysGetTLBStats(struct tlbStats *tlbStatsBuffer) {
+  getTLBStats(tlbStatsBuffer);
+  return 0;
+}
+
+// Copies a snapshot of memory usage (per owner and per process) into input
+// buffer
+static int64_t sysGetMemoryStats(struct memoryStats *memoryStatsBuffer) {
+  // populate destination pages before processLock is taken
+  if (kPrefaultUserPages(&currentProcessArray[getCoreId()]->vmSpace,
+                         (uint64_t)memoryStatsBuffer,
+                         sizeof(struct memoryStats), 1) != SUCCESS) {
+    return -1;
+  }
+  getMemoryStats(memoryStatsBuffer);
+  getProcessMemoryStats(memoryStatsBuffer);
+  return 0;
+}
+
+// Add increment to the nice value of current process and return the new nice
+// value
+static int64_t sysNice(int64_t increment) { return nice(increment); }
+
+// Returns average CPU cycles taken by nTargetCores other cores to invalidate
+// nPages pages (TLB shootdown benchmark), -1 if fewer cores are online
+static int64_t sysBenchmarkTLBShootdown(uint64_t nTargetCores, uint64_t nPages,
+                                        uint64_t batched) {
+  return benchmarkTLBShootdown(nTargetCores, nPages, batched);
+}
+
+// Set program break (end of heap) of current process and return the new
+// program break (the current one if it could not be changed)
+static uint64_t sysBrk(uint64_t brk) {
+  struct vmSpace *vmSpacePtr = &currentProcessArray[getCoreId()]->vmSpace;
+  if (brk == 0) {
+    return vmSpacePtr->brk;
+  }
+  return kBrk(vmSpacePtr, brk);
+}
+
+// Grow (or shrink) heap of current process by increment bytes and return the
+// previous program break, -1 if it failed
+static int64_t sysSbrk(int64_t increment) {
+  struct vmSpace *vmSpacePtr = &currentProcessArray[getCoreId()]->vmSpace;
+  uint64_t brk = vmSpacePtr->brk;
+  if (kBrk(vmSpacePtr, brk + increment) != brk + increment) {
+    return -1;
+  }
+  return brk;
+}
+
+// Map anonymous zero-filled memory in current process and return its address,
+// -1 if it failed
+static int64_t sysMmap(uint64_t vAddr, uint64_t length, uint64_t prot,
+                       uint64_t flags) {
+  uint64_t mapAddr = kMmap(&currentProcessArray[getCoreId()]->vmSpace, vAddr,
+                           length, prot, flags);
+  return mapAddr != 0 ? (int64_t)mapAddr : -1;
+}
+
+// Unmap anonymous memory in current process
+static int64_t sysMunmap(uint64_t vAddr, uint64_t length) {
+  if (kMunmap(&currentProcessArray[getCoreId()]->vmSpace, vAddr, length) !=
+      SUCCESS) {
+    return -1;
+  }
+  return 0;
+}
+
+// Return id of the shared memory segment with given key, creating a segment of
+// size bytes if there is none, -1 if it failed
+static int64_t sysShmGet(uint64_t key, uint64_t size) {
+  int64_t shmId = kShmGet(key, size);
+  return shmId >= 0 ? shmId : -1;
+}
+
+// Attach shared memory segment to current process and return its address, -1
+// if it failed
+static int64_t sysShmAttach(uint64_t shmId, uint64_t vAddr, uint64_t prot) {
+  uint64_t mapAddr = kShmAttach(&currentProcessArray[getCoreId()]->vmSpace,
+                                shmId, vAddr, prot);
+  return mapAddr != 0 ? (int64_t)mapAddr : -1;
+}
+
+// Detach shared memory segment attached at vAddr from current process
+static int64_t sysShmDetach(uint64_t vAddr) {
+  if (kShmDetach(&currentProcessArray[getCoreId()]->vmSpace, vAddr) !=
+      SUCCESS) {
+    return -1;
+  }
+  return 0;
+}
+
+// Remove shared memory segment shmId (freed once no process has it attached)
+static int64_t sysShmRemove(uint64_t shmId) {
+  return kShmRemove(shmId) == SUCCESS ? 0 : -1;
+}
+
 // Array of TSSs; one per CPU core
 uint64_t *ring0SysCallStackPtrTable[MAX_N_CORES_SUPPORTED];
 
@@ -163,7 +301,20 @@ void *systemCallTable[N_SYSCALLS] = {(void *)sysPrintBuffer,
                                      (void *)sysGetFileSize,
                                      (void *)sysFork,
                                      (void *)sysExec,
-                                     (void *)sysGetRootDirectory};
+                                     (void *)sysGetRootDirectory,
+                                     (void *)sysGetPageFaultStats,
+                                     (void *)sysBrk,
+                                     (void *)sysSbrk,
+                                     (void *)sysMmap,
+                                     (void *)sysMunmap,
+                                     (void *)sysGetTLBStats,
+                                     (void *)sysBenchmarkTLBShootdown,
+                                     (void *)sysShmGet,
+                                     (void *)sysShmAttach,
+                                     (void *)sysShmDetach,
+                                     (void *)sysGetMemoryStats,
+                                     (void *)sysNice,
+                                     (void *)sysShmRemove};
 
 void initSystemCalls() {
   // Set per-core ring0 syscall stack to tss rsp0 (ring0 interrupt) stack
@@ -16,7 +16,7 @@
 
 #include <stdint.h>
 
-#define N_SYSCALLS 13
+#define N_SYSCALLS 26
 
 void initSystemCalls();
 void systemCall(uint64_t sysCallNumber);
@@ -0,0 +1,56 @@
+/*
+ * Copyright 2024 Andrea Miele
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stdio.h"
+
+// TLB shootdown benchmark: for each number of target cores (1 to the number of
+// other online cores), report the average number of CPU cycles (time stamp
+// counter) taken by the target cores to invalidate N pages, with the pages
+// sent in one IPI per core (batched) or in one IPI per core for each page
+// Run with QEMU -smp 2 to -smp 16 to cover all core counts
+
+#define N_PAGE_COUNTS 4
+
+// 64 pages exceed the shootdown batch size: the whole TLB is flushed
+static uint64_t pageCountArray[N_PAGE_COUNTS] = {1, 8, 32, 64};
+
+// Returns average cycles per shootdown, -1 if fewer than nTargetCores other
+// cores are online (kernel benchmarkTLBShootdown)
+extern int64_t benchmarkTLBShootdown(uint64_t nTargetCores, uint64_t nPages,
+                                     uint64_t batched);
+
+int main() {
+  if (benchmarkTLBShootdown(1, 1, 1) < 0) {
+    printf("TLB shootdown benchmark: at least 2 cores are needed\n");
+    return -1;
+  }
+  printf("TLB shootdown benchmark: cycles per shootdown (batched/per page)\n");
+  for (uint64_t nTargetCores = 1;; nTargetCores++) {
+    int64_t cycles = benchmarkTLBShootdown(nTargetCores, 1, 1);
+    if (cycles < 0) {
+      break;
+    }
+    printf("%u target cores:", nTargetCores);
+    for (int i = 0; i < N_PAGE_COUNTS; i++) {
+      uint64_t nPages = pageCountArray[i];
+      printf(" %u pages %u/%u", nPages,
+             benchmarkTLBShootdown(nTargetCores, nPages, 1),
+             benchmarkTLBShootdown(nTargetCores, nPages, 0));
+    }
+    printf("\n");
+  }
+  return 0;
+}
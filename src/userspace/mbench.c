@@ -0,0 +1,112 @@
+/*
+ * Copyright 2024 Andrea Miele
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stdio.h"
+#include "stdlib.h"
+
+// malloc benchmark: for each size distribution, run N_OPERATIONS random
+// malloc/free operations on N_SLOTS live allocations and report the average
+// number of CPU cycles (time stamp counter) per operation
+
+#define N_SLOTS 256
+#define N_OPERATIONS 200000
+#define N_DISTRIBUTIONS 5
+
+struct sizeDistribution {
+  char *name;
+  size_t minSize;
+  size_t maxSize;
+};
+
+static struct sizeDistribution distributionArray[N_DISTRIBUTIONS] = {
+    {"fixed 32B", 32, 32},
+    {"small 16B-256B", 16, 256},
+    {"medium 16B-2KB", 16, 2048},
+    {"large 4KB-64KB", 4096, 65536},
+    {"mixed 16B-512KB", 16, 512 * 1024}};
+
+static void *slotArray[N_SLOTS];
+
+static uint64_t randomState = 88172645463325252ULL;
+
+// xorshift64 pseudo-random number generator
+static uint64_t nextRandom() {
+  randomState ^= randomState << 13;
+  randomState ^= randomState >> 7;
+  randomState ^= randomState << 17;
+  return randomState;
+}
+
+// Returns random size of distribution d; sizes of the mixed distribution are
+// mostly small with a few large and very large (mmap) requests
+static size_t randomSize(struct sizeDistribution *d) {
+  uint64_t r = nextRandom();
+  if (d->maxSize > 65536) {
+    uint64_t kind = r % 100;
+    if (kind < 90) {
+      return 16 + (r >> 8) % 512;
+    } else if (kind < 99) {
+      return 4096 + (r >> 8) % 65536;
+    }
+  }
+  return d->minSize + (r >> 8) % (d->maxSize - d->minSize + 1);
+}
+
+static void runDistribution(struct sizeDistribution *d) {
+  uint64_t nFailed = 0;
+  uint64_t start = readTimeStampCounter();
+  for (uint64_t i = 0; i < N_OPERATIONS; i++) {
+    uint64_t slot = nextRandom() % N_SLOTS;
+    if (slotArray[slot] != NULL) {
+      free(slotArray[slot]);
+      slotArray[slot] = NULL;
+    } else {
+      slotArray[slot] = malloc(randomSize(d));
+      if (slotArray[slot] == NULL) {
+        nFailed++;
+      } else {
+        *(uint8_t *)slotArray[slot] = 1;  // touch first page
+      }
+    }
+  }
+  for (int i = 0; i < N_SLOTS; i++) {
+    free(slotArray[i]);
+    slotArray[i] = NULL;
+  }
+  uint64_t cycles = readTimeStampCounter() - start;
+  printf("%s: %u cycles/operation, %u failed allocations\n", d->name,
+         cycles / N_OPERATIONS, nFailed);
+}
+
+int main() {
+  struct mallocStats stats;
+
+  printf("malloc benchmark: %u operations, %u live slots\n", N_OPERATIONS,
+         N_SLOTS);
+  for (int i = 0; i < N_DISTRIBUTIONS; i++) {
+    runDistribution(&distributionArray[i]);
+  }
+
+  getMallocStats(&stats);
+  printf(
+      "mallocs: %u, frees: %u, bump allocations: %u, small reuses: %u, large "
+      "reuses: %u, coalesces: %u, mmap allocations: %u\n",
+      stats.nMallocs, stats.nFrees, stats.nBumpAllocs, stats.nSmallReuses,
+      stats.nLargeReuses, stats.nCoalesces, stats.nMmapAllocs);
+  printf("heap size: %u KB, peak bytes in use: %u KB\n", stats.heapSize / 1024,
+         stats.peakBytesInUse / 1024);
+  return 0;
+}
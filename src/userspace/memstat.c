@@ -0,0 +1,97 @@
+/*
+ * Copyright 2024 Andrea Miele
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stdio.h"
+
+// Memory usage report: physical pages per owner (kernel image, page tables,
+// ring0 stacks, user pages, file system, slab caches), usage of the kernel
+// window (first GB of physical memory), 2MB user page usage and RSS, shared
+// pages, page table overhead and 2MB pages of each process
+
+#define N_PAGE_TAGS 6
+#define MAX_N_MEMORY_STATS_PROCESSES 32
+#define PAGE_SIZE_KB 4
+
+// Per-process memory usage (struct processMemoryStats in
+// src/memory/memory.h)
+struct processMemoryStats {
+  int64_t pid;
+  uint64_t state;
+  uint64_t nResidentPages;
+  uint64_t nSharedPages;
+  uint64_t nPageTablePages;
+  uint64_t nRing0StackPages;
+  uint64_t nHugePages;
+};
+
+// System memory usage in pages (struct memoryStats in src/memory/memory.h)
+struct memoryStats {
+  uint64_t nTotalPages;
+  uint64_t nFreePages;
+  uint64_t nKernelZonePages;
+  uint64_t nKernelZoneFreePages;
+  uint64_t nKernelImagePages;
+  uint64_t nTaggedPagesArray[N_PAGE_TAGS];
+  uint64_t nHugePageFaults;
+  uint64_t nHugePageFallbacks;
+  uint64_t nHugePageSplits;
+  uint64_t nProcesses;
+  struct processMemoryStats processArray[MAX_N_MEMORY_STATS_PROCESSES];
+};
+extern int64_t getMemoryStats(struct memoryStats *stats);
+
+// PAGE_TAG_* order (src/memory/memory.h)
+static char *tagNameArray[N_PAGE_TAGS] = {"kernel",     "page tables",
+                                          "ring0 stacks", "user pages",
+                                          "file system", "slab caches"};
+
+// enum processState order (src/process/process.h)
+static char *stateNameArray[] = {"unused",   "init",     "ready",
+                                 "running",  "sleeping", "killed"};
+
+static struct memoryStats stats;
+
+int main() {
+  if (getMemoryStats(&stats) != 0) {
+    printf("memstat: getMemoryStats failed\n");
+    return -1;
+  }
+  printf("Memory: %uKB total, %uKB free, kernel image %uKB\n",
+         stats.nTotalPages * PAGE_SIZE_KB, stats.nFreePages * PAGE_SIZE_KB,
+         stats.nKernelImagePages * PAGE_SIZE_KB);
+  printf("Kernel window (first GB): %uKB managed, %uKB used\n",
+         stats.nKernelZonePages * PAGE_SIZE_KB,
+         (stats.nKernelZonePages - stats.nKernelZoneFreePages) * PAGE_SIZE_KB);
+  for (int i = 0; i < N_PAGE_TAGS; i++) {
+    printf(" %s: %uKB\n", tagNameArray[i],
+           stats.nTaggedPagesArray[i] * PAGE_SIZE_KB);
+  }
+  printf("2MB user pages: %u populated, %u 4KB fallbacks, %u split\n",
+         stats.nHugePageFaults, stats.nHugePageFallbacks,
+         stats.nHugePageSplits);
+  printf(
+      "PID  STATE     RSS(KB)  SHARED(KB)  PAGE TABLES(KB)  RING0(KB)  "
+      "2MB PAGES\n");
+  for (uint64_t i = 0; i < stats.nProcesses; i++) {
+    struct processMemoryStats *proc = &stats.processArray[i];
+    printf("%d  %s  %u  %u  %u  %u  %u\n", proc->pid,
+           stateNameArray[proc->state], proc->nResidentPages * PAGE_SIZE_KB,
+           proc->nSharedPages * PAGE_SIZE_KB,
+           proc->nPageTablePages * PAGE_SIZE_KB,
+           proc->nRing0StackPages * PAGE_SIZE_KB, proc->nHugePages);
+  }
+  return 0;
+}
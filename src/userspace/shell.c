@@ -25,18 +25,62 @@ extern int64_t openFile(char *fileName);
 extern int64_t exec(char *fileName);
 extern int64_t closeFile(int64_t fileDescriptorIndex);
 
+// Page fault counters of a process (struct vmStats in src/memory/memory.h)
+struct pageFaultStats {
+  uint64_t nZeroFillFaults;
+  uint64_t nFileFaults;
+  uint64_t nCoWFaults;
+};
+extern int64_t getPageFaultStats(struct pageFaultStats *stats);
+
+// TLB counters of all cores (struct tlbStats in src/memory/memory.h)
+struct tlbStats {
+  uint64_t nFlushSwitches;
+  uint64_t nNoFlushSwitches;
+  uint64_t nLazySwitches;
+  uint64_t nSkippedSwitches;
+  uint64_t nFullFlushes;
+  uint64_t nPageInvalidations;
+  uint64_t nShootdowns;
+  uint64_t nShootdownIPIs;
+  uint64_t pcidEnabled;
+};
+extern int64_t getTLBStats(struct tlbStats *stats);
+
 #define COMMAND_BUFFER_SIZE 80
-#define N_COMMANDS 1
+#define N_COMMANDS 3
 
-char *commandStrings[N_COMMANDS] = {"sysmem"};
-size_t commandStringSizes[N_COMMANDS] = {6};
+char *commandStrings[N_COMMANDS] = {"sysmem", "faults", "tlb"};
+size_t commandStringSizes[N_COMMANDS] = {6, 6, 3};
 
 // SHELL COMMAND FUNCTIONS
 void getMemorySizeCmd() {
   printf("Total system memory: %u MB\n", getMemorySize() / (1024 * 1024));
 }
 
-static void *commandFunctions[N_COMMANDS] = {(void *)getMemorySizeCmd};
+void getPageFaultStatsCmd() {
+  struct pageFaultStats stats = {0};
+  getPageFaultStats(&stats);
+  printf("Shell page faults: zero-fill: %u, file: %u, copy-on-write: %u\n",
+         stats.nZeroFillFaults, stats.nFileFaults, stats.nCoWFaults);
+}
+
+void getTLBStatsCmd() {
+  struct tlbStats stats = {0};
+  getTLBStats(&stats);
+  printf("PCID: %s\n", stats.pcidEnabled ? "enabled" : "not available");
+  printf(
+      "Address space switches: flushing TLB: %u, keeping TLB: %u, lazy "
+      "(idle): %u, skipped (same page table): %u\n"
+      "TLB flushes: %u, page invalidations: %u, shootdowns: %u (IPIs: %u)\n",
+      stats.nFlushSwitches, stats.nNoFlushSwitches, stats.nLazySwitches,
+      stats.nSkippedSwitches, stats.nFullFlushes, stats.nPageInvalidations,
+      stats.nShootdowns, stats.nShootdownIPIs);
+}
+
+static void *commandFunctions[N_COMMANDS] = {(void *)getMemorySizeCmd,
+                                             (void *)getPageFaultStatsCmd,
+                                             (void *)getTLBStatsCmd};
 
 static size_t readCommand(char *commandBuffer) {
   char cs[2] = {0};
@@ -62,9 +106,12 @@ static size_t readCommand(char *commandBuffer) {
 
 static int parseCommand(char *commandBuffer, uint64_t commandStringSize) {
   int command = -1;
-  if (commandStringSize == commandStringSizes[0] &&
-      memCompare(commandBuffer, commandStrings[0], commandStringSizes[0])) {
-    command = 0;
+  for (int i = 0; i < N_COMMANDS; i++) {
+    if (commandStringSize == commandStringSizes[i] &&
+        memCompare(commandBuffer, commandStrings[i], commandStringSizes[i])) {
+      command = i;
+      break;
+    }
   }
   return command;
 }
@@ -104,14 +151,8 @@ int main() {
           }
         }
       }
-    } else {
-      switch (command) {
-        case 0:
-          ((void (*)())(commandFunctions[0]))();
-          break;
-        default:
-          break;
-      }
+    } else if (command < N_COMMANDS) {
+      ((void (*)())(commandFunctions[command]))();
     }
   }
   return 0;
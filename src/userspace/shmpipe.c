@@ -0,0 +1,113 @@
+/*
+ * Copyright 2024 Andrea Miele
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stdio.h"
+#include "stdlib.h"
+
+// Shared memory pipeline: the child process (producer) writes N_MESSAGES
+// messages to a ring buffer in a shared memory segment and the parent process
+// (consumer) reads them in place, with no copy through the kernel
+// Reports the checksum of the received data and the average number of CPU
+// cycles (time stamp counter) per message
+
+#define SHM_KEY 0x5348
+#define N_SLOTS 64
+#define MESSAGE_SIZE 1024
+#define N_MESSAGES 100000
+
+extern int64_t fork();
+extern void exit();
+extern void pwait(int64_t pid);
+
+// Single-producer single-consumer ring buffer: head is written only by the
+// producer and tail only by the consumer
+struct ringBuffer {
+  volatile uint64_t head;  // messages written
+  volatile uint64_t tail;  // messages read
+  uint8_t slotArray[N_SLOTS][MESSAGE_SIZE];
+};
+
+static void produce(struct ringBuffer *ring) {
+  for (uint64_t i = 0; i < N_MESSAGES; i++) {
+    while (i - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == N_SLOTS) {
+      __asm__ volatile("pause");
+    }
+    uint8_t *slot = ring->slotArray[i % N_SLOTS];
+    for (uint64_t j = 0; j < MESSAGE_SIZE; j++) {
+      slot[j] = (uint8_t)(i + j);
+    }
+    __atomic_store_n(&ring->head, i + 1, __ATOMIC_RELEASE);
+  }
+}
+
+// Returns the sum of all the bytes received
+static uint64_t consume(struct ringBuffer *ring) {
+  uint64_t checksum = 0;
+  for (uint64_t i = 0; i < N_MESSAGES; i++) {
+    while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == i) {
+      __asm__ volatile("pause");
+    }
+    uint8_t *slot = ring->slotArray[i % N_SLOTS];
+    for (uint64_t j = 0; j < MESSAGE_SIZE; j++) {
+      checksum += slot[j];
+    }
+    __atomic_store_n(&ring->tail, i + 1, __ATOMIC_RELEASE);
+  }
+  return checksum;
+}
+
+int main() {
+  int64_t shmId = shmget(SHM_KEY, sizeof(struct ringBuffer));
+  if (shmId < 0) {
+    printf("shmpipe: shmget failed\n");
+    return -1;
+  }
+  struct ringBuffer *ring = shmat(shmId, NULL, PROT_READ | PROT_WRITE);
+  if (ring == MAP_FAILED) {
+    printf("shmpipe: shmat failed\n");
+    shmrm(shmId);
+    return -1;
+  }
+  // the segment is freed once both processes have detached it
+  shmrm(shmId);
+  ring->head = 0;
+  ring->tail = 0;
+
+  // the child inherits the attachment: both processes map the same pages
+  uint64_t start = readTimeStampCounter();
+  int64_t pid = fork();
+  if (pid == 0) {
+    produce(ring);
+    shmdt(ring);
+    exit();
+  }
+  uint64_t checksum = consume(ring);
+  uint64_t cycles = readTimeStampCounter() - start;
+  pwait(pid);
+
+  uint64_t expectedChecksum = 0;
+  for (uint64_t i = 0; i < N_MESSAGES; i++) {
+    for (uint64_t j = 0; j < MESSAGE_SIZE; j++) {
+      expectedChecksum += (uint8_t)(i + j);
+    }
+  }
+  printf("shmpipe: %u messages of %u bytes, checksum %s, %u cycles/message\n",
+         N_MESSAGES, MESSAGE_SIZE,
+         checksum == expectedChecksum ? "OK" : "MISMATCH",
+         cycles / N_MESSAGES);
+  shmdt(ring);
+  return 0;
+}
@@ -58,3 +58,340 @@ void memset(void *ptr, int c, size_t size) {
     d8[i] = c;
   }
 }
+
+// Read the CPU time stamp counter (cycles)
+uint64_t readTimeStampCounter() {
+  uint32_t low;
+  uint32_t high;
+  __asm__ volatile("rdtsc" : "=a"(low), "=d"(high));
+  return ((uint64_t)high << 32) | low;
+}
+
+///*** MALLOC ***///
+// Blocks are carved from the heap (grown with sbrk) and start with a 16-byte
+// header holding the size of the previous block and the block size (header
+// included, multiple of 16) with the BLOCK_* flags in the low bits, so that
+// payloads are 16-byte aligned
+// - Small blocks (at most SMALL_MAX_BLOCK_SIZE bytes) are rounded up to one of
+//   N_SMALL_CLASSES size classes and recycled through one LIFO free list per
+//   class; they are never split or coalesced
+// - Large blocks are kept in free lists binned by power of two and are split
+//   and coalesced with free neighbouring large blocks and with the top of the
+//   heap, which is returned to the kernel when it grows past HEAP_TRIM_SIZE
+// - Blocks of at least MMAP_THRESHOLD bytes are mapped with mmap and unmapped
+//   when freed
+// If the free list of a size class is empty blocks are carved from the top of
+// the heap by bumping the top pointer (fast path)
+// Processes are single-threaded: there is no locking
+
+#define BLOCK_HEADER_SIZE 16
+#define BLOCK_ALIGNMENT 16
+#define BLOCK_IN_USE 1   // allocated or in a small size class free list
+#define BLOCK_MMAPPED 2  // mapped with mmap
+#define BLOCK_FLAGS_MASK (BLOCK_ALIGNMENT - 1)
+
+// Small size classes: 32 to 256 bytes in steps of 16, 384 to 2048 bytes in
+// steps of 128
+#define SMALL_FINE_MAX_BLOCK_SIZE 256
+#define SMALL_MAX_BLOCK_SIZE 2048
+#define N_SMALL_CLASSES           \
+  (SMALL_FINE_MAX_BLOCK_SIZE / 16 - 1 + \
+   (SMALL_MAX_BLOCK_SIZE - SMALL_FINE_MAX_BLOCK_SIZE) / 128)
+
+// Large free block bins: bin i holds blocks of [2^(i + 11), 2^(i + 12)[ bytes
+#define N_LARGE_BINS 20
+#define LARGE_BIN_MIN_SHIFT 11
+
+#define MMAP_THRESHOLD (256 * 1024)
+#define USER_SPACE_SIZE 0xC0000000ULL  // user space ends at 3GB
+#define HEAP_GROW_SIZE (64 * 1024)
+#define HEAP_TRIM_SIZE (256 * 1024)
+
+struct blockHeader {
+  uint64_t prevSize;  // size of the previous block, 0 for the first block
+  uint64_t size;      // block size and BLOCK_* flags
+};
+
+// Large free block, linked in its bin
+struct freeLargeBlock {
+  struct blockHeader header;
+  struct freeLargeBlock *next;
+  struct freeLargeBlock *prev;
+};
+
+static void *smallFreeLists[N_SMALL_CLASSES];
+static struct freeLargeBlock *largeBins[N_LARGE_BINS];
+static uint8_t *heapTop;           // first byte not used by blocks
+static uint8_t *heapEnd;           // program break
+static uint64_t heapTopPrevSize;   // size of the block right below heapTop
+static struct mallocStats stats;
+
+#define BLOCK_SIZE(block) ((block)->size & ~(uint64_t)BLOCK_FLAGS_MASK)
+#define PAYLOAD_TO_BLOCK(ptr) \
+  ((struct blockHeader *)((uint8_t *)(ptr)-BLOCK_HEADER_SIZE))
+#define BLOCK_TO_PAYLOAD(block) \
+  ((void *)((uint8_t *)(block) + BLOCK_HEADER_SIZE))
+
+// Returns block size (header included) for a request of size bytes
+static uint64_t requestToBlockSize(size_t size) {
+  uint64_t blockSize = (size + BLOCK_HEADER_SIZE + BLOCK_ALIGNMENT - 1) &
+                       ~(uint64_t)(BLOCK_ALIGNMENT - 1);
+  return blockSize < 2 * BLOCK_HEADER_SIZE ? 2 * BLOCK_HEADER_SIZE : blockSize;
+}
+
+// Returns small size class index of a block of blockSize bytes and sets
+// classSize to the size of the blocks of the class
+static int smallClassIndex(uint64_t blockSize, uint64_t *classSize) {
+  if (blockSize <= SMALL_FINE_MAX_BLOCK_SIZE) {
+    *classSize = blockSize;
+    return blockSize / 16 - 2;
+  }
+  int index = (blockSize - SMALL_FINE_MAX_BLOCK_SIZE + 127) / 128;
+  *classSize = SMALL_FINE_MAX_BLOCK_SIZE + index * 128;
+  return SMALL_FINE_MAX_BLOCK_SIZE / 16 - 2 + index;
+}
+
+// Returns large bin index of a free block of blockSize bytes
+static int largeBinIndex(uint64_t blockSize) {
+  int index = 63 - __builtin_clzll(blockSize) - LARGE_BIN_MIN_SHIFT;
+  return index < N_LARGE_BINS ? index : N_LARGE_BINS - 1;
+}
+
+// Set size of block and update the previous block size of the next block
+static void setBlockSize(struct blockHeader *block, uint64_t size,
+                         uint64_t flags) {
+  block->size = size | flags;
+  uint8_t *next = (uint8_t *)block + size;
+  if (next == heapTop) {
+    heapTopPrevSize = size;
+  } else {
+    ((struct blockHeader *)next)->prevSize = size;
+  }
+}
+
+static void insertLargeBlock(struct freeLargeBlock *block) {
+  int index = largeBinIndex(BLOCK_SIZE(&block->header));
+  block->prev = NULL;
+  block->next = largeBins[index];
+  if (largeBins[index] != NULL) {
+    largeBins[index]->prev = block;
+  }
+  largeBins[index] = block;
+}
+
+static void removeLargeBlock(struct freeLargeBlock *block) {
+  if (block->prev != NULL) {
+    block->prev->next = block->next;
+  } else {
+    largeBins[largeBinIndex(BLOCK_SIZE(&block->header))] = block->next;
+  }
+  if (block->next != NULL) {
+    block->next->prev = block->prev;
+  }
+}
+
+// Carve a block of blockSize bytes from the top of the heap, growing the heap
+// if needed
+static struct blockHeader *allocFromTop(uint64_t blockSize) {
+  if (heapTop == NULL) {
+    heapTop = heapEnd = brk(NULL);
+  }
+  if (heapTop + blockSize > heapEnd) {
+    uint64_t growSize = heapTop + blockSize - heapEnd;
+    growSize =
+        (growSize + HEAP_GROW_SIZE - 1) & ~(uint64_t)(HEAP_GROW_SIZE - 1);
+    if (sbrk(growSize) == MAP_FAILED) {
+      return NULL;
+    }
+    heapEnd += growSize;
+    stats.heapSize += growSize;
+  }
+  struct blockHeader *block = (struct blockHeader *)heapTop;
+  block->prevSize = heapTopPrevSize;
+  heapTop += blockSize;
+  setBlockSize(block, blockSize, BLOCK_IN_USE);
+  stats.nBumpAllocs++;
+  return block;
+}
+
+// Return the top of the heap to the kernel if it is larger than HEAP_TRIM_SIZE
+static void trimHeap() {
+  uint64_t topSize = heapEnd - heapTop;
+  if (topSize <= HEAP_TRIM_SIZE) {
+    return;
+  }
+  uint64_t trimSize =
+      (topSize - HEAP_GROW_SIZE) & ~(uint64_t)(HEAP_GROW_SIZE - 1);
+  if (sbrk(-(int64_t)trimSize) != MAP_FAILED) {
+    heapEnd -= trimSize;
+    stats.heapSize -= trimSize;
+  }
+}
+
+// Allocate large block of at least blockSize bytes: first fit in the bins,
+// splitting the block found, or from the top of the heap
+static struct blockHeader *allocLarge(uint64_t blockSize) {
+  for (int i = largeBinIndex(blockSize); i < N_LARGE_BINS; i++) {
+    for (struct freeLargeBlock *free = largeBins[i]; free != NULL;
+         free = free->next) {
+      uint64_t freeSize = BLOCK_SIZE(&free->header);
+      if (freeSize < blockSize) {
+        continue;
+      }
+      removeLargeBlock(free);
+      struct blockHeader *block = &free->header;
+      if (freeSize - blockSize > SMALL_MAX_BLOCK_SIZE) {  // split
+        struct freeLargeBlock *rest =
+            (struct freeLargeBlock *)((uint8_t *)block + blockSize);
+        setBlockSize(block, blockSize, BLOCK_IN_USE);
+        setBlockSize(&rest->header, freeSize - blockSize, 0);
+        insertLargeBlock(rest);
+      } else {
+        setBlockSize(block, freeSize, BLOCK_IN_USE);
+      }
+      stats.nLargeReuses++;
+      return block;
+    }
+  }
+  return allocFromTop(blockSize);
+}
+
+// Free large block, coalescing it with free neighbouring blocks and with the
+// top of the heap
+static void freeLarge(struct blockHeader *block) {
+  uint64_t size = BLOCK_SIZE(block);
+  if (block->prevSize != 0) {
+    struct blockHeader *prev =
+        (struct blockHeader *)((uint8_t *)block - block->prevSize);
+    if (!(prev->size & BLOCK_IN_USE)) {
+      removeLargeBlock((struct freeLargeBlock *)prev);
+      size += BLOCK_SIZE(prev);
+      block = prev;
+      stats.nCoalesces++;
+    }
+  }
+  uint8_t *next = (uint8_t *)block + size;
+  if (next == heapTop) {
+    heapTop = (uint8_t *)block;
+    heapTopPrevSize = block->prevSize;
+    trimHeap();
+    return;
+  }
+  if (!(((struct blockHeader *)next)->size & BLOCK_IN_USE)) {
+    removeLargeBlock((struct freeLargeBlock *)next);
+    size += BLOCK_SIZE((struct blockHeader *)next);
+    stats.nCoalesces++;
+    if ((uint8_t *)block + size == heapTop) {
+      heapTop = (uint8_t *)block;
+      heapTopPrevSize = block->prevSize;
+      trimHeap();
+      return;
+    }
+  }
+  setBlockSize(block, size, 0);
+  insertLargeBlock((struct freeLargeBlock *)block);
+}
+
+// Allocate size bytes (16-byte aligned), NULL if it failed
+void *malloc(size_t size) {
+  struct blockHeader *block = NULL;
+  if (size > USER_SPACE_SIZE) {
+    return NULL;
+  }
+  uint64_t blockSize = requestToBlockSize(size);
+
+  if (size >= MMAP_THRESHOLD) {
+    blockSize = (blockSize + 4095) & ~4095ULL;
+    block = mmap(NULL, blockSize, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS);
+    if (block == MAP_FAILED) {
+      return NULL;
+    }
+    block->prevSize = 0;
+    block->size = blockSize | BLOCK_IN_USE | BLOCK_MMAPPED;
+    stats.nMmapAllocs++;
+  } else if (blockSize <= SMALL_MAX_BLOCK_SIZE) {
+    uint64_t classSize = 0;
+    int index = smallClassIndex(blockSize, &classSize);
+    if (smallFreeLists[index] != NULL) {
+      void *ptr = smallFreeLists[index];
+      smallFreeLists[index] = *(void **)ptr;
+      block = PAYLOAD_TO_BLOCK(ptr);
+      stats.nSmallReuses++;
+    } else {
+      block = allocFromTop(classSize);
+    }
+  } else {
+    block = allocLarge(blockSize);
+  }
+  if (block == NULL) {
+    return NULL;
+  }
+
+  stats.nMallocs++;
+  stats.bytesInUse += BLOCK_SIZE(block);
+  if (stats.bytesInUse > stats.peakBytesInUse) {
+    stats.peakBytesInUse = stats.bytesInUse;
+  }
+  return BLOCK_TO_PAYLOAD(block);
+}
+
+// Free memory allocated by malloc, calloc or realloc
+void free(void *ptr) {
+  if (ptr == NULL) {
+    return;
+  }
+  struct blockHeader *block = PAYLOAD_TO_BLOCK(ptr);
+  uint64_t blockSize = BLOCK_SIZE(block);
+  stats.nFrees++;
+  stats.bytesInUse -= blockSize;
+
+  if (block->size & BLOCK_MMAPPED) {
+    munmap(block, blockSize);
+  } else if (blockSize <= SMALL_MAX_BLOCK_SIZE) {
+    uint64_t classSize = 0;
+    int index = smallClassIndex(blockSize, &classSize);
+    *(void **)ptr = smallFreeLists[index];
+    smallFreeLists[index] = ptr;
+  } else {
+    freeLarge(block);
+  }
+}
+
+// Allocate zeroed array of n elements of size bytes
+void *calloc(size_t n, size_t size) {
+  if (size != 0 && n > ((size_t)-1) / size) {
+    return NULL;
+  }
+  void *ptr = malloc(n * size);
+  if (ptr != NULL) {
+    memset(ptr, 0, n * size);
+  }
+  return ptr;
+}
+
+// Resize allocation, moving it if it does not fit in place
+void *realloc(void *ptr, size_t size) {
+  if (ptr == NULL) {
+    return malloc(size);
+  }
+  if (size == 0) {
+    free(ptr);
+    return NULL;
+  }
+  uint64_t usableSize = BLOCK_SIZE(PAYLOAD_TO_BLOCK(ptr)) - BLOCK_HEADER_SIZE;
+  if (size <= usableSize) {
+    return ptr;
+  }
+  void *newPtr = malloc(size);
+  if (newPtr != NULL) {
+    memcpy(newPtr, ptr, usableSize);
+    free(ptr);
+  }
+  return newPtr;
+}
+
+// Copy allocator statistics into input struct
+void getMallocStats(struct mallocStats *mallocStatsPtr) {
+  memcpy(mallocStatsPtr, &stats, sizeof(struct mallocStats));
+}
@@ -15,11 +15,80 @@
 #define _STDLIB_H_
 
 #include <stddef.h>
+#include <stdint.h>
+
+// mmap protection and flags
+#define PROT_READ 1
+#define PROT_WRITE 2
+#define MAP_PRIVATE 2
+#define MAP_ANONYMOUS 0x20
+#define MAP_FAILED ((void *)-1)
+
+// Syscalls
+// Set program break (end of heap) to addr and return the new program break
+// (the current one if it could not be changed, brk(0) returns the current one)
+extern void *brk(void *addr);
+// Move program break by increment bytes and return the previous one
+// (MAP_FAILED if it failed)
+extern void *sbrk(int64_t increment);
+// Map length bytes of zero-filled memory (flags: MAP_PRIVATE | MAP_ANONYMOUS)
+// at addr if possible (addr is a hint) and return its address (MAP_FAILED if it
+// failed)
+extern void *mmap(void *addr, size_t length, int prot, int flags);
+// Unmap pages in [addr, addr + length[ mapped by mmap; returns 0 if successful
+extern int64_t munmap(void *addr, size_t length);
+// Return id of the shared memory segment with given key, creating a segment of
+// size bytes if there is none (-1 if it failed)
+extern int64_t shmget(uint64_t key, size_t size);
+// Attach shared memory segment shmId at addr if possible (addr is a hint) and
+// return its address (MAP_FAILED if it failed); prot: PROT_READ and optionally
+// PROT_WRITE
+// All processes attached to a segment (and their children) share its pages
+extern void *shmat(int64_t shmId, void *addr, int prot);
+// Detach the shared memory segment attached at addr; returns 0 if successful
+// The segment is freed when its last process detaches it (or exits)
+extern int64_t shmdt(void *addr);
+// Remove shared memory segment shmId: its key can be reused and it cannot be
+// attached anymore; it is freed once no process has it attached (returns 0
+// if successful)
+extern int64_t shmrm(int64_t shmId);
+// Add increment to the nice value of the calling process (clamped to [0, 3])
+// and return the new nice value: a process with nice value n is never
+// scheduled above priority level n (0: highest)
+extern int64_t nice(int64_t increment);
+
 // Returns 1 if two buffer are equal, 0 otherwise
 int memCompare(char *bufferA, char *bufferB, size_t size);
 // Copy size bytes from src to dest
 void memcpy(void *dest, void *src, size_t size);
 // Set size bytes starting at ptr to (char) c
 void memset(void *ptr, int c, size_t size);
+// Read the CPU time stamp counter (cycles)
+uint64_t readTimeStampCounter();
+
+// Allocator statistics
+struct mallocStats {
+  uint64_t nMallocs;        // successful allocations
+  uint64_t nFrees;          // frees
+  uint64_t nBumpAllocs;     // blocks carved from the top of the heap
+  uint64_t nSmallReuses;    // small blocks reused from size class free lists
+  uint64_t nLargeReuses;    // large blocks reused from free bins
+  uint64_t nCoalesces;      // large free blocks merged with a neighbour
+  uint64_t nMmapAllocs;     // blocks mapped with mmap
+  uint64_t heapSize;        // bytes obtained with sbrk
+  uint64_t bytesInUse;      // bytes in allocated blocks (headers included)
+  uint64_t peakBytesInUse;  // largest value of bytesInUse
+};
+
+// Allocate size bytes (16-byte aligned), NULL if it failed
+void *malloc(size_t size);
+// Free memory allocated by malloc, calloc or realloc
+void free(void *ptr);
+// Allocate zeroed array of n elements of size bytes
+void *calloc(size_t n, size_t size);
+// Resize allocation, moving it if it does not fit in place
+void *realloc(void *ptr, size_t size);
+// Copy allocator statistics into input struct
+void getMallocStats(struct mallocStats *mallocStatsPtr);
 
 #endif
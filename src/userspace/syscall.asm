@@ -26,6 +26,19 @@ global getFileSize
 global fork
 global exec
 global getRootDirEntries
+global getPageFaultStats
+global brk
+global sbrk
+global mmap
+global munmap
+global getTLBStats
+global benchmarkTLBShootdown
+global shmget
+global shmat
+global shmdt
+global getMemoryStats
+global nice
+global shmrm
 
 section .asm
 ; Long Mode
@@ -151,3 +164,107 @@ getRootDirEntries:
         mov r8, 0
 	mov r9, 0
         jmp sysCall
+getPageFaultStats:
+        mov rsi, rdi			; input buffer
+        mov rdi, 13			; getPageFaultStats syscall index
+        mov rdx, 0
+	mov rcx, 0
+        mov r8, 0
+	mov r9, 0
+        jmp sysCall
+brk:
+        mov rsi, rdi			; new program break
+        mov rdi, 14			; brk syscall index
+        mov rdx, 0
+	mov rcx, 0
+        mov r8, 0
+	mov r9, 0
+        jmp sysCall
+sbrk:
+        mov rsi, rdi			; increment
+        mov rdi, 15			; sbrk syscall index
+        mov rdx, 0
+	mov rcx, 0
+        mov r8, 0
+	mov r9, 0
+        jmp sysCall
+mmap:
+        mov r8, rcx			; flags
+        mov rcx, rdx			; prot
+        mov rdx, rsi			; length
+        mov rsi, rdi			; address
+        mov rdi, 16			; mmap syscall index
+	mov r9, 0
+        jmp sysCall
+munmap:
+        mov rdx, rsi			; length
+        mov rsi, rdi			; address
+        mov rdi, 17			; munmap syscall index
+	mov rcx, 0
+        mov r8, 0
+	mov r9, 0
+        jmp sysCall
+getTLBStats:
+        mov rsi, rdi			; input buffer
+        mov rdi, 18			; getTLBStats syscall index
+        mov rdx, 0
+	mov rcx, 0
+        mov r8, 0
+	mov r9, 0
+        jmp sysCall
+benchmarkTLBShootdown:
+        mov rcx, rdx			; batched
+        mov rdx, rsi			; number of pages
+        mov rsi, rdi			; number of target cores
+        mov rdi, 19			; benchmarkTLBShootdown syscall index
+        mov r8, 0
+	mov r9, 0
+        jmp sysCall
+shmget:
+        mov rdx, rsi			; size
+        mov rsi, rdi			; key
+        mov rdi, 20			; shmget syscall index
+	mov rcx, 0
+        mov r8, 0
+	mov r9, 0
+        jmp sysCall
+shmat:
+        mov rcx, rdx			; prot
+        mov rdx, rsi			; address
+        mov rsi, rdi			; segment id
+        mov rdi, 21			; shmat syscall index
+        mov r8, 0
+	mov r9, 0
+        jmp sysCall
+shmdt:
+        mov rsi, rdi			; address
+        mov rdi, 22			; shmdt syscall index
+        mov rdx, 0
+	mov rcx, 0
+        mov r8, 0
+	mov r9, 0
+        jmp sysCall
+getMemoryStats:
+        mov rsi, rdi			; input buffer
+        mov rdi, 23			; getMemoryStats syscall index
+        mov rdx, 0
+	mov rcx, 0
+        mov r8, 0
+	mov r9, 0
+        jmp sysCall
+nice:
+        mov rsi, rdi			; increment
+        mov rdi, 24			; nice syscall index
+        mov rdx, 0
+	mov rcx, 0
+        mov r8, 0
+	mov r9, 0
+        jmp sysCall
+shmrm:
+        mov rsi, rdi			; segment id
+        mov rdi, 25			; shmrm syscall index
+        mov rdx, 0
+	mov rcx, 0
+        mov r8, 0
+	mov r9, 0
+        jmp sysCall